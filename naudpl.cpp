@@ -1,5 +1,6 @@
 // Because netcat is garbage at listening on UDP
-
+// Binary vision telemetry (see src/TelemetryProtocol.hpp) is decoded and printed as text; anything else is passed through as-is.
+// Build: g++ -O2 -std=c++17 -Isrc -o naudpl naudpl.cpp src/TelemetryProtocol.cpp
 
 
 #include <iostream>
@@ -10,10 +11,30 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <cstdio>
+
+#include "TelemetryProtocol.hpp"
 
 using std::cout; using std::cerr; using std::endl;
 
 
+bool rawMode = false;
+
+void printTelemetry(const telemetry::Packet& packet) {
+	if (packet.drawOnly) printf("#%u captured %.3f s latency %.1f ms, draw only\n", packet.sequence, packet.captureTimeUs / 1e6, packet.latencyUs / 1e3);
+	else printf("#%u captured %.3f s latency %.1f ms, %u targets\n", packet.sequence, packet.captureTimeUs / 1e6, packet.latencyUs / 1e3, packet.targetCount);
+	for (unsigned int i = 0; i < packet.targetCount; ++i) {
+		const telemetry::Target& target = packet.targets[i];
+		printf("  distance=%f tapeAngle=%f robotAngle=%f confidence=%.2f\n", target.distance, target.tapeAngle, target.robotAngle, target.confidence);
+	}
+	if (packet.hasDrawPoints) {
+		printf("  draw points:");
+		for (unsigned int i = 0; i < packet.drawPointCount; ++i) printf(" (%.1f, %.1f)", packet.drawPoints[i].x, packet.drawPoints[i].y);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
 void daSocket(int port) {
 	
 	
@@ -46,8 +67,11 @@ void daSocket(int port) {
 		char buf[66537];
 		ssize_t recieveSize = recvfrom(sockfd, buf, sizeof(buf) - 1,
 		0, nullptr, nullptr);
-		if (recieveSize > 0) {
-			
+		telemetry::Packet packet;
+		if (recieveSize > 0 && !rawMode && telemetry::decode((const uint8_t*) buf, recieveSize, packet)) {
+			printTelemetry(packet);
+		}
+		else if (recieveSize > 0) {
 			write(STDOUT_FILENO, buf, recieveSize);
 		}
 		else if (recieveSize < 0) {
@@ -58,12 +82,17 @@ void daSocket(int port) {
 }
 
 void usageAndExit() {
-	cerr << "Non-ass-udp-listener: Listens for all udp packets sent to specified port, sending it to stdout. Because netcat is garbage at that.\nUsage: naudpl <port>" << endl;
+	cerr << "Non-ass-udp-listener: Listens for all udp packets sent to specified port, sending it to stdout. Because netcat is garbage at that.\n"
+	"Vision telemetry packets are decoded, unless -r is given.\nUsage: naudpl [-r] <port>" << endl;
 	exit(1);
 }
 
 int main(int argc, const char * argv[]) {
 	
+	if (argc >= 2 && strcmp(argv[1], "-r") == 0) {
+		rawMode = true;
+		++argv; --argc;
+	}
 	if (argc < 2) usageAndExit();
 	int port = atoi(argv[1]);
 	if (port <= 0) usageAndExit();
@@ -0,0 +1,224 @@
+// Stand-in for the driver station's RTP receiver, for testing the stream without gStreamer.
+// Run it on the pi itself to test over loopback: ./rtpstat localhost
+// It sends receiver reports to the pi's control port every second, so it also tests the adaptive bitrate (-l simulates packet loss).
+// start_streaming.sh runs it for the reports, with -f passing the stream on to GStreamer, since they can't both have the port.
+// Build: g++ -O2 -std=c++17 -pthread -o rtpstat rtpstat.cpp
+
+#include <iostream>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <unistd.h>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+using std::cout; using std::cerr; using std::endl;
+
+int connectTcp(const char* addr, const char* port) {
+	struct addrinfo* addrs;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int error = getaddrinfo(addr, port, &hints, &addrs);
+	if (error != 0) {
+		cerr << "getaddrinfo: " << gai_strerror(error) << endl;
+		exit(1);
+	}
+	int fd = -1;
+	for (struct addrinfo* rp = addrs; rp != nullptr; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (fd == -1) continue;
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if (fd == -1) {
+		cerr << "Could not connect to " << addr << ":" << port << endl;
+		exit(1);
+	}
+	return fd;
+}
+
+// A UDP socket sending to port on this machine
+int connectLocalUdp(int port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1 || connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+		perror("Could not forward");
+		exit(1);
+	}
+	return fd;
+}
+
+// Prints everything the pi sends on fd
+void forwardToStderr(int fd, const char* prefix) {
+	std::thread([fd, prefix]() {
+		char buf[4096];
+		ssize_t len;
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			write(STDERR_FILENO, prefix, strlen(prefix));
+			write(STDERR_FILENO, buf, len);
+		}
+		cerr << prefix << "Connection to pi closed" << endl;
+	}).detach();
+}
+
+// Connects to the pi's launch port and sends the bitrate, like start_streaming.sh does, then prints what the pi sends back.
+void requestStream(const char* piAddr, int bitrate) {
+	int fd = connectTcp(piAddr, "5807");
+	std::string bitrateStr = std::to_string(bitrate) + "\n";
+	write(fd, bitrateStr.c_str(), bitrateStr.size());
+	forwardToStderr(fd, "");
+}
+
+struct ReceiverStats {
+	bool started = false;
+	uint16_t highestSeq = 0;
+	unsigned long packets = 0, bytes = 0, frames = 0, lost = 0, reordered = 0;
+
+	// RFC 3550 interarrival jitter, in 90 kHz timestamp units
+	double jitter = 0;
+	bool hasTransit = false;
+	int64_t lastTransit = 0;
+
+	void receive(const uint8_t* packet, size_t size, std::chrono::steady_clock::time_point arrival) {
+		if (size < 12 || (packet[0] >> 6) != 2) return; // not RTP
+		uint16_t seq = (packet[2] << 8) | packet[3];
+		uint32_t timestamp = ((uint32_t) packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+		bool marker = packet[1] & 0x80;
+
+		++packets;
+		bytes += size;
+		if (marker) ++frames;
+
+		if (!started) {
+			started = true;
+			highestSeq = seq;
+		}
+		else {
+			int16_t delta = seq - highestSeq;
+			if (delta > 0) {
+				lost += delta - 1;
+				highestSeq = seq;
+			}
+			else {
+				// It was counted as lost when it was skipped over
+				++reordered;
+				if (lost > 0) --lost;
+			}
+		}
+
+		int64_t arrivalUnits = std::chrono::duration_cast<std::chrono::duration<int64_t, std::ratio<1, 90000>>>(arrival.time_since_epoch()).count();
+		int64_t transit = arrivalUnits - (int64_t) timestamp;
+		if (hasTransit) {
+			// Timestamps wrap, but the difference between consecutive transits doesn't care
+			double d = std::abs((double) (int32_t) (transit - lastTransit));
+			jitter += (d - jitter) / 16;
+		}
+		lastTransit = transit;
+		hasTransit = true;
+	}
+};
+
+void usageAndExit() {
+	cerr << "RTP stream statistics: Listens for the pi's RTP stream and prints packet loss, jitter, and framerate every second.\n"
+	"Usage: rtpstat [-b bitrate] [-p port] [-l percent of packets to drop] [-f port to forward to] [pi address]\n"
+	"If the pi's address is given, asks the pi to start streaming to us, and sends it receiver reports.\n"
+	"With -f, every packet that isn't dropped is passed on to that port on this machine, e.g. for GStreamer to play." << endl;
+	exit(1);
+}
+
+int main(int argc, char * argv[]) {
+	int bitrate = 1000000;
+	int port = 5809;
+	int forwardPort = 0;
+	double simulatedLoss = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:l:f:h")) != -1) {
+		switch (opt) {
+			case 'b': bitrate = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			case 'l': simulatedLoss = atof(optarg) / 100; break;
+			case 'f': forwardPort = atoi(optarg); break;
+			default: usageAndExit();
+		}
+	}
+	if (bitrate <= 0 || port <= 0 || forwardPort < 0 || forwardPort == port || simulatedLoss < 0 || simulatedLoss >= 1 || argc - optind > 1) usageAndExit();
+	const char* piAddr = (optind < argc) ? argv[optind] : nullptr;
+
+	struct sockaddr_in6 servaddr;
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin6_family = AF_INET6;
+	servaddr.sin6_addr = in6addr_any;
+	servaddr.sin6_port = htons(port);
+
+	int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+	int no = 0;
+	if (sockfd == -1 || setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) < 0
+	 || bind(sockfd, (sockaddr *) &servaddr, sizeof(servaddr)) != 0) {
+		perror("Could not listen");
+		return 1;
+	}
+	// So that the stats are still printed if the stream stops
+	struct timeval timeout = { 0, 200000 };
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	int forwardFd = (forwardPort > 0) ? connectLocalUdp(forwardPort) : -1;
+
+	int controlFd = -1;
+	if (piAddr != nullptr) {
+		// The receiver must be listening before the stream starts
+		requestStream(piAddr, bitrate);
+		controlFd = connectTcp(piAddr, "5805");
+		forwardToStderr(controlFd, "control: ");
+	}
+	cerr << "listening for RTP at port " << port << endl;
+	if (simulatedLoss > 0) cerr << "dropping " << simulatedLoss * 100 << "% of packets" << endl;
+
+	std::mt19937 random(std::random_device{}());
+	std::bernoulli_distribution dropPacket(simulatedLoss);
+
+	ReceiverStats stats;
+	auto lastReport = std::chrono::steady_clock::now();
+	while (true) {
+		uint8_t buf[65536];
+		ssize_t size = recvfrom(sockfd, buf, sizeof(buf), 0, nullptr, nullptr);
+		auto now = std::chrono::steady_clock::now();
+		if (size > 0 && !dropPacket(random)) {
+			stats.receive(buf, size, now);
+			// Nothing might be listening yet, which is fine
+			if (forwardFd >= 0) send(forwardFd, buf, size, 0);
+		}
+		else if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) perror("Recieve error");
+
+		if (now - lastReport >= std::chrono::seconds(1)) {
+			double seconds = std::chrono::duration<double>(now - lastReport).count();
+			unsigned long expected = stats.packets + stats.lost;
+			double lossPercent = expected ? 100.0 * stats.lost / expected : 0;
+			cout << stats.frames / seconds << " fps, " << stats.bytes * 8 / seconds / 1000 << " kbps, "
+			<< stats.packets << " packets, " << stats.lost << " lost (" << lossPercent << "%), "
+			<< stats.reordered << " reordered, jitter " << stats.jitter / 90 << " ms" << endl;
+
+			if (controlFd >= 0 && expected > 0) {
+				std::string report = "streamReport:" + std::to_string(lossPercent) + " " + std::to_string(stats.jitter / 90) + "\n";
+				if (write(controlFd, report.c_str(), report.size()) < 0) perror("Sending receiver report");
+			}
+
+			stats.packets = stats.bytes = stats.frames = stats.lost = stats.reordered = 0;
+			lastReport = now;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include "BandwidthPlanner.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+// A high-bandwidth isochronous endpoint gets up to 3 packets of up to 1024 bytes every 125 us microframe, and each packet starts with a UVC payload header
+static constexpr double MICROFRAMES_PER_SECOND = 8000;
+static constexpr int MAX_PACKET_SIZE = 1024, MAX_PACKETS = 3, PAYLOAD_HEADER_SIZE = 12;
+// Cameras only have a handful of alternate settings to reserve with, so a reservation is rounded up to a step of about this many bytes per microframe
+static constexpr int RESERVATION_STEP = 128;
+
+// Sizes and framerates to try when a camera reports a range instead of a list
+static const cv::Size2i COMMON_SIZES[] = {
+	{160, 120}, {320, 180}, {320, 240}, {424, 240}, {432, 240}, {640, 360}, {640, 480},
+	{800, 448}, {800, 600}, {960, 540}, {1024, 576}, {1280, 720}, {1920, 1080}
+};
+static const double COMMON_RATES[] = { 5, 10, 15, 20, 24, 30, 60 };
+
+static unsigned int bytesPerPixel(uint32_t pixelFormat) {
+	switch (pixelFormat) {
+		case V4L2_PIX_FMT_YUYV: case V4L2_PIX_FMT_UYVY: case V4L2_PIX_FMT_YVYU: return 2;
+		default: return 0; // Compressed, or something we don't know about
+	}
+}
+
+double BandwidthPlanner::requiredMbps(uint32_t pixelFormat, unsigned int width, unsigned int height, double fps) {
+	unsigned int bytes = bytesPerPixel(pixelFormat);
+	if (bytes == 0 || fps <= 0) return -1;
+	double payload = (double) width * height * bytes * fps / MICROFRAMES_PER_SECOND;
+	int packets = ceil(payload / (MAX_PACKET_SIZE - PAYLOAD_HEADER_SIZE));
+	double perMicroframe = payload + packets * PAYLOAD_HEADER_SIZE;
+	if (perMicroframe > MAX_PACKET_SIZE * MAX_PACKETS) return -1;
+	perMicroframe = ceil(perMicroframe / RESERVATION_STEP) * RESERVATION_STEP;
+	return perMicroframe * MICROFRAMES_PER_SECOND * 8 / 1e6;
+}
+
+static std::vector<cv::Size2i> enumerateSizes(int fd, uint32_t pixelFormat) {
+	std::vector<cv::Size2i> sizes;
+	struct v4l2_frmsizeenum size;
+	memset(&size, 0, sizeof(size));
+	size.pixel_format = pixelFormat;
+	for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; ++size.index) {
+		if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			sizes.push_back({ (int) size.discrete.width, (int) size.discrete.height });
+			continue;
+		}
+		// Stepwise or continuous, which only comes as index 0
+		struct v4l2_frmsize_stepwise& range = size.stepwise;
+		for (auto& common : COMMON_SIZES) {
+			unsigned int width = common.width, height = common.height;
+			if (width < range.min_width || width > range.max_width || height < range.min_height || height > range.max_height) continue;
+			if (range.step_width > 0 && (width - range.min_width) % range.step_width != 0) continue;
+			if (range.step_height > 0 && (height - range.min_height) % range.step_height != 0) continue;
+			sizes.push_back(common);
+		}
+		break;
+	}
+	return sizes;
+}
+
+static std::vector<double> enumerateRates(int fd, uint32_t pixelFormat, cv::Size2i size) {
+	std::vector<double> rates;
+	struct v4l2_frmivalenum interval;
+	memset(&interval, 0, sizeof(interval));
+	interval.pixel_format = pixelFormat;
+	interval.width = size.width;
+	interval.height = size.height;
+	for (interval.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0; ++interval.index) {
+		if (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+			if (interval.discrete.numerator > 0) rates.push_back((double) interval.discrete.denominator / interval.discrete.numerator);
+			continue;
+		}
+		// A range of intervals (seconds per frame), so the longest is the slowest framerate
+		struct v4l2_frmival_stepwise& range = interval.stepwise;
+		if (range.min.numerator == 0 || range.max.numerator == 0) break;
+		double fastest = (double) range.min.denominator / range.min.numerator, slowest = (double) range.max.denominator / range.max.numerator;
+		for (double rate : COMMON_RATES) {
+			if (rate >= slowest && rate <= fastest) rates.push_back(rate);
+		}
+		break;
+	}
+	return rates;
+}
+
+std::vector<CameraMode> BandwidthPlanner::enumerateModes(const std::string& device) {
+	std::vector<CameraMode> modes;
+	int fd = open(device.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror(("Enumerating modes of " + device).c_str());
+		return modes;
+	}
+	struct v4l2_fmtdesc format;
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for (format.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &format) == 0; ++format.index) {
+		for (auto& size : enumerateSizes(fd, format.pixelformat)) {
+			for (double fps : enumerateRates(fd, format.pixelformat, size)) {
+				modes.push_back({ format.pixelformat, (unsigned int) size.width, (unsigned int) size.height, fps,
+					requiredMbps(format.pixelformat, size.width, size.height, fps) });
+			}
+		}
+	}
+	close(fd);
+	return modes;
+}
+
+std::vector<CameraMode> BandwidthPlanner::plan(const std::vector<Request>& cameras) {
+	// Each camera's usable modes, best first, and what the cheapest costs
+	std::vector<std::vector<CameraMode>> candidates(cameras.size());
+	std::vector<double> cheapest(cameras.size(), 0);
+	for (unsigned int i = 0; i < cameras.size(); ++i) {
+		const Request& camera = cameras[i];
+		for (auto& mode : camera.modes) {
+			if (mode.pixelFormat != V4L2_PIX_FMT_YUYV || mode.mbps < 0) continue;
+			if ((int) mode.width > camera.maxSize.width || (int) mode.height > camera.maxSize.height) continue;
+			if (camera.maxFps > 0 && mode.fps > camera.maxFps + 0.01) continue;
+			candidates[i].push_back(mode);
+		}
+		std::sort(candidates[i].begin(), candidates[i].end(), [](const CameraMode& a, const CameraMode& b) {
+			double aRate = (double) a.width * a.height * a.fps, bRate = (double) b.width * b.height * b.fps;
+			if (aRate != bRate) return aRate > bRate;
+			if (a.fps != b.fps) return a.fps > b.fps;
+			return a.mbps < b.mbps;
+		});
+		for (auto& mode : candidates[i]) cheapest[i] = (cheapest[i] == 0) ? mode.mbps : std::min(cheapest[i], mode.mbps);
+	}
+
+	std::vector<CameraMode> picked;
+	std::stringstream log;
+	log.precision(4);
+	double remaining = budgetMbps, planned = 0;
+	for (unsigned int i = 0; i < cameras.size(); ++i) {
+		const Request& camera = cameras[i];
+		log << "cam" << i << " " << camera.device << " ";
+		if (candidates[i].empty()) {
+			picked.push_back({ V4L2_PIX_FMT_YUYV, (unsigned int) camera.maxSize.width, (unsigned int) camera.maxSize.height, 0, -1 });
+			log << camera.maxSize.width << "x" << camera.maxSize.height << " unplanned (none of its " << camera.modes.size() << " modes are usable)\n";
+			continue;
+		}
+		// Leave enough for every camera after this one to get something
+		double reserved = std::accumulate(cheapest.begin() + i + 1, cheapest.end(), 0.0);
+		auto choice = std::find_if(candidates[i].begin(), candidates[i].end(), [&](const CameraMode& mode) { return mode.mbps <= remaining - reserved; });
+		bool overBudget = choice == candidates[i].end();
+		if (overBudget) {
+			choice = std::min_element(candidates[i].begin(), candidates[i].end(), [](const CameraMode& a, const CameraMode& b) { return a.mbps < b.mbps; });
+		}
+		picked.push_back(*choice);
+		remaining -= choice->mbps;
+		planned += choice->mbps;
+		log << choice->width << "x" << choice->height << "@" << choice->fps << " YUYV " << choice->mbps << "Mbps ";
+		if (overBudget) log << "(over budget, even at its cheapest)\n";
+		else if (choice == candidates[i].begin()) log << "(best of " << candidates[i].size() << " usable modes)\n";
+		else log << "(#" << (choice - candidates[i].begin()) + 1 << " of " << candidates[i].size() << " usable modes, to fit)\n";
+	}
+	log << "usb planned=" << planned << "Mbps budget=" << budgetMbps << "Mbps\n";
+	report = log.str();
+	std::cout << "USB bandwidth plan:\n" << report;
+	return picked;
+}
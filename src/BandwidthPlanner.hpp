@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+// A format, size, and framerate that a camera can capture at
+struct CameraMode {
+	uint32_t pixelFormat; // V4L2_PIX_FMT_*
+	unsigned int width, height;
+	double fps;
+	// USB bandwidth it reserves, from BandwidthPlanner::requiredMbps(). Negative if it can't be worked out (compressed formats) or carried at all.
+	double mbps;
+};
+
+/* class BandwidthPlanner
+** Picks a mode for each camera so they all fit on one USB 2.0 bus.
+** UVC cameras reserve isochronous bandwidth for their whole stream when it starts, sized for their worst frame, and a camera that can't
+**  get its reservation fails to start (or the ones started before it starve). The Pi's cameras all share one 480 Mbps controller.
+** Only YUYV is planned with, since that's what the streamer composites. Other formats are enumerated and logged, but not picked.
+*/
+class BandwidthPlanner {
+public:
+	// USB 2.0 only lets periodic transfers have 80% of each microframe, which is 384 Mbps
+	double budgetMbps = 384;
+
+	// Everything a camera supports, from VIDIOC_ENUM_FMT, VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS.
+	// Stepwise and continuous sizes and intervals are sampled at common values. Empty if the device can't be opened.
+	static std::vector<CameraMode> enumerateModes(const std::string& device);
+	// Isochronous bandwidth a mode reserves, in Mbps, or -1 if it can't be carried (or the format is compressed)
+	static double requiredMbps(uint32_t pixelFormat, unsigned int width, unsigned int height, double fps);
+
+	struct Request {
+		std::string device;
+		std::vector<CameraMode> modes;
+		cv::Size2i maxSize; // Its tile in the layout. Nothing bigger is picked.
+		double maxFps;
+	};
+	/* Picks a mode for each camera, in order, so earlier ones (the vision camera first) get the best they can
+	**  while leaving enough for the cheapest mode of every camera after them. Modes are ranked by pixels per second, then by framerate.
+	** A camera with no usable modes (it couldn't be enumerated) gets its maxSize at fps 0, which asks for as fast as possible, like before planning.
+	** If even the cheapest modes don't fit, they're picked anyway and the report says so.
+	*/
+	std::vector<CameraMode> plan(const std::vector<Request>& cameras);
+	// What the last plan() picked and why, a line per camera then the total, e.g.:
+	// cam0 /dev/video1 640x360@30 YUYV 114.7Mbps (best of 14 usable modes)
+	// usb planned=155.6Mbps budget=384Mbps
+	std::string getReport() { return report; }
+
+private:
+	std::string report;
+};
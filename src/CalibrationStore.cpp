@@ -0,0 +1,199 @@
+#include "CalibrationStore.hpp"
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+
+#include <sys/stat.h>
+#include <opencv2/calib3d.hpp>
+
+using std::cerr; using std::endl;
+
+// Cache file layout, all native-endian, since it's only ever read by the pi that wrote it:
+//  magic, SourceStamp, uint32 count, then count of:
+//  int32 width, height, double cameraMatrix[9], uint32 distCount, double distCoeffs[distCount], int32 lutColumns, lutRows, float lut[2*lutColumns*lutRows]
+static constexpr char CACHE_MAGIC[8] = { '5', '7', '0', '8', 'C', 'A', 'L', '1' };
+
+bool loadCalibration(const std::string path, Calibration& calibration) {
+	cv::FileStorage calibFile;
+	calibFile.open(path.c_str(), cv::FileStorage::READ);
+	if (!calibFile.isOpened()) {
+		std::cerr << "Failed to open camera data " << path << endl;
+		return false;
+	}
+
+	calibration.cameraMatrix = calibFile["cameraMatrix"].mat();
+	calibration.distCoeffs = calibFile["dist_coeffs"].mat();
+	cv::FileNode calibSize = calibFile["cameraResolution"];
+
+	calibration.width = calibSize[0];
+	calibration.height = calibSize[1];
+
+	if (calibration.cameraMatrix.type() != CV_64F || calibration.cameraMatrix.rows != 3 || calibration.cameraMatrix.cols != 3) {
+		std::cerr << "Camera data " << path << " has no 3x3 cameraMatrix" << endl;
+		return false;
+	}
+
+	// correcting for opencv bug?
+	//calibration.cameraMatrix.at<double>(0,0) *= 2;
+	//calibration.cameraMatrix.at<double>(1,1) *= 2;
+	return true;
+}
+
+Calibration scaleCalibration(const Calibration& calibration, int width, int height) {
+	assert(calibration.cameraMatrix.type() == CV_64F);
+	if (fabs(calibration.width / (double) calibration.height - width / (double) height) > 0.03) {
+		cerr << "wrong aspect ratio recieved from camera! Vision will be borked!" << endl;
+	}
+	Calibration scaled = { calibration.cameraMatrix.clone(), calibration.distCoeffs, width, height };
+	scaled.cameraMatrix.at<double>(0, 0) *= (width / (double) calibration.width);
+	scaled.cameraMatrix.at<double>(0, 2) *= (width / (double) calibration.width);
+	scaled.cameraMatrix.at<double>(1, 1) *= (height / (double) calibration.height);
+	scaled.cameraMatrix.at<double>(1, 2) *= (height / (double) calibration.height);
+	return scaled;
+}
+
+void ResolutionCalibration::buildLut() {
+	lut.clear();
+	lutColumns = lutRows = 0;
+	if (distCoeffs.empty() || cv::countNonZero(distCoeffs) == 0) return;
+
+	lutColumns = (width - 1) / LUT_STEP + 2;
+	lutRows = (height - 1) / LUT_STEP + 2;
+	std::vector<cv::Point2f> grid;
+	grid.reserve(lutColumns * lutRows);
+	for (int row = 0; row < lutRows; ++row) for (int column = 0; column < lutColumns; ++column) {
+		grid.push_back(cv::Point2f(column * LUT_STEP, row * LUT_STEP));
+	}
+	// Passing cameraMatrix again as P gives pixels rather than normalized coordinates
+	cv::undistortPoints(grid, lut, cameraMatrix, distCoeffs, cv::noArray(), cameraMatrix);
+}
+
+cv::Point2f ResolutionCalibration::undistort(cv::Point2f point) const {
+	if (lut.empty()) return point;
+	// Points past the edges use the nearest cell
+	float x = std::min(std::max(point.x / LUT_STEP, 0.0f), lutColumns - 1.001f);
+	float y = std::min(std::max(point.y / LUT_STEP, 0.0f), lutRows - 1.001f);
+	int column = (int) x, row = (int) y;
+	float fx = x - column, fy = y - row;
+	const cv::Point2f* top = &lut[row * lutColumns + column];
+	const cv::Point2f* bottom = top + lutColumns;
+	return (top[0] * (1 - fx) + top[1] * fx) * (1 - fy) + (bottom[0] * (1 - fx) + bottom[1] * fx) * fy;
+}
+
+void CalibrationStore::setBase(const Calibration& calibration) {
+	base = calibration;
+	resolutions.clear();
+}
+
+bool CalibrationStore::load(const std::string& path, const std::vector<cv::Size2i>& sizes) {
+	Calibration calibration;
+	if (!loadCalibration(path, calibration)) return false;
+	setBase(calibration);
+
+	struct stat source;
+	SourceStamp stamp = { 0, 0 };
+	if (stat(path.c_str(), &source) == 0) stamp = { (int64_t) source.st_size, (int64_t) source.st_mtim.tv_sec * 1000000000 + source.st_mtim.tv_nsec };
+	std::string cachePath = path + ".cache";
+	readCache(cachePath, stamp);
+
+	bool built = false;
+	for (auto& size : sizes) {
+		if (resolutions.count({ size.width, size.height })) continue;
+		resolutions[{ size.width, size.height }] = build(size.width, size.height);
+		built = true;
+	}
+	if (built) writeCache(cachePath, stamp);
+	std::cout << "Calibration for " << resolutions.size() << " resolutions of " << path << (built ? " built" : " loaded from cache") << endl;
+	return true;
+}
+
+std::shared_ptr<const ResolutionCalibration> CalibrationStore::get(int width, int height) {
+	auto found = resolutions.find({ width, height });
+	if (found != resolutions.end()) return found->second;
+	auto built = build(width, height);
+	resolutions[{ width, height }] = built;
+	return built;
+}
+
+std::shared_ptr<const ResolutionCalibration> CalibrationStore::build(int width, int height) {
+	Calibration scaled = scaleCalibration(base, width, height);
+	auto resolution = std::make_shared<ResolutionCalibration>();
+	resolution->width = width;
+	resolution->height = height;
+	resolution->cameraMatrix = scaled.cameraMatrix;
+	resolution->distCoeffs = scaled.distCoeffs.empty() ? cv::Mat() : scaled.distCoeffs.clone();
+	resolution->buildLut();
+	return resolution;
+}
+
+bool CalibrationStore::readCache(const std::string& path, const SourceStamp& stamp) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) return false;
+	char magic[sizeof(CACHE_MAGIC)];
+	SourceStamp cachedStamp;
+	uint32_t count;
+	bool good = fread(magic, sizeof(magic), 1, file) == 1 && std::equal(magic, magic + sizeof(magic), CACHE_MAGIC)
+		&& fread(&cachedStamp, sizeof(cachedStamp), 1, file) == 1 && cachedStamp == stamp
+		&& fread(&count, sizeof(count), 1, file) == 1;
+
+	std::map<std::pair<int, int>, std::shared_ptr<const ResolutionCalibration>> cached;
+	for (uint32_t i = 0; good && i < count; ++i) {
+		auto resolution = std::make_shared<ResolutionCalibration>();
+		int32_t size[2], lutSize[2];
+		uint32_t distCount;
+		resolution->cameraMatrix.create(3, 3, CV_64F);
+		good = fread(size, sizeof(size), 1, file) == 1
+			&& fread(resolution->cameraMatrix.ptr<double>(), sizeof(double), 9, file) == 9
+			&& fread(&distCount, sizeof(distCount), 1, file) == 1 && distCount <= 14;
+		if (!good) break;
+		if (distCount > 0) {
+			resolution->distCoeffs.create(1, distCount, CV_64F);
+			good = fread(resolution->distCoeffs.ptr<double>(), sizeof(double), distCount, file) == distCount;
+		}
+		good = good && fread(lutSize, sizeof(lutSize), 1, file) == 1 && lutSize[0] >= 0 && lutSize[1] >= 0 && lutSize[0] * lutSize[1] <= (1 << 20);
+		if (!good) break;
+		resolution->width = size[0]; resolution->height = size[1];
+		resolution->lutColumns = lutSize[0]; resolution->lutRows = lutSize[1];
+		resolution->lut.resize(lutSize[0] * lutSize[1]);
+		good = fread(resolution->lut.data(), sizeof(cv::Point2f), resolution->lut.size(), file) == resolution->lut.size();
+		cached[{ size[0], size[1] }] = resolution;
+	}
+	fclose(file);
+	if (!good) {
+		cerr << "Ignoring out of date or unreadable calibration cache " << path << endl;
+		return false;
+	}
+	resolutions = cached;
+	return true;
+}
+
+void CalibrationStore::writeCache(const std::string& path, const SourceStamp& stamp) {
+	// Written to another file then renamed, so a crash never leaves half a cache
+	std::string tempPath = path + ".tmp";
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (file == nullptr) {
+		perror(("Saving calibration cache " + path).c_str());
+		return;
+	}
+	uint32_t count = resolutions.size();
+	bool good = fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, file) == 1 && fwrite(&stamp, sizeof(stamp), 1, file) == 1 && fwrite(&count, sizeof(count), 1, file) == 1;
+	for (auto& entry : resolutions) {
+		const ResolutionCalibration& resolution = *entry.second;
+		int32_t size[2] = { resolution.width, resolution.height }, lutSize[2] = { resolution.lutColumns, resolution.lutRows };
+		cv::Mat distCoeffs;
+		if (!resolution.distCoeffs.empty()) resolution.distCoeffs.reshape(1, 1).convertTo(distCoeffs, CV_64F);
+		uint32_t distCount = distCoeffs.total();
+		good = good && fwrite(size, sizeof(size), 1, file) == 1
+			&& fwrite(resolution.cameraMatrix.ptr<double>(), sizeof(double), 9, file) == 9
+			&& fwrite(&distCount, sizeof(distCount), 1, file) == 1
+			&& (distCount == 0 || fwrite(distCoeffs.ptr<double>(), sizeof(double), distCount, file) == distCount)
+			&& fwrite(lutSize, sizeof(lutSize), 1, file) == 1
+			&& fwrite(resolution.lut.data(), sizeof(cv::Point2f), resolution.lut.size(), file) == resolution.lut.size();
+	}
+	if (fclose(file) != 0 || !good || rename(tempPath.c_str(), path.c_str()) != 0) {
+		perror(("Saving calibration cache " + path).c_str());
+		remove(tempPath.c_str());
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+// A camera calibration, as stored in calib-data
+struct Calibration {
+	cv::Mat cameraMatrix, distCoeffs;
+	int width, height;
+};
+bool loadCalibration(const std::string path, Calibration& calibration);
+// Scales a calibration to another resolution. The camera matrix is copied, so calibration itself is left alone.
+Calibration scaleCalibration(const Calibration& calibration, int width, int height);
+
+/* struct ResolutionCalibration
+** A calibration scaled to one resolution, with a table for undistorting points,
+**  so vision can undistort a target's corners itself and hand solvePnP no distortion coefficients.
+*/
+struct ResolutionCalibration {
+	int width, height;
+	cv::Mat cameraMatrix, distCoeffs;
+	// Where every LUT_STEP'th pixel (up to one step past the far edges) ends up once undistorted,
+	//  in the pixels of a distortion-free camera with cameraMatrix. Empty if there's no distortion.
+	static constexpr int LUT_STEP = 8;
+	int lutColumns = 0, lutRows = 0;
+	std::vector<cv::Point2f> lut;
+	void buildLut();
+	// Undistorts a point by interpolating between the four nearest table entries
+	cv::Point2f undistort(cv::Point2f point) const;
+};
+
+/* class CalibrationStore
+** One camera's calibration at every resolution it runs at. They're built once from its calib-data XML and cached next to it in a binary file
+**  (<xml>.cache), which is used instead for as long as the XML doesn't change. Switching resolution is then just picking another pointer.
+** It isn't thread safe. The vision thread owns the one it's using, and reloads build a new one to hand over.
+*/
+class CalibrationStore {
+public:
+	// Loads path's calibration, and every size in sizes from the cache (building and saving them if they're missing or out of date).
+	// Returns false if path can't be loaded.
+	bool load(const std::string& path, const std::vector<cv::Size2i>& sizes);
+	// For when there's no calibration file. Nothing is cached.
+	void setBase(const Calibration& calibration);
+	const Calibration& getBase() { return base; }
+	// The calibration for a resolution. One that wasn't loaded (e.g. a test image's) is built on the spot, and kept.
+	std::shared_ptr<const ResolutionCalibration> get(int width, int height);
+
+private:
+	Calibration base;
+	std::map<std::pair<int, int>, std::shared_ptr<const ResolutionCalibration>> resolutions;
+	std::shared_ptr<const ResolutionCalibration> build(int width, int height);
+	// The cache is only used if it was made from a file of the same size and modification time
+	struct SourceStamp {
+		int64_t size, modified;
+		bool operator==(const SourceStamp& other) const { return size == other.size && modified == other.modified; }
+	};
+	bool readCache(const std::string& path, const SourceStamp& stamp);
+	void writeCache(const std::string& path, const SourceStamp& stamp);
+};
@@ -0,0 +1,68 @@
+#include "CameraDiscovery.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+
+// Names in a directory, sorted, without . and ..
+static std::vector<std::string> listDirectory(const std::string& path) {
+	std::vector<std::string> names;
+	DIR* directory = opendir(path.c_str());
+	if (directory == nullptr) return names;
+	while (struct dirent* entry = readdir(directory)) {
+		if (entry->d_name[0] == '.') continue;
+		names.push_back(entry->d_name);
+	}
+	closedir(directory);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+std::vector<std::string> CameraDiscovery::findDevicesWithString(const std::string& model) const {
+	std::vector<std::string> devices;
+	for (auto& name : listDirectory(byIdRoot)) {
+		// Cameras have a metadata interface too (index1), which can't capture
+		if (name.find(model) == std::string::npos || name.find("index0") == std::string::npos) continue;
+		char device[PATH_MAX];
+		// Fails if the link is dangling, which it is for a moment while a camera's being unplugged
+		if (realpath((byIdRoot + "/" + name).c_str(), device) == nullptr) continue;
+		devices.push_back(device);
+	}
+	return devices;
+}
+
+std::vector<CameraDiscovery::Camera> CameraDiscovery::findCameras(const std::vector<std::string>& models) const {
+	std::vector<Camera> cameras;
+	for (auto& model : models) {
+		for (auto& device : findDevicesWithString(model)) cameras.push_back({ model, device });
+	}
+	return cameras;
+}
+
+std::vector<std::string> CameraDiscovery::findLoopbackDevices() const {
+	std::vector<std::string> devices;
+	for (auto& name : listDirectory(sysfsRoot)) {
+		std::ifstream nameFile(sysfsRoot + "/" + name + "/name");
+		std::string deviceName;
+		std::getline(nameFile, deviceName);
+		if (deviceName.find("Dummy") != std::string::npos) devices.push_back(devRoot + "/" + name);
+	}
+	return devices;
+}
+
+CameraHotplug::CameraHotplug(CameraDiscovery discovery, std::vector<std::string> models, std::function<void(const std::vector<CameraDiscovery::Camera>&)> onChange)
+: discovery(discovery), models(models), onChange(onChange), found(discovery.findCameras(models)), watcher(std::bind(&CameraHotplug::rescan, this)) {
+	if (!watcher.watchDirectory(discovery.byIdRoot)) std::cerr << "Can't watch " << discovery.byIdRoot << " for cameras being plugged in" << std::endl;
+}
+
+void CameraHotplug::rescan() {
+	std::vector<CameraDiscovery::Camera> cameras = discovery.findCameras(models);
+	// Links for other devices (and index1s) come and go too
+	if (cameras == found) return;
+	found = cameras;
+	onChange(cameras);
+}
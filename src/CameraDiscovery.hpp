@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "FileWatcher.hpp"
+
+/* class CameraDiscovery
+** Finds cameras and the v4l2loopback device by reading /dev/v4l/by-id and /sys/class/video4linux directly.
+** The roots can be changed to point it at a fake tree, e.g. in a temp directory:
+**  <byIdRoot>/usb-046d_HD_Pro_Webcam_C920_99EDB55F-video-index0 -> a symlink to the camera's device node
+**  <sysfsRoot>/video3/name containing "Dummy", for a v4l2loopback device at <devRoot>/video3
+*/
+class CameraDiscovery {
+public:
+	std::string byIdRoot = "/dev/v4l/by-id";
+	std::string sysfsRoot = "/sys/class/video4linux";
+	std::string devRoot = "/dev";
+
+	struct Camera {
+		std::string model; // Which of the models it was found by
+		std::string device; // e.g. /dev/video1
+		bool operator==(const Camera& other) const { return model == other.model && device == other.device; }
+	};
+	// Every camera whose by-id name contains one of models. They're in the same order as models, so the first is the most wanted.
+	std::vector<Camera> findCameras(const std::vector<std::string>& models) const;
+	// Device nodes of the capture interfaces (index0) whose by-id name contains model, sorted by name
+	std::vector<std::string> findDevicesWithString(const std::string& model) const;
+	std::vector<std::string> findLoopbackDevices() const;
+};
+
+/* class CameraHotplug
+** Calls onChange(discovery.findCameras(models)) from its own thread whenever the cameras found change, until it's destroyed.
+** discovery.byIdRoot is watched with inotify. It doesn't have to exist yet, since udev removes it when the last camera is unplugged.
+*/
+class CameraHotplug {
+public:
+	CameraHotplug(CameraDiscovery discovery, std::vector<std::string> models, std::function<void(const std::vector<CameraDiscovery::Camera>&)> onChange);
+
+private:
+	CameraDiscovery discovery;
+	std::vector<std::string> models;
+	std::function<void(const std::vector<CameraDiscovery::Camera>&)> onChange;
+	// Only touched by the watcher's thread, after the constructor
+	std::vector<CameraDiscovery::Camera> found;
+	void rescan();
+	// Last, so it's destroyed (and its thread stopped) before the rest
+	FileWatcher watcher;
+};
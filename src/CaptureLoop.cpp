@@ -0,0 +1,98 @@
+#include "CaptureLoop.hpp"
+#include "VideoHandler.hpp"
+
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+CaptureLoop::CaptureLoop() {
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0) {
+		perror("CaptureLoop epoll_create1/eventfd");
+		return;
+	}
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = wakeFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+		perror("CaptureLoop epoll_ctl");
+		return;
+	}
+	loopThread = std::thread(&CaptureLoop::loop, this);
+}
+
+CaptureLoop::~CaptureLoop() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	uint64_t one = 1;
+	if (wakeFd >= 0) write(wakeFd, &one, sizeof(one));
+	if (loopThread.joinable()) loopThread.join();
+	if (epollFd >= 0) close(epollFd);
+	if (wakeFd >= 0) close(wakeFd);
+}
+
+void CaptureLoop::watch(ThreadedVideoReader* camera) {
+	std::lock_guard<std::mutex> guard(lock);
+	for (int fd : { camera->getFd(), camera->deadlineFd }) {
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1 && errno != EEXIST) {
+			perror("CaptureLoop epoll_ctl");
+			continue;
+		}
+		watched[fd] = { camera, fd == camera->deadlineFd };
+	}
+}
+
+void CaptureLoop::unwatch(ThreadedVideoReader* camera, bool wait) {
+	std::unique_lock<std::mutex> guard(lock);
+	for (auto i = watched.begin(); i != watched.end();) {
+		if (i->second.camera != camera) {
+			++i;
+			continue;
+		}
+		// Fails harmlessly if the fd was already closed, which takes it out of the epoll set anyway
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, i->first, nullptr);
+		i = watched.erase(i);
+	}
+	if (wait) idle.wait(guard, [this, camera]() { return busy != camera; });
+}
+
+void CaptureLoop::loop() {
+	while (true) {
+		struct epoll_event events[16];
+		int eventCount = epoll_wait(epollFd, events, 16, -1);
+		if (eventCount < 0) {
+			if (errno == EINTR) continue;
+			perror("CaptureLoop epoll_wait");
+			// Don't spam the console
+			sleep(1);
+			continue;
+		}
+		for (int i = 0; i < eventCount; ++i) {
+			Watched handling;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping) return;
+				// It might have been unwatched by an earlier event in this batch
+				auto entry = watched.find(events[i].data.fd);
+				if (entry == watched.end()) continue;
+				handling = entry->second;
+				busy = handling.camera;
+			}
+			if (handling.isDeadline) handling.camera->onDeadline();
+			else handling.camera->onReadable();
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				busy = nullptr;
+			}
+			idle.notify_all();
+		}
+	}
+}
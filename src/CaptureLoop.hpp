@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+class ThreadedVideoReader;
+
+/* class CaptureLoop
+** Services every camera from one thread. The cameras' device files are opened non-blocking and waited on together with epoll,
+**  along with a timerfd for each camera which goes off when it's late with a frame (see ThreadedVideoReader::armDeadline()).
+** Nothing slow is done on the loop's thread: opening and resetting cameras happens on a thread the camera starts only while it's doing that.
+** Frame callbacks are run on the loop's thread, so a slow one holds up every camera.
+*/
+class CaptureLoop {
+public:
+	CaptureLoop();
+	~CaptureLoop();
+	// Starts waiting for camera's frames and deadline. The camera must be open and streaming.
+	void watch(ThreadedVideoReader* camera);
+	/* Stops waiting for camera's frames and deadline.
+	** If wait, also waits for the loop to be done with it, so it can be destroyed. (Don't hold anything its callback needs, like Streamer's frameLock.)
+	*/
+	void unwatch(ThreadedVideoReader* camera, bool wait);
+
+private:
+	int epollFd = -1;
+	// Wakes the loop so it can exit
+	int wakeFd = -1;
+	struct Watched {
+		ThreadedVideoReader* camera;
+		bool isDeadline;
+	};
+	std::mutex lock;
+	std::map<int, Watched> watched;
+	// The camera whose frame or deadline the loop is handling right now
+	ThreadedVideoReader* busy = nullptr;
+	std::condition_variable idle;
+	bool stopping = false;
+	std::thread loopThread;
+	void loop();
+};
@@ -0,0 +1,36 @@
+#include "ChangeDetector.hpp"
+
+#include <cstdlib>
+
+void ChangeDetector::sample(const cv::Mat& frame, std::vector<uint8_t>& out) {
+	assert(frame.type() == CV_8UC2 && frame.cols >= GRID_WIDTH*2 && frame.rows >= GRID_HEIGHT*2);
+	out.resize(GRID_WIDTH * GRID_HEIGHT);
+
+	for (int gridY = 0; gridY < GRID_HEIGHT; ++gridY) {
+		int y = (2*gridY + 1) * frame.rows / (2*GRID_HEIGHT);
+		const uint8_t* row0 = frame.ptr<uint8_t>(y);
+		const uint8_t* row1 = frame.ptr<uint8_t>(y + 1);
+		for (int gridX = 0; gridX < GRID_WIDTH; ++gridX) {
+			// Average 2x2 pixels at the center of each grid cell, to knock down the sensor noise. Luma is every other byte.
+			int x = ((2*gridX + 1) * frame.cols / (2*GRID_WIDTH)) & ~1;
+			out[gridY*GRID_WIDTH + gridX] = (row0[2*x] + row0[2*x + 2] + row1[2*x] + row1[2*x + 2] + 2) / 4;
+		}
+	}
+}
+
+bool ChangeDetector::hasChanged(const cv::Mat& frame) {
+	sample(frame, samples);
+
+	bool changed = !hasReference;
+	if (!changed) {
+		unsigned int sad = 0;
+		for (size_t i = 0; i < samples.size(); ++i) sad += abs(samples[i] - reference[i]);
+		changed = sad > threshold * samples.size();
+	}
+	if (changed) {
+		std::swap(reference, samples);
+		hasReference = true;
+		lastChange = std::chrono::steady_clock::now();
+	}
+	return changed;
+}
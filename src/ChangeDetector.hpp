@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+#include <opencv2/core.hpp>
+
+/* class ChangeDetector
+** Cheaply decides whether a camera's view has changed, by comparing luma sampled on a coarse grid 
+** against the last frame that was considered changed. It's meant for secondary cameras which sit still 
+** most of the match (an intake camera while idle, or a camera pointed at the floor).
+** Comparing against the last changed frame instead of the previous frame means that slow drift is eventually noticed.
+*/
+class ChangeDetector {
+public:
+	// Returns true if frame (YUYV) is different enough from the reference, or if there's no reference yet. If so, it becomes the new reference.
+	bool hasChanged(const cv::Mat& frame);
+	// Forget the reference, so the next frame counts as changed. (For when whatever the frame was copied to was overwritten)
+	void reset() { hasReference = false; }
+	// How long since a frame last counted as changed
+	std::chrono::steady_clock::duration getTimeUnchanged() { return std::chrono::steady_clock::now() - lastChange; }
+
+	static constexpr int GRID_WIDTH = 32, GRID_HEIGHT = 18;
+	// Mean absolute luma difference per sample. Sensor noise on our cameras is around 1-2.
+	double threshold = 4.0;
+
+private:
+	std::vector<uint8_t> reference, samples;
+	bool hasReference = false;
+	std::chrono::steady_clock::time_point lastChange = std::chrono::steady_clock::now();
+	void sample(const cv::Mat& frame, std::vector<uint8_t>& out);
+};
@@ -0,0 +1,45 @@
+#include "ContourStore.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+void ContourStore::clear() {
+	points.clear();
+	contourStart.clear();
+	contourLength.clear();
+	hullStart.clear();
+	hullLength.clear();
+	area.clear();
+	hullArea.clear();
+	hullBounds.clear();
+}
+
+void ContourStore::add(const std::vector<cv::Point>& contour) {
+	contourStart.push_back(points.size());
+	contourLength.push_back(contour.size());
+	hullStart.push_back(0);
+	hullLength.push_back(0);
+	points.insert(points.end(), contour.begin(), contour.end());
+}
+
+void ContourStore::addHulls() {
+	// A hull is never longer than its contour, so this is the only time points can move
+	points.reserve(points.size() * 2);
+	for (size_t i = 0; i < size(); ++i) {
+		if (contourLength[i] == 0) continue;
+		cv::convexHull(contour(i), hullScratch, false);
+		hullStart[i] = points.size();
+		hullLength[i] = hullScratch.size();
+		points.insert(points.end(), hullScratch.begin(), hullScratch.end());
+	}
+}
+
+void ContourStore::computeStats() {
+	area.resize(size());
+	hullArea.resize(size());
+	hullBounds.resize(size());
+	for (size_t i = 0; i < size(); ++i) {
+		area[i] = (contourLength[i] > 0) ? cv::contourArea(contour(i)) : 0;
+		hullArea[i] = (hullLength[i] > 0) ? cv::contourArea(hull(i)) : 0;
+		hullBounds[i] = (hullLength[i] > 0) ? cv::boundingRect(hull(i)) : cv::Rect();
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/* class ContourStore
+** Every contour found in a frame, and its convex hull, in flat arrays instead of a vector per contour:
+**  all the points are in one buffer, and each contour is a start and length into it, with a column per statistic.
+** GripHexFinder keeps one for as long as it lives and clear()s it each frame, so after the first few frames
+**  a cluttered scene costs no more allocations than an empty one.
+** contour() and hull() are cv::Mat headers over points, so they can go straight to OpenCV without copying.
+**  They're only good until the next add() or addHulls(), which may move points.
+*/
+class ContourStore {
+public:
+	// Contours' points, in the order they were added, then their hulls'
+	std::vector<cv::Point> points;
+	// Columns, one entry per contour
+	std::vector<int> contourStart, contourLength, hullStart, hullLength;
+	// From computeStats()
+	std::vector<double> area, hullArea;
+	std::vector<cv::Rect> hullBounds;
+
+	size_t size() const { return contourStart.size(); }
+	// Empties it, but keeps its memory for the next frame
+	void clear();
+	// Copies a contour in. Its hull starts empty.
+	void add(const std::vector<cv::Point>& contour);
+	// Works out every contour's convex hull, and puts it after the contours in points
+	void addHulls();
+	// Fills area, hullArea and hullBounds for every contour
+	void computeStats();
+
+	cv::Mat contour(size_t i) { return view(contourStart[i], contourLength[i]); }
+	cv::Mat hull(size_t i) { return view(hullStart[i], hullLength[i]); }
+
+private:
+	// convexHull()'s output, reused
+	std::vector<cv::Point> hullScratch;
+	cv::Mat view(int start, int length) { return cv::Mat(length, 1, CV_32SC2, points.data() + start); }
+};
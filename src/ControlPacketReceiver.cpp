@@ -4,12 +4,13 @@
 #include <fcntl.h>
 #include <chrono>
 #include <thread>
-
-#include <opencv2/imgproc.hpp>
+#include <algorithm>
 
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -20,25 +21,30 @@
 #include <string>
 
 
-ControlPacketReceiver::ControlPacketReceiver(std::function<std::string(std::string)> parsePacketCallback,short port){
+ControlPacketReceiver::ControlPacketReceiver(std::function<std::string(std::string)> parsePacketCallback,short port,std::vector<std::string> slowCommands){
 	this->port=port;
 	this->parsePacketCallback=parsePacketCallback;
+	this->slowCommands=slowCommands;
 	start();
 }
 
 void ControlPacketReceiver::start(){
     int retval=setupSocket();
-	if(retval!=0) std::cerr << "ControlPacketReceiver::setupSocket() returned status " << retval << std::endl;
+	if(retval!=0) {
+		std::cerr << "ControlPacketReceiver::setupSocket() returned status " << retval << std::endl;
+		return;
+	}
     receiverThread=std::thread(&ControlPacketReceiver::receivePackets,this);
+    commandThread=std::thread(&ControlPacketReceiver::runCommands,this);
 }
 int ControlPacketReceiver::setupSocket(){
 	//Sets up the network socket for receiving control messages.
-    servFd = socket(AF_INET6, SOCK_STREAM, 0);
+    servFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (servFd < 0) {
 		perror("socket");
 		return -1;
 	}
-	
+
 	int flag = 1;
 	if (setsockopt(servFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1) {
 		perror("setsockopt");
@@ -47,7 +53,7 @@ int ControlPacketReceiver::setupSocket(){
 
     struct sockaddr_in6 servAddr;
 	memset(&servAddr, 0, sizeof(servAddr));
-	
+
 	servAddr.sin6_family = AF_INET6;
 	servAddr.sin6_addr = in6addr_any;
 	servAddr.sin6_port = htons(port); //Port that the control stream uses
@@ -60,50 +66,274 @@ int ControlPacketReceiver::setupSocket(){
 		perror("listen");
 		return -1;
 	}
-	fcntl(servFd, F_SETFD, fcntl(servFd, F_GETFD) | FD_CLOEXEC);
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || wakeFd < 0) {
+		perror("epoll_create1/eventfd");
+		return -1;
+	}
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = servFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, servFd, &event) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	event.data.fd = wakeFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
     return 0;
 }
 
 void ControlPacketReceiver::receivePackets(){
+	std::cout << "Listening for control packet senders..." << std::endl;
     while (!destroyReceiver) {
-		std::cout << "Listening for control packet sender..." << std::endl;
-		struct sockaddr_in6 clientAddr;
-		socklen_t clientAddrLen = sizeof(clientAddr);
-		int clientFd = accept(servFd, (struct sockaddr*) &clientAddr, &clientAddrLen);
-		if (clientFd < 0) {
-			perror("accept");
+		struct epoll_event events[16];
+		int eventCount = epoll_wait(epollFd, events, 16, -1);
+		if (eventCount < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
 			// Don't spam the console
 			sleep(1);
 			continue;
 		}
-		std::cout << "Connection to controller established." << std::endl;
-		const char* connect_msg="Connection established.\n\0";
-		write(clientFd,connect_msg,strlen(connect_msg));
-		while(true){
-			char controlMessage[65536];
-			int len = read(clientFd, controlMessage, sizeof(controlMessage)-1);
-			if(len<=0){
-				std::cerr << "Connection to controller broken." << std::endl;
-				break; //Our connection has been broken.
-			} 
-			std::cout << "Received control message " << controlMessage << std::endl;
-			controlMessage[len] = '\0'; //Nullchar-delimit our message.
-			std::string status = parsePacketCallback(controlMessage); //Send the control packet to our external packet-parsing function.
-			std::cout << "Control Message status: \n" << status << std::endl;
-			int retval=write(clientFd,status.c_str(), status.length());
-			if(retval<0){
-				std::cerr << "Connection to controller broken." << std::endl;
-				break;
+		for (int i = 0; i < eventCount; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == servFd) acceptClient();
+			else if (fd == wakeFd) {
+				uint64_t count;
+				read(wakeFd, &count, sizeof(count));
+				deliverFinished();
+			}
+			else {
+				auto client = clients.find(fd);
+				if (client == clients.end()) continue;
+				// Read even if it hung up, so whatever it sent before closing still gets handled
+				bool keep = true;
+				if (events[i].events & EPOLLIN) keep = readClient(fd);
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) keep = false;
+				// readClient() may have closed it
+				client = clients.find(fd);
+				if (client == clients.end()) continue;
+				if (keep && (events[i].events & EPOLLOUT)) keep = flushClient(fd, client->second);
+				if (!keep) closeClient(fd);
 			}
 		}
     }
+}
+
+void ControlPacketReceiver::acceptClient(){
+	while (true) {
+		int clientFd = accept4(servFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientFd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+			return;
+		}
+		if (clients.size() >= MAX_CLIENTS) {
+			std::cerr << "Too many control clients, refusing another" << std::endl;
+			close(clientFd);
+			continue;
+		}
+		struct epoll_event event = {};
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.fd = clientFd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event) == -1) {
+			perror("epoll_ctl");
+			close(clientFd);
+			continue;
+		}
+		Client& client = clients[clientFd];
+		client.id = nextClientId++;
+		std::cout << "Connection to controller established. (" << clients.size() << " connected)" << std::endl;
+		sendToClient(clientFd, client, "Connection established.\n");
+	}
+}
+
+bool ControlPacketReceiver::readClient(int fd){
+	Client& client = clients[fd];
+	char buffer[4096];
+	// Messages that came with the end of the connection are still handled, since one-shot senders (e.g. echo visionEnable | nc -N) write then close
+	bool closed = false;
+	while (true) {
+		ssize_t len = read(fd, buffer, sizeof(buffer));
+		if (len == 0) {
+			std::cerr << "Connection to controller broken." << std::endl;
+			closed = true;
+			break;
+		}
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			// e.g. reset by a sender that closed without reading our replies. What it sent before that still counts.
+			perror("Control connection read");
+			closed = true;
+			break;
+		}
+		client.received.append(buffer, len);
+	}
+
+	// Pull out every complete message
+	size_t start = 0;
+	while (start < client.received.size()) {
+		std::string message;
+		if (isdigit((unsigned char) client.received[start])) {
+			// <length>:<message>
+			size_t colon = client.received.find(':', start);
+			if (colon == std::string::npos) break;
+			size_t length = strtoul(client.received.c_str() + start, nullptr, 10);
+			if (length > MAX_MESSAGE_SIZE) {
+				std::cerr << "Control message too long (" << length << " bytes)" << std::endl;
+				return false;
+			}
+			if (client.received.size() - (colon + 1) < length) break;
+			message = client.received.substr(colon + 1, length);
+			start = colon + 1 + length;
+			// A newline after a length-framed message is allowed, since that's what netcat adds
+			if (start < client.received.size() && client.received[start] == '\n') ++start;
+		}
+		else {
+			size_t newline = client.received.find('\n', start);
+			if (newline == std::string::npos) break;
+			message = client.received.substr(start, newline - start);
+			start = newline + 1;
+			if (!message.empty() && message.back() == '\r') message.pop_back();
+			if (message.empty()) continue;
+		}
+		handleMessage(fd, client, message);
+	}
+	client.received.erase(0, start);
+	if (closed) {
+		// Nothing more is coming, so an unterminated plain message is complete. An incomplete length-framed one is dropped.
+		if (!client.received.empty() && !isdigit((unsigned char) client.received[0]) && client.received.size() <= MAX_MESSAGE_SIZE) {
+			std::string message = client.received;
+			if (message.back() == '\r') message.pop_back();
+			if (!message.empty()) handleMessage(fd, client, message);
+		}
+		client.received.clear();
+		// Best effort at replying; the other end may still be reading
+		flushClient(fd, client);
+		return false;
+	}
+	if (client.received.size() > MAX_MESSAGE_SIZE) {
+		std::cerr << "Control message too long without a newline" << std::endl;
+		return false;
+	}
+	return flushClient(fd, client);
+}
+
+void ControlPacketReceiver::handleMessage(int fd, Client& client, const std::string& message){
+	std::cout << "Received control message " << message << std::endl;
+	std::string command = message.substr(0, message.find(':'));
+
+	if (std::find(slowCommands.begin(), slowCommands.end(), command) != slowCommands.end()) {
+		uint64_t commandId;
+		{
+			std::lock_guard<std::mutex> lock(commandLock);
+			commandId = nextCommandId++;
+			commandQueue.push_back({ commandId, client.id, message + "\n", "" });
+		}
+		commandCondition.notify_one();
+		sendToClient(fd, client, "Queued " + std::to_string(commandId) + "\n");
+		return;
+	}
+	std::string status = parsePacketCallback(message + "\n"); //Send the control packet to our external packet-parsing function.
+	std::cout << "Control Message status: \n" << status << std::endl;
+	sendToClient(fd, client, status);
+}
+
+void ControlPacketReceiver::runCommands(){
+	while (true) {
+		QueuedCommand command;
+		{
+			std::unique_lock<std::mutex> lock(commandLock);
+			commandCondition.wait(lock, [this]() { return !commandQueue.empty() || destroyReceiver; });
+			if (destroyReceiver) return;
+			command = commandQueue.front();
+			commandQueue.pop_front();
+		}
+		command.status = parsePacketCallback(command.message);
+		std::cout << "Control Message " << command.commandId << " status: \n" << command.status << std::endl;
+		{
+			std::lock_guard<std::mutex> lock(commandLock);
+			finishedCommands.push_back(command);
+		}
+		uint64_t one = 1;
+		write(wakeFd, &one, sizeof(one));
+	}
+}
+
+void ControlPacketReceiver::deliverFinished(){
+	std::deque<QueuedCommand> finished;
+	{
+		std::lock_guard<std::mutex> lock(commandLock);
+		finished.swap(finishedCommands);
+	}
+	for (auto& command : finished) {
+		// The client might have disconnected while it was running
+		for (auto& entry : clients) {
+			if (entry.second.id != command.clientId) continue;
+			std::string status = command.status;
+			if (!status.empty() && status.back() != '\n') status += '\n';
+			sendToClient(entry.first, entry.second, "Done " + std::to_string(command.commandId) + ":\n" + status);
+			break;
+		}
+	}
+}
 
+void ControlPacketReceiver::sendToClient(int fd, Client& client, const std::string& data){
+	client.toSend += data;
+	// A client that isn't reading gets disconnected instead of growing this forever
+	if (client.toSend.size() > MAX_MESSAGE_SIZE) {
+		std::cerr << "Controller isn't reading its replies, disconnecting it" << std::endl;
+		client.toSend.clear();
+		shutdown(fd, SHUT_RDWR);
+		return;
+	}
+	if (!flushClient(fd, client)) shutdown(fd, SHUT_RDWR);
+}
+
+bool ControlPacketReceiver::flushClient(int fd, Client& client){
+	while (!client.toSend.empty()) {
+		ssize_t sent = send(fd, client.toSend.data(), client.toSend.size(), MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			std::cerr << "Connection to controller broken." << std::endl;
+			return false;
+		}
+		client.toSend.erase(0, sent);
+	}
+	// Only wait for the socket to be writable while there's something to write
+	struct epoll_event event = {};
+	event.events = EPOLLIN | EPOLLRDHUP | (client.toSend.empty() ? 0u : (uint32_t) EPOLLOUT);
+	event.data.fd = fd;
+	epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+	return true;
+}
+
+void ControlPacketReceiver::closeClient(int fd){
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients.erase(fd);
+	std::cout << "Controller disconnected. (" << clients.size() << " connected)" << std::endl;
 }
 
 ControlPacketReceiver::~ControlPacketReceiver(){
 	std::cout << "Destroying control packet receiver..." << std::endl;
-	destroyReceiver=true;
+	{
+		std::lock_guard<std::mutex> lock(commandLock);
+		destroyReceiver=true;
+	}
+	commandCondition.notify_all();
+	uint64_t one = 1;
+	if (wakeFd >= 0) write(wakeFd, &one, sizeof(one));
+	if (receiverThread.joinable()) receiverThread.join();
+	// A command that's running finishes first
+	if (commandThread.joinable()) commandThread.join();
+	for (auto& entry : clients) close(entry.first);
+	if (epollFd >= 0) close(epollFd);
+	if (wakeFd >= 0) close(wakeFd);
 	close(servFd);
-	receiverThread.join();
 	std::cout << "Control Packet Receiver destroyed." << std::endl;
-}
\ No newline at end of file
+}
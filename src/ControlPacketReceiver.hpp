@@ -8,24 +8,72 @@
 #include <cstring>
 #include <functional>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
 
-/* ControlPacketReceiver(std::function<const char*(char*)> parsePacketCallback, short port=58000)
-** This class sets up a listening tcp socket on the specified port (58000 if not specified) 
+/* ControlPacketReceiver(std::function<std::string(std::string)> parsePacketCallback, short port=58000, std::vector<std::string> slowCommands={})
+** This class sets up a listening tcp socket on the specified port (58000 if not specified)
 ** and sends received messages to the callback function provided to its constructor.
-** If the connection is interrupted, it will wait for it to be re-established.
+** Any number of clients can be connected at once; one epoll thread serves all of them.
+** Messages are framed either by a newline, or (for messages that contain newlines) by a length prefix: <decimal length>:<message>
+**  (Commands never start with a digit, so the two can't be confused.)
+** The callback gets each message with a newline on the end, like it would have been typed into netcat.
+** Commands named in slowCommands (e.g. "reset", which reopens a camera) are queued and run in order on a worker thread,
+**  so they don't hold up other commands. Their sender gets "Queued <id>" right away, and "Done <id>:" followed by the status when it finishes.
+**  Everything else runs immediately, and the status is sent back directly.
 ** This class logs its operations to stdout.
 */
 class ControlPacketReceiver{
 private:
     int servFd=-1;
+    int epollFd=-1;
+    // Wakes the epoll thread when a queued command finishes, or the receiver is being destroyed
+    int wakeFd=-1;
     short port;
     std::thread receiverThread;
     volatile bool destroyReceiver=false; //Gets set to true when receiver's destructor is called. This is so we can properly clean up the network socket we create.
     int setupSocket(); //Initializes network socket.
-    void receivePackets(); //Self-resetting loop that receives control packets. Runs on a seperate thread.
+    void receivePackets(); //epoll loop that accepts clients and receives control packets. Runs on a seperate thread.
     std::function<std::string(std::string controlMessage)> parsePacketCallback; //Callback function that parses control messages received.
+
+    static constexpr size_t MAX_MESSAGE_SIZE=65536;
+    static constexpr unsigned int MAX_CLIENTS=16;
+    struct Client {
+        uint64_t id; // fds get reused, so finished commands find their client by this instead
+        std::string received; // Bytes that haven't made a whole message yet
+        std::string toSend; // Bytes the socket wasn't ready for yet
+    };
+    // Only touched by the epoll thread
+    std::map<int, Client> clients;
+    uint64_t nextClientId=1;
+    void acceptClient();
+    // Returns false if the client should be disconnected
+    bool readClient(int fd);
+    void handleMessage(int fd, Client& client, const std::string& message);
+    void sendToClient(int fd, Client& client, const std::string& data);
+    bool flushClient(int fd, Client& client);
+    void closeClient(int fd);
+
+    // Slow commands, run in order by commandThread
+    std::vector<std::string> slowCommands;
+    struct QueuedCommand {
+        uint64_t commandId, clientId;
+        std::string message, status;
+    };
+    std::deque<QueuedCommand> commandQueue, finishedCommands;
+    std::mutex commandLock;
+    std::condition_variable commandCondition;
+    uint64_t nextCommandId=1;
+    std::thread commandThread;
+    void runCommands();
+    // Sends finished commands' statuses to their clients. Runs on the epoll thread.
+    void deliverFinished();
 public:
-    ControlPacketReceiver(std::function<std::string(std::string)> parsePacketCallback,short port=58000);
+    ControlPacketReceiver(std::function<std::string(std::string)> parsePacketCallback,short port=58000,std::vector<std::string> slowCommands={});
     ~ControlPacketReceiver();
     void start();
-};
\ No newline at end of file
+};
@@ -28,6 +28,7 @@
 using std::cout; using std::cerr; using std::endl; using std::string;
 
 void DataComm::setupSocket() {
+    if (fd >= 0) close(fd);
     fd = -1;
     
     // addrinfo is linked list
@@ -41,64 +42,180 @@ void DataComm::setupSocket() {
     int error = getaddrinfo(client_name, this->port, &hints, &addrs);
     if (error != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+        return;
     }
     
+    int newFd = -1;
     for (struct addrinfo* rp = addrs; rp != nullptr; rp = rp->ai_next) {
         
-        fd = socket(rp->ai_family, rp->ai_socktype,
+        newFd = socket(rp->ai_family, rp->ai_socktype,
                         rp->ai_protocol);
-        if (fd == -1) continue;
+        if (newFd == -1) continue;
         
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+        if (connect(newFd, rp->ai_addr, rp->ai_addrlen) == 0) {
             break;
         }
         else {
-            close(fd);
-            fd = -1;
+            close(newFd);
+            newFd = -1;
             perror("connect failed");
         }
     }
     freeaddrinfo(addrs);
-    if (fd == -1) {
+    if (newFd == -1) {
         printf("could not resolve or connect to: %s\n", client_name);
         return;
     }
-    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    fcntl(newFd, F_SETFD, fcntl(newFd, F_GETFD) | FD_CLOEXEC);
+    fd = newFd;
 }
 DataComm::DataComm(const char* client_name, const char* port="5808") : client_name(client_name) {
     this->port=port;
-    setupSocket();
+    senderThread = std::thread(&DataComm::senderLoop, this);
+}
+DataComm::~DataComm() {
+    {
+        std::lock_guard<std::mutex> lock(mailboxLock);
+        running = false;
+    }
+    mailboxCondition.notify_all();
+    senderThread.join();
+    if (fd >= 0) close(fd);
 }
 
+DataComm::Stats DataComm::getStats() {
+    std::lock_guard<std::mutex> lock(statsLock);
+    return stats;
+}
 
-void DataComm::sendData(VisionData data, std::chrono::time_point<std::chrono::steady_clock> timeFrom) {
-    std::stringstream toSend;
-    
-    if (fd < 0) setupSocket();
+void DataComm::senderLoop() {
+    auto backoff = std::chrono::steady_clock::duration(minBackoff);
+    auto nextConnect = clock.now();
+    auto lastReport = clock.now();
+    Stats lastStats;
     
-    if (fd >= 0) {
-    
-        
-        char buf[200];
-        sprintf(buf, "# distance=%f tapeAngle=%f robotAngle=%f\n", data.distance, data.tapeAngle, data.robotAngle);
-        toSend << buf;
-        
-        toSend << "@" <<
-        std::chrono::duration_cast<std::chrono::milliseconds>(clock.now() - timeFrom).count()
-            << endl;
+    while (running) {
+        // Results go first
+        telemetry::Packet packets[2];
+        int packetCount = 0;
+        {
+            std::unique_lock<std::mutex> lock(mailboxLock);
+            mailboxCondition.wait_for(lock, std::chrono::seconds(1), [this]() { return resultSlot.full || drawSlot.full || !running; });
+            if (!running) break;
+            for (Slot* slot : { &resultSlot, &drawSlot }) {
+                if (!slot->full) continue;
+                packets[packetCount++] = slot->packet;
+                slot->full = false;
+            }
+        }
         
-        string sendStr = toSend.str();
+        for (int i = 0; i < packetCount; ++i) {
+            const telemetry::Packet& packet = packets[i];
+            auto now = clock.now();
+            if (fd < 0 && now >= nextConnect) {
+                // This is what can block for seconds, which is why it's on this thread
+                setupSocket();
+                if (fd < 0) {
+                    backoff = std::min<std::chrono::steady_clock::duration>(backoff * 2, maxBackoff);
+                    nextConnect = clock.now() + backoff;
+                }
+                else backoff = minBackoff;
+            }
+            bool sent = fd >= 0 && sendNow(packet);
+            if (!sent && fd >= 0) {
+                // Try a new socket next time, e.g. in case the RIO's address changed
+                close(fd);
+                fd = -1;
+                nextConnect = clock.now() + backoff;
+            }
+            std::lock_guard<std::mutex> lock(statsLock);
+            if (sent) ++stats.sent;
+            else ++stats.dropped;
+        }
         
-        if (send(fd, sendStr.c_str(), sendStr.length(), 0) < 0 && errno!=EAGAIN) {
-            perror("Failed to send data to robot");
-            setupSocket();
+        if (clock.now() - lastReport >= std::chrono::seconds(10)) {
+            Stats current = getStats();
+            if (current.sent != lastStats.sent || current.dropped != lastStats.dropped) {
+                cout << "Sent " << current.sent - lastStats.sent << " results to the robot in the past 10 s, "
+                << current.coalesced - lastStats.coalesced << " coalesced, " << current.dropped - lastStats.dropped << " dropped" << endl;
+            }
+            lastStats = current;
+            lastReport = clock.now();
         }
-        cout << sendStr << std::endl;
-	}
-};
-void DataComm::sendDraw(VisionDrawPoints* data){
-    if(send(fd,(void*) data,sizeof(VisionDrawPoints),0) < 0){
-        perror("Failed to send draw points!");
-        setupSocket();
     }
+}
+
+
+void DataComm::sendData(VisionData data, std::chrono::time_point<std::chrono::steady_clock> timeFrom) {
+    VisionResults results;
+    results.count = 1;
+    results.targets[0].calcs = data;
+    results.targets[0].score = 1;
+    sendResults(results, timeFrom);
+}
+void DataComm::sendResults(const VisionResults& results, std::chrono::time_point<std::chrono::steady_clock> timeFrom, bool withDrawPoints) {
+    telemetry::Packet packet;
+    packet.captureTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(timeFrom.time_since_epoch()).count();
+    packet.latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(clock.now() - timeFrom).count();
+    
+    packet.targetCount = std::min(results.count, telemetry::MAX_TARGETS);
+    for (unsigned int i = 0; i < packet.targetCount; ++i) {
+        const VisionTarget& target = results.targets[i];
+        packet.targets[i] = { (float) target.calcs.distance, (float) target.calcs.tapeAngle, (float) target.calcs.robotAngle, target.score };
+    }
+    if (withDrawPoints && results.found()) {
+        // Only the best target's
+        packet.hasDrawPoints = true;
+        packet.drawPointCount = 4;
+        for (unsigned int i = 0; i < 4; ++i) packet.drawPoints[i] = { results.best().drawPoints.contour[i].x, results.best().drawPoints.contour[i].y };
+    }
+    sendPacket(packet, resultSlot);
+}
+void DataComm::sendPacket(const telemetry::Packet& packet, Slot& slot) {
+    bool coalesced;
+    {
+        std::lock_guard<std::mutex> lock(mailboxLock);
+        coalesced = slot.full;
+        slot.packet = packet;
+        slot.full = true;
+    }
+    mailboxCondition.notify_one();
+    if (coalesced) {
+        std::lock_guard<std::mutex> lock(statsLock);
+        ++stats.coalesced;
+    }
+}
+bool DataComm::sendNow(const telemetry::Packet& packet) {
+    // Both formats are built on the stack
+    char buf[std::max<size_t>(telemetry::MAX_PACKET_SIZE, 200)];
+    size_t size;
+    if (format == Format::Binary) {
+        telemetry::Packet numbered = packet;
+        numbered.sequence = sequence++;
+        size = telemetry::encode(numbered, (uint8_t*) buf, sizeof(buf));
+    }
+    else if (packet.drawOnly) {
+        // sendDraw() in the old format was the raw struct
+        VisionDrawPoints drawPoints;
+        for (unsigned int i = 0; i < 4; ++i) drawPoints.contour[i] = cv::Point2f(packet.drawPoints[i].x, packet.drawPoints[i].y);
+        memcpy(buf, &drawPoints, sizeof(drawPoints));
+        size = sizeof(drawPoints);
+    }
+    else size = std::min<size_t>(telemetry::formatText(packet, buf, sizeof(buf)), sizeof(buf) - 1);
+    
+    if (send(fd, buf, size, MSG_DONTWAIT) < 0 && errno!=EAGAIN) {
+        perror("Failed to send data to robot");
+        return false;
+    }
+    if (verboseMode && format == Format::Text && packet.targetCount > 0) cout << buf << std::endl;
+    return true;
+}
+void DataComm::sendDraw(VisionDrawPoints* data){
+    // A packet with no targets, just the points, and marked so the RIO doesn't take it for seeing nothing
+    telemetry::Packet packet;
+    packet.drawOnly = true;
+    packet.hasDrawPoints = true;
+    packet.drawPointCount = 4;
+    for (unsigned int i = 0; i < 4; ++i) packet.drawPoints[i] = { data->contour[i].x, data->contour[i].y };
+    sendPacket(packet, drawSlot);
 }
\ No newline at end of file
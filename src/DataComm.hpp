@@ -1,15 +1,67 @@
 #pragma once
 #include <vector>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "vision.hpp"
+#include "TelemetryProtocol.hpp"
+
+/* class DataComm
+** Sends vision results to the RIO over UDP.
+** Sending happens on its own thread, so the vision thread never waits on the network (or on getaddrinfo while the RIO reboots).
+** Results go through a single-slot mailbox: if a new one arrives before the last was sent, the old one is coalesced away, since only the newest matters.
+**  Draw-only packets (sendDraw()) have a slot of their own, so they can never coalesce away a result the robot is aiming with.
+** If the socket can't be opened, it's retried with exponential backoff, and results arriving in the meantime are dropped.
+*/
 class DataComm{
-    int fd=-1;
+    std::atomic<int> fd{-1};
     const char* client_name;
     const char* port;
     std::chrono::steady_clock clock;
-public:
+    // Sequence number of the next binary packet
+    uint32_t sequence=0;
+    // Only called from senderLoop()
     void setupSocket();
+    struct Slot {
+        telemetry::Packet packet;
+        bool full=false;
+    };
+    void sendPacket(const telemetry::Packet& packet, Slot& slot);
+    // Returns false if the send failed, and the socket should be reopened.
+    bool sendNow(const telemetry::Packet& packet);
+
+    // The newest result and draw packet, waiting for senderLoop(). Guarded by mailboxLock.
+    std::mutex mailboxLock;
+    std::condition_variable mailboxCondition;
+    Slot resultSlot, drawSlot;
+    volatile bool running=true;
+    std::thread senderThread;
+    void senderLoop();
+public:
+    enum class Format { Binary, Text };
+    // Binary is the versioned format in TelemetryProtocol.hpp. Text is the old "# distance=..." format, for robot code that hasn't moved over.
+    Format format=Format::Binary;
+
+    // Reconnection backoff starts at the minimum, and doubles every failure up to the maximum.
+    std::chrono::milliseconds minBackoff=std::chrono::milliseconds(100), maxBackoff=std::chrono::milliseconds(5000);
+
+    struct Stats {
+        unsigned long sent=0; // Results that made it onto the network
+        unsigned long coalesced=0; // Results replaced by a newer one before they could be sent
+        unsigned long dropped=0; // Results that couldn't be sent, because the socket was down or the send failed
+    };
+    // Counts since the program started
+    Stats getStats();
+
     DataComm(const char* client_name,const char* port);
+    ~DataComm();
     void sendData(VisionData data, std::chrono::time_point<std::chrono::steady_clock> timeFrom);
+    // Sends every target found in a frame, best first, with their scores as the confidences. The text format only has room for the best.
+    void sendResults(const VisionResults& results, std::chrono::time_point<std::chrono::steady_clock> timeFrom, bool withDrawPoints=false);
     void sendDraw(VisionDrawPoints* data);
+private:
+    std::mutex statsLock;
+    Stats stats;
 };
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "EncodedStream.hpp"
+
+#include <iostream>
+
+std::unique_ptr<EncodedStream> EncodedStream::create(const std::vector<std::string>& backends, const EncoderConfig& config) {
+	std::unique_ptr<Encoder> encoder = createEncoder(backends, config);
+	if (!encoder) return nullptr;
+	return std::unique_ptr<EncodedStream>(new EncodedStream(std::move(encoder), config));
+}
+
+EncodedStream::EncodedStream(std::unique_ptr<Encoder> encoder, const EncoderConfig& config)
+: config(config), encoder(std::move(encoder)) {
+	encodeThread = std::thread(&EncodedStream::encodeLoop, this);
+}
+EncodedStream::~EncodedStream() {
+	running = false;
+	pendingCondition.notify_one();
+	encodeThread.join();
+}
+
+void EncodedStream::submitFrame(const cv::Mat& frame) {
+	std::unique_lock<std::mutex> lock(pendingLock);
+	if (hasPending) ++droppedFrames;
+	convertYUYVToI420(frame, pending);
+	pendingTime = std::chrono::steady_clock::now();
+	hasPending = true;
+	lock.unlock();
+	pendingCondition.notify_one();
+}
+
+void EncodedStream::setPacing(double frameIntervalFraction, unsigned int burstPackets) {
+	auto window = std::chrono::duration<double>(frameIntervalFraction / config.fps);
+	sender.setPacing(std::chrono::duration_cast<std::chrono::steady_clock::duration>(window), burstPackets);
+}
+
+void EncodedStream::setBitrate(int bitrate) {
+	std::lock_guard<std::mutex> lock(encoderLock);
+	config.bitrate = bitrate;
+	encoder->setBitrate(bitrate);
+}
+void EncodedStream::requestKeyframe() {
+	std::lock_guard<std::mutex> lock(encoderLock);
+	encoder->requestKeyframe();
+}
+
+bool EncodedStream::setRegionQuality(const std::vector<RegionQuality>& regions, float defaultQpOffset) {
+	std::lock_guard<std::mutex> lock(encoderLock);
+	return encoder->setRegionQuality(regions, defaultQpOffset);
+}
+
+void EncodedStream::encodeLoop() {
+	while (running) {
+		{
+			std::unique_lock<std::mutex> lock(pendingLock);
+			pendingCondition.wait(lock, [this]() { return hasPending || !running; });
+			if (!running) return;
+			std::swap(pending, encoding);
+			output.captureTime = pendingTime;
+			hasPending = false;
+		}
+		bool encoded;
+		{
+			std::lock_guard<std::mutex> lock(encoderLock);
+			encoded = encoder->encode(encoding, output);
+		}
+		if (encoded) sender.sendFrame(output);
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+#include "Encoder.hpp"
+#include "RtpSender.hpp"
+
+/* class EncodedStream
+** Encodes frames and sends them over RTP, in-process, on its own thread.
+** submitFrame() only converts the frame to the encoder's input format and returns, so the compositor never waits on the encoder.
+** If the encoder falls behind, the frame that was waiting is replaced by the newer one.
+*/
+class EncodedStream {
+public:
+	// Returns nullptr if none of the backends could be created
+	static std::unique_ptr<EncodedStream> create(const std::vector<std::string>& backends, const EncoderConfig& config);
+	~EncodedStream();
+
+	bool setDestination(const std::string& host, const std::string& port) { return sender.setDestination(host, port); }
+	// See RtpSender::setPacing(). The window is a fraction of the frame interval, since the encoder thread waits on it.
+	void setPacing(double frameIntervalFraction, unsigned int burstPackets = 8);
+	RtpSender::Stats takeSenderStats() { return sender.takeStats(); }
+	void setSsrc(uint32_t ssrc) { sender.setSsrc(ssrc); }
+	// Converts a YUYV frame and queues it for encoding.
+	void submitFrame(const cv::Mat& frame);
+	void setBitrate(int bitrate);
+	void requestKeyframe();
+	// See Encoder::setRegionQuality()
+	bool setRegionQuality(const std::vector<RegionQuality>& regions, float defaultQpOffset);
+
+	const EncoderConfig& getConfig() { return config; }
+	const char* getEncoderName() { return encoder->getName(); }
+	// Frames that were replaced before the encoder got to them
+	unsigned long getDroppedFrames() { return droppedFrames; }
+
+private:
+	EncodedStream(std::unique_ptr<Encoder> encoder, const EncoderConfig& config);
+	EncoderConfig config;
+	std::unique_ptr<Encoder> encoder;
+	RtpSender sender;
+
+	// The frame waiting to be encoded, and the one being encoded. They're swapped instead of copied.
+	I420Picture pending, encoding;
+	std::chrono::steady_clock::time_point pendingTime;
+	bool hasPending = false;
+	volatile unsigned long droppedFrames = 0;
+	std::mutex pendingLock;
+	// Held while calling the encoder, because bitrate and keyframe changes come from other threads
+	std::mutex encoderLock;
+	std::condition_variable pendingCondition;
+
+	volatile bool running = true;
+	std::thread encodeThread;
+	void encodeLoop();
+	EncodedFrame output;
+};
@@ -0,0 +1,179 @@
+#include "Encoder.hpp"
+
+#include <iostream>
+#include <map>
+#include <cstring>
+
+#ifdef HAVE_X264
+extern "C" {
+#include <x264.h>
+}
+#endif
+
+void I420Picture::create(int width, int height) {
+	assert(width % 2 == 0 && height % 2 == 0);
+	this->width = width; this->height = height;
+	data.resize(width*height + 2*(width/2)*(height/2));
+}
+
+void convertYUYVToI420(const cv::Mat& in, I420Picture& out) {
+	assert(in.type() == CV_8UC2);
+	out.create(in.cols, in.rows);
+	const int width = in.cols, chromaWidth = in.cols / 2;
+
+	for (int y = 0; y < in.rows; y += 2) {
+		// Y0 U Y1 V
+		const uint8_t* row0 = in.ptr<uint8_t>(y);
+		const uint8_t* row1 = in.ptr<uint8_t>(y + 1);
+		uint8_t* lum0 = out.y() + y*width;
+		uint8_t* lum1 = lum0 + width;
+		uint8_t* u = out.u() + (y/2)*chromaWidth;
+		uint8_t* v = out.v() + (y/2)*chromaWidth;
+
+		for (int x = 0; x < chromaWidth; ++x) {
+			lum0[2*x] = row0[4*x]; lum0[2*x + 1] = row0[4*x + 2];
+			lum1[2*x] = row1[4*x]; lum1[2*x + 1] = row1[4*x + 2];
+			u[x] = (row0[4*x + 1] + row1[4*x + 1] + 1) / 2;
+			v[x] = (row0[4*x + 3] + row1[4*x + 3] + 1) / 2;
+		}
+	}
+}
+
+void EncodedFrame::appendNal(const uint8_t* nal, size_t size) {
+	// Start codes are 00 00 01 or 00 00 00 01
+	if (size >= 3 && nal[0] == 0 && nal[1] == 0) {
+		size_t start = (nal[2] == 1) ? 3 : ((size >= 4 && nal[2] == 0 && nal[3] == 1) ? 4 : 0);
+		nal += start; size -= start;
+	}
+	if (size == 0) return;
+	nals.push_back({ data.size(), size });
+	data.insert(data.end(), nal, nal + size);
+}
+
+#ifdef HAVE_X264
+// Software encoder, for development machines and anything without a hardware encoder.
+// Tuned for latency: no B-frames, no lookahead, and one frame out for every frame in.
+class X264Encoder : public Encoder {
+	x264_param_t param;
+	x264_t* encoder = nullptr;
+	int64_t frameNum = 0;
+	bool keyframeRequested = false;
+	// One offset per 16x16 macroblock, in raster order. Empty if there are no regions.
+	std::vector<float> quantOffsets;
+
+	void setRateControl(int bitrate) {
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = bitrate / 1000; // kbps
+		// A VBV buffer of a single frame keeps big frames from building up latency
+		param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
+		param.rc.i_vbv_buffer_size = std::max(1, (int) (param.rc.i_bitrate / (param.i_fps_num / (double) param.i_fps_den)));
+	}
+public:
+	bool open(const EncoderConfig& config) {
+		if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) return false;
+		param.i_width = config.width;
+		param.i_height = config.height;
+		param.i_csp = X264_CSP_I420;
+		param.i_fps_num = (int) round(config.fps * 1000);
+		param.i_fps_den = 1000;
+		param.b_vfr_input = 0;
+		param.i_keyint_max = config.keyframeInterval;
+		// SPS/PPS with every keyframe, so the receiver can start at any keyframe
+		param.b_repeat_headers = 1;
+		param.b_annexb = 1;
+		param.i_log_level = X264_LOG_WARNING;
+		setRateControl(config.bitrate);
+		// ultrafast turns off adaptive quantization, but x264 ignores quant_offsets (for setRegionQuality()) without it,
+		// and it can't be turned on by reconfiguring later.
+		param.rc.i_aq_mode = X264_AQ_VARIANCE;
+		param.rc.f_aq_strength = 1.0;
+		if (x264_param_apply_profile(&param, "high") < 0) return false;
+
+		encoder = x264_encoder_open(&param);
+		return encoder != nullptr;
+	}
+	~X264Encoder() {
+		if (encoder != nullptr) x264_encoder_close(encoder);
+	}
+
+	bool encode(I420Picture& picture, EncodedFrame& out) override {
+		out.clear();
+		assert(picture.width == param.i_width && picture.height == param.i_height);
+
+		x264_picture_t in, encoded;
+		x264_picture_init(&in);
+		in.img.i_csp = X264_CSP_I420;
+		in.img.i_plane = 3;
+		in.img.plane[0] = picture.y(); in.img.i_stride[0] = picture.width;
+		in.img.plane[1] = picture.u(); in.img.i_stride[1] = picture.width / 2;
+		in.img.plane[2] = picture.v(); in.img.i_stride[2] = picture.width / 2;
+		in.i_pts = frameNum++;
+		in.i_type = keyframeRequested ? X264_TYPE_IDR : X264_TYPE_AUTO;
+		// x264 reads this while encoding the frame, and doesn't free it since quant_offsets_free isn't set.
+		if (!quantOffsets.empty()) in.prop.quant_offsets = quantOffsets.data();
+		keyframeRequested = false;
+
+		x264_nal_t* nals;
+		int nalCount;
+		if (x264_encoder_encode(encoder, &nals, &nalCount, &in, &encoded) < 0) {
+			std::cerr << "x264_encoder_encode failed" << std::endl;
+			return false;
+		}
+		for (int i = 0; i < nalCount; ++i) out.appendNal(nals[i].p_payload, nals[i].i_payload);
+		out.keyframe = encoded.b_keyframe;
+		return true;
+	}
+	void setBitrate(int bitrate) override {
+		setRateControl(bitrate);
+		if (x264_encoder_reconfig(encoder, &param) < 0) std::cerr << "x264_encoder_reconfig failed" << std::endl;
+	}
+	void requestKeyframe() override { keyframeRequested = true; }
+	const char* getName() override { return "x264"; }
+	
+	bool setRegionQuality(const std::vector<RegionQuality>& regions, float defaultQpOffset) override {
+		int mbWidth = (param.i_width + 15) / 16, mbHeight = (param.i_height + 15) / 16;
+		quantOffsets.assign(mbWidth * mbHeight, defaultQpOffset);
+		for (auto& region : regions) {
+			// Macroblocks whose centers are in the region
+			for (int mbY = 0; mbY < mbHeight; ++mbY) for (int mbX = 0; mbX < mbWidth; ++mbX) {
+				if (region.rect.contains(cv::Point(mbX*16 + 8, mbY*16 + 8))) quantOffsets[mbY*mbWidth + mbX] = region.qpOffset;
+			}
+		}
+		return true;
+	}
+};
+#endif
+
+// Function-local so that it's initialized before any other file's static initializers register to it.
+static std::map<std::string, EncoderFactory>& getEncoderRegistry() {
+	static std::map<std::string, EncoderFactory> registry {
+#ifdef HAVE_X264
+		{ "x264", [](const EncoderConfig& config) -> std::unique_ptr<Encoder> {
+			auto encoder = std::make_unique<X264Encoder>();
+			if (!encoder->open(config)) return nullptr;
+			return encoder;
+		}},
+#endif
+	};
+	return registry;
+}
+
+void registerEncoder(const std::string& name, EncoderFactory factory) {
+	getEncoderRegistry()[name] = factory;
+}
+
+std::unique_ptr<Encoder> createEncoder(const std::vector<std::string>& backends, const EncoderConfig& config) {
+	auto& registry = getEncoderRegistry();
+	for (auto& name : backends) {
+		auto factory = registry.find(name);
+		if (factory == registry.end()) continue;
+
+		std::unique_ptr<Encoder> encoder = factory->second(config);
+		if (encoder) {
+			std::cout << "Using " << name << " encoder at " << config.width << "x" << config.height << ", " << config.bitrate << " bps" << std::endl;
+			return encoder;
+		}
+		std::cerr << "Encoder " << name << " failed to initialize" << std::endl;
+	}
+	return nullptr;
+}
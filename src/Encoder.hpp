@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <chrono>
+
+#include <opencv2/core.hpp>
+
+// In-process H.264 encoding, which replaces the gst-launch pipeline when a backend is available.
+// Backends are registered by name, so a hardware encoder can be plugged in without touching the streaming code.
+
+// A planar YUV 4:2:0 picture, which is what encoders (both x264 and the pi's hardware) want as input.
+struct I420Picture {
+	int width = 0, height = 0;
+	std::vector<uint8_t> data;
+	void create(int width, int height);
+	uint8_t* y() { return data.data(); }
+	uint8_t* u() { return data.data() + width*height; }
+	uint8_t* v() { return data.data() + width*height + (width/2)*(height/2); }
+};
+// Converts a YUYV (4:2:2) frame, which is what the cameras and the framebuffer use, to I420. Chroma is averaged between pairs of rows.
+void convertYUYVToI420(const cv::Mat& in, I420Picture& out);
+
+// The output of encoding one frame. data holds the NAL units back-to-back, without Annex B start codes.
+// It's reused from frame to frame, so that it doesn't reallocate.
+struct EncodedFrame {
+	struct Nal {
+		size_t offset, size;
+	};
+	std::vector<uint8_t> data;
+	std::vector<Nal> nals;
+	bool keyframe = false;
+	// The time that the frame was composited, for the RTP timestamp
+	std::chrono::steady_clock::time_point captureTime;
+
+	void clear() { data.clear(); nals.clear(); keyframe = false; }
+	// Appends a NAL unit, stripping the Annex B start code if there is one.
+	void appendNal(const uint8_t* nal, size_t size);
+};
+
+// Spend more or fewer bits on part of the frame. qpOffset is added to the quantizer, so negative is higher quality.
+// (Each step of 6 roughly halves or doubles the bits spent.)
+struct RegionQuality {
+	cv::Rect2i rect;
+	float qpOffset;
+};
+
+struct EncoderConfig {
+	int width, height;
+	double fps = 30;
+	int bitrate = 1000000; // bits/second
+	// Frames between keyframes. Lower recovers from packet loss faster, at the cost of bitrate.
+	int keyframeInterval = 60;
+};
+
+class Encoder {
+public:
+	virtual ~Encoder() {}
+	// Encodes a frame. Returns false if the encoder failed; out is then empty.
+	virtual bool encode(I420Picture& picture, EncodedFrame& out) = 0;
+	// Changes the target bitrate without restarting the encoder.
+	virtual void setBitrate(int bitrate) = 0;
+	// The next frame will be a keyframe. (For when the receiver has just connected or lost packets)
+	virtual void requestKeyframe() = 0;
+	virtual const char* getName() = 0;
+	/* Sets per-region quality for the following frames. Where regions overlap, later ones win.
+	** Everything outside of them gets defaultQpOffset. Returns false if the backend doesn't support it.
+	*/
+	virtual bool setRegionQuality(const std::vector<RegionQuality>& regions, float defaultQpOffset) { return false; }
+};
+
+// Creates an encoder, or returns nullptr if the backend isn't usable (e.g. the hardware isn't present).
+typedef std::function<std::unique_ptr<Encoder>(const EncoderConfig&)> EncoderFactory;
+// Adds a backend. A hardware encoder can call this at startup to make itself available.
+void registerEncoder(const std::string& name, EncoderFactory factory);
+// Tries each named backend in order, returning the first that initializes, or nullptr if none do.
+std::unique_ptr<Encoder> createEncoder(const std::vector<std::string>& backends, const EncoderConfig& config);
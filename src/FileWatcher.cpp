@@ -0,0 +1,134 @@
+#include "FileWatcher.hpp"
+
+#include <iostream>
+#include <chrono>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+// How long to wait for more changes before reporting them
+static constexpr int SETTLE_MS = 100;
+// Every watch uses the same mask, since inotify only keeps one per directory
+static constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE;
+
+static std::string parentOf(const std::string& path) {
+	size_t slash = path.find_last_of('/');
+	return (slash == std::string::npos) ? "." : path.substr(0, std::max<size_t>(slash, 1));
+}
+static std::string nameOf(const std::string& path) {
+	size_t slash = path.find_last_of('/');
+	return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+FileWatcher::FileWatcher(std::function<void(const std::string&)> onChange) : onChange(onChange) {
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inotifyFd < 0 || wakeFd < 0) {
+		perror("FileWatcher inotify_init1/eventfd");
+		return;
+	}
+	watcherThread = std::thread(&FileWatcher::watchLoop, this);
+}
+
+FileWatcher::~FileWatcher() {
+	uint64_t one = 1;
+	if (wakeFd >= 0) write(wakeFd, &one, sizeof(one));
+	if (watcherThread.joinable()) watcherThread.join();
+	if (inotifyFd >= 0) close(inotifyFd);
+	if (wakeFd >= 0) close(wakeFd);
+}
+
+bool FileWatcher::watch(const std::string& path) {
+	if (inotifyFd < 0) return false;
+	std::string directory = parentOf(path);
+	std::string name = nameOf(path);
+
+	std::lock_guard<std::mutex> guard(lock);
+	// Adding the same directory again returns the same watch descriptor
+	int wd = inotify_add_watch(inotifyFd, directory.c_str(), WATCH_MASK);
+	if (wd < 0) {
+		perror(("FileWatcher: can't watch " + directory).c_str());
+		return false;
+	}
+	directories[wd] = directory;
+	watchedNames[directory].insert(name);
+	return true;
+}
+
+bool FileWatcher::watchDirectory(const std::string& directory) {
+	if (inotifyFd < 0) return false;
+	std::lock_guard<std::mutex> guard(lock);
+	watchedDirectories.insert(directory);
+	return armDirectory(directory);
+}
+
+bool FileWatcher::armDirectory(const std::string& directory) {
+	int wd = inotify_add_watch(inotifyFd, directory.c_str(), WATCH_MASK | IN_ONLYDIR);
+	if (wd >= 0) {
+		directories[wd] = directory;
+		return true;
+	}
+	std::string parent = parentOf(directory);
+	if (errno != ENOENT || parent == directory) {
+		perror(("FileWatcher: can't watch " + directory).c_str());
+		return false;
+	}
+	// Wait for it to be created
+	awaitedNames[parent].insert(nameOf(directory));
+	return armDirectory(parent);
+}
+
+void FileWatcher::watchLoop() {
+	std::set<std::string> changed;
+	while (true) {
+		struct pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+		// Once something has changed, only wait long enough to see if more is coming
+		int ready = poll(fds, 2, changed.empty() ? -1 : SETTLE_MS);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			perror("FileWatcher poll");
+			return;
+		}
+		if (fds[1].revents & POLLIN) return;
+
+		if (ready == 0) {
+			for (auto& path : changed) onChange(path);
+			changed.clear();
+			continue;
+		}
+
+		alignas(struct inotify_event) char buffer[4096];
+		ssize_t length;
+		while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+			for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+				struct inotify_event* event = (struct inotify_event*) p;
+				std::lock_guard<std::mutex> guard(lock);
+				auto directory = directories.find(event->wd);
+				if (directory == directories.end()) continue;
+				std::string path = directory->second;
+				// Watches every watched directory in (or at) prefix again, as far down as exists now
+				auto rearm = [&](const std::string& prefix) {
+					for (auto& watched : watchedDirectories) {
+						if (watched == prefix || watched.compare(0, prefix.size() + 1, prefix + "/") == 0) {
+							armDirectory(watched);
+							changed.insert(watched);
+						}
+					}
+				};
+				if (event->mask & IN_IGNORED) {
+					// The directory itself was removed. If it's one we're watching, or one we're waiting in, fall back to its parent.
+					directories.erase(directory);
+					rearm(path);
+					continue;
+				}
+				if (event->len == 0) continue;
+				if (watchedDirectories.count(path)) changed.insert(path);
+				if (watchedNames[path].count(event->name)) changed.insert(path + "/" + event->name);
+				// A directory we're waiting for (or one of its parents) showed up
+				if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && awaitedNames[path].count(event->name)) rearm(path + "/" + event->name);
+			}
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+/* class FileWatcher
+** Calls onChange(path) from its own thread whenever one of the watched files is written, created, or replaced.
+** It watches each file's directory with inotify rather than the file itself, since editors and scp replace files instead of writing them in place,
+**  and the file doesn't even have to exist yet.
+** Whole directories can be watched too, with watchDirectory().
+** Changes are collected for a short while before onChange is called, so a file saved in several writes is only reported once.
+*/
+class FileWatcher {
+public:
+	FileWatcher(std::function<void(const std::string&)> onChange);
+	~FileWatcher();
+	// Starts watching a file. Returns false if its directory can't be watched.
+	bool watch(const std::string& path);
+	/* Starts watching a directory. Anything in it being created, removed, or renamed is reported as onChange(directory).
+	** The directory doesn't have to exist yet. If it's removed and created again (udev does this to /dev/v4l/by-id
+	**  when the last camera is unplugged), that's reported as a change too, and watching carries on.
+	** Returns false if neither it nor any of its parents can be watched.
+	*/
+	bool watchDirectory(const std::string& directory);
+
+private:
+	std::function<void(const std::string&)> onChange;
+	int inotifyFd = -1;
+	// Wakes the watcher thread so it can exit
+	int wakeFd = -1;
+	std::mutex lock;
+	// Watch descriptor -> directory, and the names we care about in each directory
+	std::map<int, std::string> directories;
+	std::map<std::string, std::set<std::string>> watchedNames;
+	// Directories from watchDirectory(), and the names of missing directories (or their missing parents) we're waiting for in each directory
+	std::set<std::string> watchedDirectories;
+	std::map<std::string, std::set<std::string>> awaitedNames;
+	// Watches a directory, or if it doesn't exist, its nearest parent that does. lock must be held.
+	bool armDirectory(const std::string& directory);
+	std::thread watcherThread;
+	void watchLoop();
+};
@@ -0,0 +1,76 @@
+#include "FramePacer.hpp"
+
+#include <iostream>
+
+FramePacer::FramePacer(std::mutex& lock, std::function<void(bool)> emitFrame, std::function<bool(void)> tilesReady, std::function<bool(void)> anyTileNew)
+: lock(lock), emitFrame(emitFrame), tilesReady(tilesReady), anyTileNew(anyTileNew) {
+}
+FramePacer::~FramePacer() {
+	stop();
+}
+
+void FramePacer::start(double fps, std::chrono::steady_clock::duration lateDeadline) {
+	if (running) stop();
+	if (fps <= 0) {
+		std::cerr << "FramePacer: invalid framerate " << fps << std::endl;
+		return;
+	}
+	this->fps = fps;
+	interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+	// Waiting longer than a frame interval would just push every following frame late
+	this->lateDeadline = std::min(lateDeadline, interval / 2);
+
+	running = true;
+	pacerThread = std::thread(&FramePacer::pacerLoop, this);
+	std::cout << "Output paced at " << fps << " fps, waiting up to "
+	<< std::chrono::duration_cast<std::chrono::milliseconds>(this->lateDeadline).count() << " ms for late tiles" << std::endl;
+}
+void FramePacer::stop() {
+	if (!running) return;
+	running = false;
+	tileCondition.notify_all();
+	if (pacerThread.joinable()) pacerThread.join();
+}
+
+void FramePacer::notifyTile() {
+	tileCondition.notify_all();
+}
+
+FramePacer::Stats FramePacer::takeStats() {
+	std::lock_guard<std::mutex> guard(statsLock);
+	Stats ret = stats;
+	stats = Stats();
+	return ret;
+}
+
+void FramePacer::pacerLoop() {
+	auto nextTick = std::chrono::steady_clock::now() + interval;
+
+	while (running) {
+		std::this_thread::sleep_until(nextTick);
+
+		bool late, duplicate;
+		{
+			std::unique_lock<std::mutex> uniqueLock(lock);
+			late = !tilesReady();
+			if (late && lateDeadline.count() > 0) {
+				late = !tileCondition.wait_until(uniqueLock, nextTick + lateDeadline, [this]() { return tilesReady() || !running; });
+			}
+			if (!running) break;
+
+			duplicate = !anyTileNew();
+			emitFrame(duplicate);
+		}
+		{
+			std::lock_guard<std::mutex> guard(statsLock);
+			++stats.emitted;
+			if (duplicate) ++stats.duplicated;
+			else if (late) ++stats.late;
+		}
+
+		nextTick += interval;
+		// If we fell behind (e.g. the lock was held through a resolution change), skip the missed ticks instead of bursting to catch up.
+		auto now = std::chrono::steady_clock::now();
+		if (nextTick < now) nextTick = now + interval;
+	}
+}
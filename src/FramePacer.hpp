@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+/* class FramePacer
+** Emits output frames on a fixed cadence from its own thread, instead of whenever the cameras happen to deliver.
+** Every tick, if the tiles we care about aren't all fresh yet, it waits for them until lateDeadline after the tick,
+**  then emits anyway with whatever the newest tiles are.
+** It shares the caller's lock, so emitFrame and tilesReady are always called with that lock held.
+*/
+class FramePacer {
+public:
+	struct Stats {
+		unsigned long emitted = 0; // Every frame sent out
+		unsigned long duplicated = 0; // Frames sent out without a single new tile since the last one
+		unsigned long late = 0; // Frames sent out before all the tiles we care about had arrived
+	};
+
+	/* emitFrame(bool duplicate) outputs the frame. duplicate is true if no tile has changed since the last emitted frame.
+	** tilesReady() returns true if every tile we'd like to wait for has been updated since the last frame.
+	** anyTileNew() returns true if any tile has been updated since the last frame.
+	*/
+	FramePacer(std::mutex& lock, std::function<void(bool)> emitFrame, std::function<bool(void)> tilesReady, std::function<bool(void)> anyTileNew);
+	~FramePacer();
+
+	// Starts the pacing thread. A lateDeadline of zero means never wait for late tiles.
+	void start(double fps, std::chrono::steady_clock::duration lateDeadline);
+	void stop();
+	bool isRunning() { return running; }
+	double getFps() { return fps; }
+
+	// Must be called (without the lock held) whenever a tile is updated, so that a waiting tick can wake up.
+	void notifyTile();
+
+	// Returns the counts since the last call to takeStats(), and resets them.
+	Stats takeStats();
+
+private:
+	std::mutex& lock;
+	std::condition_variable tileCondition;
+	std::function<void(bool)> emitFrame;
+	std::function<bool(void)> tilesReady, anyTileNew;
+
+	double fps = 0;
+	std::chrono::steady_clock::duration interval, lateDeadline;
+	volatile bool running = false;
+	std::thread pacerThread;
+	void pacerLoop();
+
+	std::mutex statsLock;
+	Stats stats;
+};
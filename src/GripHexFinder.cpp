@@ -11,19 +11,16 @@ void GripHexFinder::Process(cv::Mat& source0){
 	//Step HSL_Threshold0:
 	//input
 	cv::Mat hslThresholdInput = source0;
-	double hslThresholdHue[] = {0.0, 180.0};
-	double hslThresholdSaturation[] = {0.0, 255.0};
-	double hslThresholdLuminance[] = {200.0, 255.0};
-	hslThreshold(hslThresholdInput, hslThresholdHue, hslThresholdSaturation, hslThresholdLuminance, this->hslThresholdOutput);
+	hslThreshold(hslThresholdInput, thresholds.hue, thresholds.saturation, thresholds.luminance, this->hslThresholdOutput);
 	//Step Find_Contours0:
 	//input
 	cv::Mat findContoursInput = hslThresholdOutput;
 	bool findContoursExternalOnly = false;  // default Boolean
-	findContours(findContoursInput, findContoursExternalOnly, this->findContoursOutput);
+	findContours(findContoursInput, findContoursExternalOnly, this->contoursOutput);
 	//Step Convex_Hulls0:
-	//input
-	std::vector<std::vector<cv::Point> > convexHullsContours = findContoursOutput;
-	convexHulls(convexHullsContours, this->convexHullsOutput);
+	convexHulls(this->contoursOutput);
+	//Step Contour_Stats0:
+	contoursOutput.computeStats();
 }
 
 /**
@@ -34,18 +31,11 @@ cv::Mat* GripHexFinder::GetHslThresholdOutput(){
 	return &(this->hslThresholdOutput);
 }
 /**
- * This method is a generated getter for the output of a Find_Contours.
- * @return ContoursReport output from Find_Contours.
- */
-std::vector<std::vector<cv::Point> >* GripHexFinder::GetFindContoursOutput(){
-	return &(this->findContoursOutput);
-}
-/**
- * This method is a generated getter for the output of a Convex_Hulls.
- * @return ContoursReport output from Convex_Hulls.
+ * Getter for the output of Find_Contours, Convex_Hulls and Contour_Stats.
+ * @return The contours, with their hulls and stats.
  */
-std::vector<std::vector<cv::Point> >* GripHexFinder::GetConvexHullsOutput(){
-	return &(this->convexHullsOutput);
+ContourStore* GripHexFinder::GetContoursOutput(){
+	return &(this->contoursOutput);
 }
 	/**
 	 * Segment an image based on hue, saturation, and luminance ranges.
@@ -58,8 +48,9 @@ std::vector<std::vector<cv::Point> >* GripHexFinder::GetConvexHullsOutput(){
 	 */
 	//void hslThreshold(Mat *input, double hue[], double sat[], double lum[], Mat *out) {
 	void GripHexFinder::hslThreshold(cv::Mat &input, double hue[], double sat[], double lum[], cv::Mat &out) {
-		cv::cvtColor(input, out, cv::COLOR_BGR2HLS);
-		cv::inRange(out, cv::Scalar(hue[0], lum[0], sat[0]), cv::Scalar(hue[1], lum[1], sat[1]), out);
+		// Converting into out then thresholding it in place would reallocate it every frame, since they're different types
+		cv::cvtColor(input, hlsImage, cv::COLOR_BGR2HLS);
+		cv::inRange(hlsImage, cv::Scalar(hue[0], lum[0], sat[0]), cv::Scalar(hue[1], lum[1], sat[1]), out);
 	}
 
 	/**
@@ -67,29 +58,24 @@ std::vector<std::vector<cv::Point> >* GripHexFinder::GetConvexHullsOutput(){
 	 *
 	 * @param input The image to find contours in.
 	 * @param externalOnly if only external contours are to be found.
-	 * @param contours vector of contours to put contours in.
+	 * @param contours store to put contours in.
 	 */
-	void GripHexFinder::findContours(cv::Mat &input, bool externalOnly, std::vector<std::vector<cv::Point> > &contours) {
-		std::vector<cv::Vec4i> hierarchy;
-		contours.clear();
+	void GripHexFinder::findContours(cv::Mat &input, bool externalOnly, ContourStore &contours) {
+		// cv::findContours only writes vectors of vectors. foundContours isn't cleared, so its inner vectors keep their memory.
 		int mode = externalOnly ? cv::RETR_EXTERNAL : cv::RETR_LIST;
 		int method = cv::CHAIN_APPROX_SIMPLE;
-		cv::findContours(input, contours, hierarchy, mode, method);
+		cv::findContours(input, foundContours, hierarchy, mode, method);
+		contours.clear();
+		for (auto& contour : foundContours) contours.add(contour);
 	}
 
 	/**
 	 * Compute the convex hulls of contours.
 	 *
-	 * @param inputContours The contours on which to perform the operation.
-	 * @param outputContours The contours where the output will be stored.
+	 * @param contours The contours on which to perform the operation. The hulls are stored alongside them.
 	 */
-	void GripHexFinder::convexHulls(std::vector<std::vector<cv::Point> > &inputContours, std::vector<std::vector<cv::Point> > &outputContours) {
-		std::vector<std::vector<cv::Point> > hull (inputContours.size());
-		outputContours.clear();
-		for (size_t i = 0; i < inputContours.size(); i++ ) {
-			cv::convexHull(cv::Mat((inputContours)[i]), hull[i], false);
-		}
-		outputContours = hull;
+	void GripHexFinder::convexHulls(ContourStore &contours) {
+		contours.addHulls();
 	}
 
 
@@ -12,27 +12,46 @@
 #include <string>
 #include <math.h>
 
+#include "ContourStore.hpp"
+
 namespace grip {
 
+/**
+* HSL threshold ranges, each as {min, max}. Hue is 0-180, saturation and luminance are 0-255.
+*/
+struct HslThresholds {
+	double hue[2] = {0.0, 180.0};
+	double saturation[2] = {0.0, 255.0};
+	double luminance[2] = {200.0, 255.0};
+};
+
 /**
 * GripHexFinder class.
 * 
 * An OpenCV pipeline generated by GRIP.
+* Keep one for as long as it's used, so its images and contour store keep their memory between frames.
 */
 class GripHexFinder {
 	public:
 		cv::Mat hslThresholdOutput;
-		std::vector<std::vector<cv::Point> > findContoursOutput;
-		std::vector<std::vector<cv::Point> > convexHullsOutput;
+		// Every contour, its hull, and their areas and bounds
+		ContourStore contoursOutput;
 		void hslThreshold(cv::Mat &, double [], double [], double [], cv::Mat &);
-		void findContours(cv::Mat &, bool , std::vector<std::vector<cv::Point> > &);
-		void convexHulls(std::vector<std::vector<cv::Point> > &, std::vector<std::vector<cv::Point> > &);
+		void findContours(cv::Mat &, bool , ContourStore &);
+		void convexHulls(ContourStore &);
 
 		GripHexFinder();
+		// Used by Process() from then on
+		HslThresholds thresholds;
 		void Process(cv::Mat& source0);
 		cv::Mat* GetHslThresholdOutput();
-		std::vector<std::vector<cv::Point> >* GetFindContoursOutput();
-		std::vector<std::vector<cv::Point> >* GetConvexHullsOutput();
+		ContourStore* GetContoursOutput();
+
+	private:
+		// Scratch for the stages, reused every frame
+		cv::Mat hlsImage;
+		std::vector<std::vector<cv::Point> > foundContours;
+		std::vector<cv::Vec4i> hierarchy;
 };
 
 
@@ -0,0 +1,168 @@
+#include "QuadPose.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// Solves a x = b for x, where b is a's last column, by Gaussian elimination with partial pivoting. a is overwritten.
+// Returns false if a is singular.
+template<int n> static bool solveLinear(double a[n][n + 1], double x[n]) {
+	for (int column = 0; column < n; ++column) {
+		int pivot = column;
+		for (int row = column + 1; row < n; ++row) if (fabs(a[row][column]) > fabs(a[pivot][column])) pivot = row;
+		if (fabs(a[pivot][column]) < 1e-12) return false;
+		if (pivot != column) for (int k = column; k <= n; ++k) std::swap(a[pivot][k], a[column][k]);
+		for (int row = column + 1; row < n; ++row) {
+			double factor = a[row][column] / a[column][column];
+			for (int k = column; k <= n; ++k) a[row][k] -= factor * a[column][k];
+		}
+	}
+	for (int row = n - 1; row >= 0; --row) {
+		double sum = a[row][n];
+		for (int k = row + 1; k < n; ++k) sum -= a[row][k] * x[k];
+		x[row] = sum / a[row][row];
+	}
+	return true;
+}
+
+// Homography (with H[2][2] = 1) taking the 4 model points exactly to the 4 normalized image points
+static bool quadHomography(const double model[4][2], const double image[4][2], double H[3][3]) {
+	double a[8][9];
+	for (int i = 0; i < 4; ++i) {
+		double x = model[i][0], y = model[i][1], u = image[i][0], v = image[i][1];
+		double uRow[9] = { x, y, 1, 0, 0, 0, -u*x, -u*y, u };
+		double vRow[9] = { 0, 0, 0, x, y, 1, -v*x, -v*y, v };
+		std::copy(uRow, uRow + 9, a[2*i]);
+		std::copy(vRow, vRow + 9, a[2*i + 1]);
+	}
+	double h[8];
+	if (!solveLinear<8>(a, h)) return false;
+	for (int i = 0; i < 8; ++i) H[i / 3][i % 3] = h[i];
+	H[2][2] = 1;
+	return true;
+}
+
+// A rotation taking the unit vector along (x, y, z) onto the z axis
+static void rotateToZAxis(double x, double y, double z, double Ra[3][3]) {
+	double norm = sqrt(x*x + y*y + z*z);
+	x /= norm; y /= norm; z /= norm;
+	if (fabs(1 + z) < std::numeric_limits<float>::epsilon()) {
+		// Pointing straight back
+		double flip[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, -1 } };
+		std::copy(&flip[0][0], &flip[0][0] + 9, &Ra[0][0]);
+		return;
+	}
+	double d = 1 / (1 + z);
+	double rotation[3][3] = {
+		{ 1 - x*x*d, -x*y*d, -x },
+		{ -x*y*d, 1 - y*y*d, -y },
+		{ x, y, 1 - (x*x + y*y)*d }
+	};
+	std::copy(&rotation[0][0], &rotation[0][0] + 9, &Ra[0][0]);
+}
+
+/* IPPE's core: the two rotations of the model plane whose projections have Jacobian J at the point that projects to (p, q).
+** This follows OpenCV's IPPE::PoseSolver::computeRotations(), which is the paper's closed form.
+** Returns false if J is degenerate.
+*/
+static bool ippeRotations(const double J[2][2], double p, double q, double R1[3][3], double R2[3][3]) {
+	double Ra[3][3];
+	rotateToZAxis(p, q, 1, Ra);
+	// Rv is Ra's transpose
+	double Rv[3][3];
+	for (int i = 0; i < 3; ++i) for (int j = 0; j < 3; ++j) Rv[i][j] = Ra[j][i];
+
+	double b00 = Rv[0][0] - p*Rv[2][0], b01 = Rv[0][1] - p*Rv[2][1];
+	double b10 = Rv[1][0] - q*Rv[2][0], b11 = Rv[1][1] - q*Rv[2][1];
+	double determinant = b00*b11 - b01*b10;
+	if (fabs(determinant) < 1e-12) return false;
+	double binv00 = b11 / determinant, binv01 = -b01 / determinant, binv10 = -b10 / determinant, binv11 = b00 / determinant;
+
+	double a00 = binv00*J[0][0] + binv01*J[1][0], a01 = binv00*J[0][1] + binv01*J[1][1];
+	double a10 = binv10*J[0][0] + binv11*J[1][0], a11 = binv10*J[0][1] + binv11*J[1][1];
+
+	// A's largest singular value
+	double ata00 = a00*a00 + a01*a01, ata01 = a00*a10 + a01*a11, ata11 = a10*a10 + a11*a11;
+	double gamma = sqrt(0.5 * (ata00 + ata11 + sqrt((ata00 - ata11)*(ata00 - ata11) + 4*ata01*ata01)));
+	if (!(gamma > std::numeric_limits<float>::epsilon())) return false;
+
+	double r00 = a00 / gamma, r01 = a01 / gamma, r10 = a10 / gamma, r11 = a11 / gamma;
+	// The third row of the 3x2 part of the rotation, up to its sign, which is what makes the two solutions
+	double b0 = sqrt(std::max(0.0, 1 - r00*r00 - r10*r10));
+	double b1 = sqrt(std::max(0.0, 1 - r01*r01 - r11*r11));
+	if (-r00*r01 - r10*r11 < 0) b1 = -b1;
+
+	double cross = r00*r11 - r01*r10;
+	for (int i = 0; i < 3; ++i) {
+		R1[i][0] = r00*Rv[i][0] + r10*Rv[i][1] + b0*Rv[i][2];
+		R1[i][1] = r01*Rv[i][0] + r11*Rv[i][1] + b1*Rv[i][2];
+		R1[i][2] = (b1*r10 - b0*r11)*Rv[i][0] + (b0*r01 - b1*r00)*Rv[i][1] + cross*Rv[i][2];
+
+		R2[i][0] = r00*Rv[i][0] + r10*Rv[i][1] - b0*Rv[i][2];
+		R2[i][1] = r01*Rv[i][0] + r11*Rv[i][1] - b1*Rv[i][2];
+		R2[i][2] = (b0*r11 - b1*r10)*Rv[i][0] + (b1*r00 - b0*r01)*Rv[i][1] + cross*Rv[i][2];
+	}
+	return true;
+}
+
+// The translation that best projects the model points (rotated by R) onto the normalized image points, by linear least squares
+static bool ippeTranslation(const double model[4][2], const double image[4][2], const double R[3][3], double t[3]) {
+	// For each point, t_x - u t_z = u p_z - p_x and t_y - v t_z = v p_z - p_y, where p is the rotated model point. These are A's normal equations.
+	double normal[3][4] = {};
+	for (int i = 0; i < 4; ++i) {
+		double px = R[0][0]*model[i][0] + R[0][1]*model[i][1];
+		double py = R[1][0]*model[i][0] + R[1][1]*model[i][1];
+		double pz = R[2][0]*model[i][0] + R[2][1]*model[i][1];
+		double u = image[i][0], v = image[i][1];
+		double rows[2][4] = { { 1, 0, -u, u*pz - px }, { 0, 1, -v, v*pz - py } };
+		for (auto& row : rows) for (int j = 0; j < 3; ++j) for (int k = 0; k < 4; ++k) normal[j][k] += row[j] * row[k];
+	}
+	return solveLinear<3>(normal, t);
+}
+
+int solveQuadPose(const double worldPoints[4][2], const cv::Point2f imagePoints[4], const double cameraMatrix[9], QuadPose solutions[2]) {
+	double fx = cameraMatrix[0], skew = cameraMatrix[1], cx = cameraMatrix[2], fy = cameraMatrix[4], cy = cameraMatrix[5];
+	if (fx == 0 || fy == 0) return 0;
+
+	// IPPE works about the model's centroid, and in normalized image coordinates
+	double centroid[2] = { 0, 0 };
+	for (int i = 0; i < 4; ++i) for (int j = 0; j < 2; ++j) centroid[j] += worldPoints[i][j] / 4;
+	double model[4][2], normalized[4][2];
+	for (int i = 0; i < 4; ++i) {
+		model[i][0] = worldPoints[i][0] - centroid[0];
+		model[i][1] = worldPoints[i][1] - centroid[1];
+		normalized[i][1] = (imagePoints[i].y - cy) / fy;
+		normalized[i][0] = (imagePoints[i].x - cx - skew*normalized[i][1]) / fx;
+	}
+
+	double H[3][3];
+	if (!quadHomography(model, normalized, H)) return 0;
+	// The homography's Jacobian at the centroid, and where the centroid ends up
+	double J[2][2] = {
+		{ H[0][0] - H[2][0]*H[0][2], H[0][1] - H[2][1]*H[0][2] },
+		{ H[1][0] - H[2][0]*H[1][2], H[1][1] - H[2][1]*H[1][2] }
+	};
+	double rotations[2][3][3];
+	if (!ippeRotations(J, H[0][2], H[1][2], rotations[0], rotations[1])) return 0;
+
+	for (int s = 0; s < 2; ++s) {
+		QuadPose& pose = solutions[s];
+		std::copy(&rotations[s][0][0], &rotations[s][0][0] + 9, &pose.R[0][0]);
+		double t[3];
+		if (!ippeTranslation(model, normalized, pose.R, t)) return 0;
+		// Back from the centroid to the model's own origin
+		for (int i = 0; i < 3; ++i) pose.t[i] = t[i] - pose.R[i][0]*centroid[0] - pose.R[i][1]*centroid[1];
+
+		double squaredError = 0;
+		for (int i = 0; i < 4; ++i) {
+			double camera[3];
+			for (int j = 0; j < 3; ++j) camera[j] = pose.R[j][0]*worldPoints[i][0] + pose.R[j][1]*worldPoints[i][1] + pose.t[j];
+			double x = camera[0] / camera[2], y = camera[1] / camera[2];
+			double dx = fx*x + skew*y + cx - imagePoints[i].x, dy = fy*y + cy - imagePoints[i].y;
+			squaredError += dx*dx + dy*dy;
+		}
+		pose.pixError = sqrt(squaredError / 8);
+	}
+	if (solutions[1].pixError < solutions[0].pixError) std::swap(solutions[0], solutions[1]);
+	return 2;
+}
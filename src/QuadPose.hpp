@@ -0,0 +1,20 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+// A pose of a target in camera space: a point p in target (world) space is at R*p + t in front of the camera
+struct QuadPose {
+	double R[3][3];
+	double t[3];
+	double pixError; // RMS reprojection error in pixels, the same as solvePnPGeneric's reprojectionError
+};
+
+/* Finds the pose of 4 coplanar points, e.g. a target's corners, with IPPE (Collins and Bartoli, "Infinitesimal Plane-based Pose Estimation", 2014),
+**  the same method as cv::SOLVEPNP_IPPE. It's for the vision thread, which calls it for every candidate contour in every frame,
+**  so it only uses small fixed-size arrays on the stack, where solvePnPGeneric goes through cv::Mats and vectors on the heap.
+** worldPoints are (x, y) on the target's z = 0 plane. imagePoints are where they are in an undistorted image (see ResolutionCalibration::undistort()).
+** cameraMatrix is 3x3, row-major.
+** Both of IPPE's solutions (one is the target flipped about its plane, which is ambiguous when it's small or far away) are put in solutions,
+**  lowest reprojection error first. Returns how many there are: 2, or 0 if the points are degenerate (e.g. 3 of them in a line).
+*/
+int solveQuadPose(const double worldPoints[4][2], const cv::Point2f imagePoints[4], const double cameraMatrix[9], QuadPose solutions[2]);
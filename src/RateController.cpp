@@ -0,0 +1,33 @@
+#include "RateController.hpp"
+
+#include <algorithm>
+
+void RateController::reset(int maxBitrate) {
+	this->maxBitrate = maxBitrate;
+	// Below this, the picture's too bad to be worth sending
+	minBitrate = std::max(100000, maxBitrate / 10);
+	bitrate = maxBitrate;
+	lastJitterMs = -1;
+}
+
+int RateController::onReport(double lossFraction, double jitterMs) {
+	if (maxBitrate <= 0) return bitrate;
+	double jitterRise = (lastJitterMs < 0) ? 0 : jitterMs - lastJitterMs;
+	lastJitterMs = jitterMs;
+
+	double newBitrate = bitrate;
+	if (lossFraction > LOSS_HIGH) {
+		// Like TFRC and GCC: cut in proportion to the loss
+		newBitrate *= 1 - 0.5 * lossFraction;
+	}
+	else if (jitterRise > JITTER_RISE_MS) {
+		newBitrate *= JITTER_DECREASE;
+	}
+	else if (lossFraction < LOSS_LOW) {
+		newBitrate *= INCREASE;
+	}
+	// Otherwise, hold
+
+	bitrate = std::clamp((int) newBitrate, minBitrate, maxBitrate);
+	return bitrate;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+
+/* class RateController
+** Picks the encoder's bitrate from the receiver's reports of packet loss and jitter.
+** It starts at (and never exceeds) the bitrate the driver station asked for, so the driver station still sets the cap for the FMS.
+** Loss backs it off multiplicatively; rising jitter (the radio's queue building up) backs it off gently before loss starts; 
+** and clean reports let it creep back up.
+*/
+class RateController {
+public:
+	// Starts over with a new ceiling, e.g. when the driver station reconnects.
+	void reset(int maxBitrate);
+	// Takes a receiver report and returns the new target bitrate.
+	int onReport(double lossFraction, double jitterMs);
+	int getBitrate() { return bitrate; }
+	int getMaxBitrate() { return maxBitrate; }
+
+	// Loss below this is treated as noise, and loss above it backs off
+	static constexpr double LOSS_LOW = 0.02, LOSS_HIGH = 0.10;
+	// Per-report increase when the network is clean
+	static constexpr double INCREASE = 1.08;
+	// Decrease when jitter is increasing quickly (ms per report)
+	static constexpr double JITTER_RISE_MS = 5, JITTER_DECREASE = 0.85;
+
+private:
+	int bitrate = 0, maxBitrate = 0, minBitrate = 0;
+	double lastJitterMs = -1;
+};
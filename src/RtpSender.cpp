@@ -0,0 +1,193 @@
+#include "RtpSender.hpp"
+
+#include <iostream>
+#include <random>
+#include <cstring>
+#include <thread>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+RtpSender::RtpSender() {
+	// RFC 3550 says these should start out random
+	std::random_device random;
+	sequenceNum = random();
+	ssrc = random();
+}
+RtpSender::~RtpSender() {
+	if (fd >= 0) close(fd);
+}
+
+bool RtpSender::setDestination(const std::string& host, const std::string& port) {
+	// Resolving can take a while, so the old socket keeps sending until the new one's ready
+	int newFd = connectTo(host, port);
+	std::lock_guard<std::mutex> lock(sendLock);
+	if (fd >= 0) close(fd);
+	fd = newFd;
+	return fd >= 0;
+}
+
+int RtpSender::connectTo(const std::string& host, const std::string& port) {
+	int fd = -1;
+	struct addrinfo* addrs;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+	if (error != 0) {
+		std::cerr << "RtpSender getaddrinfo: " << gai_strerror(error) << std::endl;
+		return -1;
+	}
+	for (struct addrinfo* rp = addrs; rp != nullptr; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, rp->ai_protocol);
+		if (fd == -1) continue;
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+
+	if (fd == -1) {
+		std::cerr << "RtpSender could not connect to " << host << ":" << port << std::endl;
+		return -1;
+	}
+	std::cout << "Sending RTP to " << host << ":" << port << std::endl;
+	return fd;
+}
+
+void RtpSender::setSsrc(uint32_t ssrc) {
+	std::lock_guard<std::mutex> lock(sendLock);
+	this->ssrc = ssrc;
+}
+
+std::vector<uint8_t>& RtpSender::nextPacket(uint32_t timestamp) {
+	if (packetCount == packets.size()) packets.emplace_back();
+	std::vector<uint8_t>& packet = packets[packetCount++];
+	packet.resize(12);
+
+	packet[0] = 0x80; // Version 2, no padding, extensions or CSRCs
+	packet[1] = PAYLOAD_TYPE;
+	packet[2] = sequenceNum >> 8; packet[3] = sequenceNum & 0xFF;
+	packet[4] = timestamp >> 24; packet[5] = timestamp >> 16; packet[6] = timestamp >> 8; packet[7] = timestamp;
+	packet[8] = ssrc >> 24; packet[9] = ssrc >> 16; packet[10] = ssrc >> 8; packet[11] = ssrc;
+	++sequenceNum;
+	return packet;
+}
+
+void RtpSender::packetize(const EncodedFrame& frame) {
+	packetCount = 0;
+	uint32_t timestamp = std::chrono::duration_cast<std::chrono::duration<int64_t, std::ratio<1, 90000>>>(
+		frame.captureTime.time_since_epoch()).count();
+
+	for (auto& nalRange : frame.nals) {
+		const uint8_t* nal = frame.data.data() + nalRange.offset;
+
+		if (nalRange.size <= MAX_PAYLOAD) { // Single NAL unit packet
+			std::vector<uint8_t>& packet = nextPacket(timestamp);
+			packet.insert(packet.end(), nal, nal + nalRange.size);
+			continue;
+		}
+		// FU-A: The NAL header is split between the FU indicator and FU header, and the rest is split between packets.
+		uint8_t indicator = (nal[0] & 0xE0) | 28;
+		uint8_t type = nal[0] & 0x1F;
+		for (size_t offset = 1; offset < nalRange.size; offset += MAX_PAYLOAD - 2) {
+			size_t size = std::min(MAX_PAYLOAD - 2, nalRange.size - offset);
+			uint8_t header = type;
+			if (offset == 1) header |= 0x80; // Start
+			if (offset + size == nalRange.size) header |= 0x40; // End
+
+			std::vector<uint8_t>& packet = nextPacket(timestamp);
+			packet.push_back(indicator);
+			packet.push_back(header);
+			packet.insert(packet.end(), nal + offset, nal + offset + size);
+		}
+	}
+	// Marker bit on the last packet of the frame
+	if (packetCount > 0) packets[packetCount - 1][1] |= 0x80;
+}
+
+void RtpSender::setPacing(std::chrono::steady_clock::duration pacingWindow, unsigned int burstPackets) {
+	std::lock_guard<std::mutex> lock(sendLock);
+	this->pacingWindow = pacingWindow;
+	this->burstPackets = std::max(1u, burstPackets);
+}
+
+RtpSender::Stats RtpSender::takeStats() {
+	std::lock_guard<std::mutex> lock(statsLock);
+	Stats ret = stats;
+	stats = Stats();
+	return ret;
+}
+
+void RtpSender::sendPackets(size_t begin, size_t end) {
+	unsigned long sent = 0, dropped = 0, bytes = 0, calls = 0;
+
+	while (begin < end) {
+		int ret = sendmmsg(fd, messages.data() + begin, end - begin, 0);
+		++calls;
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				// The send queue is full. Drop the rest of these instead of waiting, since they'd be late anyway.
+				dropped += end - begin;
+				break;
+			}
+			else if (errno == ECONNREFUSED) {
+				// An ICMP error from an earlier packet (the receiver isn't listening yet). This packet wasn't sent, so skip it.
+				++dropped;
+				++begin;
+				continue;
+			}
+			perror("RtpSender sendmmsg");
+			dropped += end - begin;
+			break;
+		}
+		for (int i = 0; i < ret; ++i) bytes += messages[begin + i].msg_len;
+		sent += ret;
+		begin += ret;
+	}
+
+	std::lock_guard<std::mutex> lock(statsLock);
+	stats.packets += sent;
+	stats.dropped += dropped;
+	stats.bytes += bytes;
+	stats.sendCalls += calls;
+}
+
+void RtpSender::sendFrame(const EncodedFrame& frame) {
+	std::lock_guard<std::mutex> lock(sendLock);
+	if (fd < 0) return;
+	packetize(frame);
+
+	// packets may have been reallocated, so the pointers are refreshed every frame
+	messages.resize(std::max(messages.size(), packetCount));
+	iovecs.resize(std::max(iovecs.size(), packetCount));
+	for (size_t i = 0; i < packetCount; ++i) {
+		iovecs[i].iov_base = packets[i].data();
+		iovecs[i].iov_len = packets[i].size();
+		memset(&messages[i], 0, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_iov = &iovecs[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	{
+		std::lock_guard<std::mutex> lock(statsLock);
+		++stats.frames;
+	}
+
+	if (pacingWindow.count() == 0 || packetCount <= burstPackets) {
+		sendPackets(0, packetCount);
+		return;
+	}
+	size_t bursts = (packetCount + burstPackets - 1) / burstPackets;
+	auto burstInterval = pacingWindow / bursts;
+	auto nextBurst = std::chrono::steady_clock::now();
+	for (size_t begin = 0; begin < packetCount; begin += burstPackets) {
+		std::this_thread::sleep_until(nextBurst);
+		sendPackets(begin, std::min(begin + burstPackets, packetCount));
+		nextBurst += burstInterval;
+	}
+}
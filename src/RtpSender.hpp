@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "Encoder.hpp"
+
+/* class RtpSender
+** Packetizes encoded H.264 frames into RTP (RFC 6184: single NAL unit packets, and FU-A fragments for NAL units that don't fit)
+** and sends them over UDP. The stream is what start_streaming.sh's rtph264depay expects: payload type 96, 90 kHz clock.
+** Each frame's packets go out in one sendmmsg() call. If pacing is on, big frames (i.e. keyframes) are instead split into 
+** bursts spread over part of the frame interval, because sending a whole keyframe at once overflows the radio's queue.
+** The socket is non-blocking, so a full send queue drops packets (and counts them) instead of stalling the encoder.
+*/
+class RtpSender {
+public:
+	RtpSender();
+	~RtpSender();
+	// Targets host:port, closing the previous socket. Returns false if host can't be resolved or connected to, and then sends nothing.
+	// Like setSsrc() and setPacing(), it's safe while another thread is in sendFrame(), and waits for that frame to finish.
+	bool setDestination(const std::string& host, const std::string& port);
+	// Streams sharing a port are told apart by SSRC. It's random unless this is called.
+	void setSsrc(uint32_t ssrc);
+	// Sends a frame, returning once the last packet is sent. With pacing, that may be up to pacingWindow later.
+	void sendFrame(const EncodedFrame& frame);
+
+	// Spread frames with more than burstPackets packets over this long. Zero disables pacing.
+	// Should be less than the frame interval, since the encoder waits on it.
+	void setPacing(std::chrono::steady_clock::duration pacingWindow, unsigned int burstPackets = 8);
+
+	struct Stats {
+		unsigned long frames = 0;
+		unsigned long packets = 0; // Packets the kernel accepted
+		unsigned long dropped = 0; // Packets that didn't fit in the send queue
+		unsigned long bytes = 0;
+		unsigned long sendCalls = 0;
+	};
+	// Returns the counts since the last call, and resets them.
+	Stats takeStats();
+
+	// Largest RTP payload. Keeps packets (with IPv6, UDP and RTP headers) under the usual 1500 byte MTU.
+	static constexpr size_t MAX_PAYLOAD = 1400;
+	static constexpr uint8_t PAYLOAD_TYPE = 96;
+
+private:
+	// Held while a frame is sent, so the socket, SSRC and pacing only change between frames
+	std::mutex sendLock;
+	int fd = -1;
+	uint16_t sequenceNum;
+	uint32_t ssrc;
+
+	std::chrono::steady_clock::duration pacingWindow = std::chrono::steady_clock::duration::zero();
+	unsigned int burstPackets = 8;
+
+	// Packets for the current frame, and the sendmmsg() structures pointing at them. Reused between frames.
+	std::vector<std::vector<uint8_t>> packets;
+	std::vector<struct mmsghdr> messages;
+	std::vector<struct iovec> iovecs;
+	size_t packetCount = 0;
+	// A connected non-blocking UDP socket, or -1
+	static int connectTo(const std::string& host, const std::string& port);
+	std::vector<uint8_t>& nextPacket(uint32_t timestamp);
+	void packetize(const EncodedFrame& frame);
+	// Sends packets [begin, end) in as few calls as possible
+	void sendPackets(size_t begin, size_t end);
+
+	std::mutex statsLock;
+	Stats stats;
+};
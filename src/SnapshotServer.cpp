@@ -0,0 +1,266 @@
+#include "SnapshotServer.hpp"
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+
+// Sends all of data, returning false if the viewer went away or stopped reading.
+static bool sendAll(int fd, const void* data, size_t size) {
+	const char* bytes = (const char*) data;
+	while (size > 0) {
+		ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (sent <= 0) return false;
+		bytes += sent; size -= sent;
+	}
+	return true;
+}
+static bool sendAll(int fd, const std::string& str) {
+	return sendAll(fd, str.data(), str.size());
+}
+
+SnapshotServer::SnapshotServer(unsigned int sourceCount) {
+	for (unsigned int i = 0; i < sourceCount; ++i) sources.push_back(std::make_unique<Source>());
+}
+
+SnapshotServer::~SnapshotServer() {
+	if (!running) return;
+	running = false;
+	shutdown(servFd, SHUT_RDWR);
+	close(servFd);
+	{
+		std::lock_guard<std::mutex> lock(encodeLock);
+		encodeCondition.notify_all();
+	}
+	jpegCondition.notify_all();
+	if (listenerThread.joinable()) listenerThread.join();
+	if (encoderThread.joinable()) encoderThread.join();
+	// Viewers notice within their send timeout or next wait
+	std::unique_lock<std::mutex> lock(clientLock);
+	clientCondition.wait(lock, [this]() { return clientCount == 0; });
+}
+
+bool SnapshotServer::start(short port) {
+	servFd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (servFd < 0) {
+		perror("SnapshotServer socket");
+		return false;
+	}
+	int flag = 1;
+	if (setsockopt(servFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1) {
+		perror("SnapshotServer setsockopt");
+	}
+
+	struct sockaddr_in6 servAddr;
+	memset(&servAddr, 0, sizeof(servAddr));
+	servAddr.sin6_family = AF_INET6;
+	servAddr.sin6_addr = in6addr_any;
+	servAddr.sin6_port = htons(port);
+	if (bind(servFd, (struct sockaddr*) &servAddr, sizeof(servAddr)) == -1 || ::listen(servFd, 10) == -1) {
+		perror("SnapshotServer bind/listen");
+		close(servFd);
+		return false;
+	}
+	fcntl(servFd, F_SETFD, fcntl(servFd, F_GETFD) | FD_CLOEXEC);
+
+	running = true;
+	encoderThread = std::thread(&SnapshotServer::encodeLoop, this);
+	listenerThread = std::thread(&SnapshotServer::listen, this);
+	std::cout << "Serving JPEG snapshots and MJPEG at http://<pi>:" << port << "/" << std::endl;
+	return true;
+}
+
+std::chrono::steady_clock::duration SnapshotServer::minInterval() {
+	if (maxFps <= 0) return std::chrono::steady_clock::duration::zero();
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / maxFps));
+}
+
+void SnapshotServer::offerFrame(unsigned int source, const cv::Mat& frame) {
+	if (!running || source >= sources.size()) return;
+	Source& s = *sources[source];
+	bool snapshotWanted = s.snapshotWanted;
+	if (s.watchers == 0 && !snapshotWanted) return;
+
+	// If the encoder is taking the last frame right now, this one is dropped rather than waited for.
+	std::unique_lock<std::mutex> lock(s.pendingLock, std::try_to_lock);
+	if (!lock.owns_lock()) return;
+	auto now = std::chrono::steady_clock::now();
+	if (!snapshotWanted && now - s.lastOffer < minInterval()) return;
+	frame.copyTo(s.pending);
+	s.hasPending = true;
+	s.lastOffer = now;
+	s.snapshotWanted = false;
+	lock.unlock();
+
+	std::lock_guard<std::mutex> encodeGuard(encodeLock);
+	framesPending = true;
+	encodeCondition.notify_one();
+}
+
+void SnapshotServer::encodeLoop() {
+	// Viewers are the lowest priority thing on the pi
+	errno = 0;
+	nice(10);
+	if (errno != 0) perror("nice");
+
+	cv::Mat yuyv, bgr;
+	std::vector<uint8_t> buffer;
+	while (running) {
+		{
+			std::unique_lock<std::mutex> lock(encodeLock);
+			encodeCondition.wait(lock, [this]() { return framesPending || !running; });
+			framesPending = false;
+		}
+		for (auto& source : sources) {
+			{
+				std::lock_guard<std::mutex> lock(source->pendingLock);
+				if (!source->hasPending) continue;
+				// Swapping hands the old buffer back to offerFrame() to be reused
+				std::swap(yuyv, source->pending);
+				source->hasPending = false;
+			}
+			cv::cvtColor(yuyv, bgr, cv::COLOR_YUV2BGR_YUYV);
+			if (!cv::imencode(".jpg", bgr, buffer, { cv::IMWRITE_JPEG_QUALITY, quality })) {
+				std::cerr << "SnapshotServer: JPEG encoding failed" << std::endl;
+				continue;
+			}
+			auto jpeg = std::make_shared<const std::vector<uint8_t>>(buffer);
+			{
+				std::lock_guard<std::mutex> lock(jpegLock);
+				source->jpeg = jpeg;
+				++source->jpegNum;
+				source->jpegTime = std::chrono::steady_clock::now();
+			}
+			jpegCondition.notify_all();
+		}
+	}
+}
+
+void SnapshotServer::listen() {
+	while (running) {
+		int clientFd = accept(servFd, nullptr, nullptr);
+		if (clientFd < 0) {
+			if (!running) break;
+			perror("SnapshotServer accept");
+			sleep(1);
+			continue;
+		}
+		fcntl(clientFd, F_SETFD, fcntl(clientFd, F_GETFD) | FD_CLOEXEC);
+		// A viewer that stops reading (or never sends a request) gives up its thread instead of holding it forever
+		struct timeval timeout = { 2, 0 };
+		setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		std::lock_guard<std::mutex> lock(clientLock);
+		if (clientCount >= maxClients) {
+			sendAll(clientFd, "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\nToo many viewers\n");
+			close(clientFd);
+			continue;
+		}
+		++clientCount;
+		std::thread([this, clientFd]() {
+			serveClient(clientFd);
+			close(clientFd);
+			std::lock_guard<std::mutex> lock(clientLock);
+			--clientCount;
+			clientCondition.notify_all();
+		}).detach();
+	}
+}
+
+void SnapshotServer::serveClient(int fd) {
+	// Only the request line matters, so the headers aren't read past what fits
+	char request[2048];
+	size_t length = 0;
+	while (length < sizeof(request) - 1) {
+		ssize_t len = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+		if (len <= 0) return;
+		length += len;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") != nullptr || strstr(request, "\n\n") != nullptr) break;
+	}
+	request[length] = '\0';
+
+	char path[256];
+	if (sscanf(request, "GET %255s", path) != 1) {
+		sendAll(fd, "HTTP/1.0 405 Method Not Allowed\r\n\r\n");
+		return;
+	}
+	if (strcmp(path, "/") == 0) {
+		std::string page = "<html><body><p><a href=\"/stream.mjpg\">composite</a> (<a href=\"/snapshot.jpg\">snapshot</a>)</p>\n";
+		for (unsigned int i = 0; i + 1 < sources.size(); ++i) {
+			std::string cam = "/cam" + std::to_string(i);
+			page += "<p><a href=\"" + cam + "/stream.mjpg\">camera " + std::to_string(i) + "</a> (<a href=\"" + cam + "/snapshot.jpg\">snapshot</a>)</p>\n";
+		}
+		page += "</body></html>\n";
+		sendAll(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + std::to_string(page.size()) + "\r\n\r\n" + page);
+		return;
+	}
+
+	// /<file> is the composite, and /cam<N>/<file> is camera N
+	unsigned int source = 0;
+	const char* file = path;
+	unsigned int camera;
+	int fileStart = 0;
+	if (sscanf(path, "/cam%u%n", &camera, &fileStart) == 1) {
+		source = camera + 1;
+		file = path + fileStart;
+	}
+	if (source >= sources.size()) {
+		sendAll(fd, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nNo such camera\n");
+	}
+	else if (strcmp(file, "/snapshot.jpg") == 0) serveSnapshot(fd, *sources[source]);
+	else if (strcmp(file, "/stream.mjpg") == 0) serveStream(fd, *sources[source]);
+	else sendAll(fd, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nNot found\n");
+}
+
+void SnapshotServer::serveSnapshot(int fd, Source& source) {
+	std::shared_ptr<const std::vector<uint8_t>> jpeg;
+	{
+		std::unique_lock<std::mutex> lock(jpegLock);
+		// A frame encoded for a stream within the last interval is as fresh as we'd give anyway
+		if (!source.jpeg || std::chrono::steady_clock::now() - source.jpegTime > minInterval()) {
+			unsigned long lastNum = source.jpegNum;
+			source.snapshotWanted = true;
+			jpegCondition.wait_for(lock, std::chrono::seconds(1), [&]() { return source.jpegNum != lastNum || !running; });
+		}
+		jpeg = source.jpeg;
+	}
+	if (!jpeg) {
+		sendAll(fd, "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\nNo frames from this source\n");
+		return;
+	}
+	if (sendAll(fd, "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\nCache-Control: no-cache\r\nContent-Length: " + std::to_string(jpeg->size()) + "\r\n\r\n")) {
+		sendAll(fd, jpeg->data(), jpeg->size());
+	}
+}
+
+void SnapshotServer::serveStream(int fd, Source& source) {
+	if (!sendAll(fd, "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=frame\r\nCache-Control: no-cache\r\n\r\n")) return;
+
+	++source.watchers;
+	unsigned long lastNum = 0;
+	while (running) {
+		std::shared_ptr<const std::vector<uint8_t>> jpeg;
+		{
+			std::unique_lock<std::mutex> lock(jpegLock);
+			jpegCondition.wait_for(lock, std::chrono::seconds(1), [&]() { return source.jpegNum != lastNum || !running; });
+			if (source.jpegNum == lastNum) continue;
+			jpeg = source.jpeg;
+			lastNum = source.jpegNum;
+		}
+		std::string header = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg->size()) + "\r\n\r\n";
+		if (!sendAll(fd, header) || !sendAll(fd, jpeg->data(), jpeg->size()) || !sendAll(fd, "\r\n")) break;
+	}
+	--source.watchers;
+}
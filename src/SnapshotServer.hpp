@@ -0,0 +1,80 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+/* class SnapshotServer
+** A tiny HTTP server for looking at what the pi sees without gStreamer: dashboards and browsers can show
+**  /snapshot.jpg (a single JPEG) or /stream.mjpg (MJPEG) of the composite, and /cam<N>/snapshot.jpg or /cam<N>/stream.mjpg of camera N.
+** Each source is JPEG encoded at most maxFps times a second, on the server's own low-priority thread,
+**  and only while someone is watching it. Every viewer of a source shares the same encoded frame.
+** Viewers are never waited on: a slow viewer just skips to the newest frame when it's ready for another.
+*/
+class SnapshotServer {
+public:
+	// Source 0 is the composite, and source N+1 is camera N.
+	SnapshotServer(unsigned int sourceCount);
+	~SnapshotServer();
+	// Starts listening. Returns false if the port can't be opened.
+	bool start(short port);
+
+	int quality = 70; // JPEG quality, 0-100
+	double maxFps = 10;
+	// More viewers than this are turned away, since each has its own thread.
+	unsigned int maxClients = 8;
+
+	/* Hands a YUYV frame to the server. It's copied only if someone is watching the source and maxFps allows another frame,
+	** and never waits for the encoder, so it's cheap enough to call on every frame from the capture threads.
+	*/
+	void offerFrame(unsigned int source, const cv::Mat& frame);
+
+private:
+	struct Source {
+		// Stream viewers, and whether a snapshot is waiting for a frame
+		std::atomic<int> watchers{0};
+		std::atomic<bool> snapshotWanted{false};
+
+		// Offered frame, waiting to be encoded. Guarded by pendingLock.
+		std::mutex pendingLock;
+		cv::Mat pending;
+		bool hasPending = false;
+		std::chrono::steady_clock::time_point lastOffer;
+
+		// Newest encoded frame. Guarded by jpegLock.
+		std::shared_ptr<const std::vector<uint8_t>> jpeg;
+		unsigned long jpegNum = 0;
+		std::chrono::steady_clock::time_point jpegTime;
+	};
+	std::vector<std::unique_ptr<Source>> sources;
+	std::chrono::steady_clock::duration minInterval();
+
+	volatile bool running = false;
+	int servFd = -1;
+	std::thread listenerThread, encoderThread;
+	void listen();
+
+	std::mutex encodeLock;
+	std::condition_variable encodeCondition;
+	bool framesPending = false;
+	void encodeLoop();
+
+	// Viewers wait on jpegCondition for the next frame
+	std::mutex jpegLock;
+	std::condition_variable jpegCondition;
+
+	// Client threads are detached, so the destructor waits for this to reach 0
+	unsigned int clientCount = 0;
+	std::mutex clientLock;
+	std::condition_variable clientCondition;
+	void serveClient(int fd);
+	void serveSnapshot(int fd, Source& source);
+	void serveStream(int fd, Source& source);
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+/* Target models
+** What doVision() looks for. Each model is a type with only static constexpr members, and the filtering and pose solving
+**  are templates on it (see findTargets() in vision.cpp), so every model gets its own copy with its geometry and limits as constants.
+** Which one runs is picked once per frame (see visionTarget in vision.hpp), never inside the per-contour loop.
+** To add a model: add a type like these, a TargetModelId for it, and a case in vision.cpp's doVision() and target name functions.
+**
+** Every model is 4 coplanar corners. worldPoints are in inches, in the order topleft, topright, bottomleft, bottomright,
+**  on the z = 0 plane with (0, 0) at the bottom center. Up and right are positive.
+*/
+
+// sqrt() isn't constexpr. Newton's method, for working out model dimensions.
+constexpr double constexprSqrt(double x, double guess = 1, int iterations = 64) {
+	return (iterations == 0 || x <= 0) ? (x <= 0 ? 0 : guess) : constexprSqrt(x, 0.5 * (guess + x / guess), iterations - 1);
+}
+
+// This year's target: the outline of the lower half of a hexagon around the power port
+struct PowerPortTarget {
+	static constexpr const char* name = "powerPort";
+	static constexpr double inchWidthTop = 3*12 + 3 + 1/4.0;
+	static constexpr double inchSideLength = 1*12 + 7 + 5/8.0;
+	static constexpr double inchHeight = 1*12 + 5;
+	static constexpr double inchWidthBottom = inchWidthTop - 2*constexprSqrt(inchSideLength*inchSideLength - inchHeight*inchHeight);
+	static constexpr double worldPoints[4][2] = {
+		{ -inchWidthTop/2, inchHeight }, { inchWidthTop/2, inchHeight },
+		{ -inchWidthBottom/2, 0 }, { inchWidthBottom/2, 0 }
+	};
+	// Of the world origin
+	static constexpr double inchHeightAboveGround = 6*12 + 9 + 1/4.0;
+
+	// Filters on each contour's convex hull. Its area as a fraction of the image's
+	static constexpr double minImageFraction = 0.01;
+	// The contour's area as a fraction of its hull's. The ideal is about 11%, since it's an outline.
+	static constexpr double minFillRatio = 0, maxFillRatio = 0.3;
+	// The hull's bounding box width / height. Head on, it's about 2.3, and it only gets narrower from the sides.
+	static constexpr double minAspect = 0.6, maxAspect = 3.2;
+	// In degrees, how far the top and bottom edges can be from level
+	static constexpr double maxEdgeAngle = 15;
+};
+
+// 2016's high goal target: a U of 2 inch tape. Its hull is the rectangle around it.
+struct StrongholdTarget {
+	static constexpr const char* name = "stronghold";
+	static constexpr double inchWidth = 1*12 + 8, inchHeight = 1*12 + 2;
+	static constexpr double worldPoints[4][2] = {
+		{ -inchWidth/2, inchHeight }, { inchWidth/2, inchHeight },
+		{ -inchWidth/2, 0 }, { inchWidth/2, 0 }
+	};
+	static constexpr double inchHeightAboveGround = 7*12;
+
+	static constexpr double minImageFraction = 0.005;
+	// The U is about 31% of its rectangle
+	static constexpr double minFillRatio = 0.15, maxFillRatio = 0.5;
+	static constexpr double minAspect = 0.4, maxAspect = 2;
+	static constexpr double maxEdgeAngle = 15;
+};
+
+// A solid retroreflective board for checking distances and the calibration in the pit: 2ft by 1.5ft,
+//  stood on something so its bottom edge is level with the camera
+struct CalibrationBoardTarget {
+	static constexpr const char* name = "board";
+	static constexpr double inchWidth = 2*12, inchHeight = 1*12 + 6;
+	static constexpr double worldPoints[4][2] = {
+		{ -inchWidth/2, inchHeight }, { inchWidth/2, inchHeight },
+		{ -inchWidth/2, 0 }, { inchWidth/2, 0 }
+	};
+	// Level with the camera (inchCameraHeightAboveGround in vision.cpp)
+	static constexpr double inchHeightAboveGround = 24;
+
+	static constexpr double minImageFraction = 0.01;
+	static constexpr double minFillRatio = 0.85, maxFillRatio = 1;
+	static constexpr double minAspect = 0.3, maxAspect = 1.8;
+	static constexpr double maxEdgeAngle = 15;
+};
+
+enum class TargetModelId { PowerPort, Stronghold, CalibrationBoard };
@@ -0,0 +1,106 @@
+#include "TelemetryProtocol.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace telemetry {
+
+// Big-endian writers and readers. Each advances the pointer past what it wrote or read.
+static void put8(uint8_t*& p, uint8_t value) { *p++ = value; }
+static void put16(uint8_t*& p, uint16_t value) { put8(p, value >> 8); put8(p, value); }
+static void put32(uint8_t*& p, uint32_t value) { put16(p, value >> 16); put16(p, value); }
+static void put64(uint8_t*& p, uint64_t value) { put32(p, value >> 32); put32(p, value); }
+static void putFloat(uint8_t*& p, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put32(p, bits);
+}
+static uint8_t get8(const uint8_t*& p) { return *p++; }
+static uint16_t get16(const uint8_t*& p) { uint16_t high = get8(p); return (high << 8) | get8(p); }
+static uint32_t get32(const uint8_t*& p) { uint32_t high = get16(p); return (high << 16) | get16(p); }
+static uint64_t get64(const uint8_t*& p) { uint64_t high = get32(p); return (high << 32) | get32(p); }
+static float getFloat(const uint8_t*& p) {
+	uint32_t bits = get32(p);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static size_t packetSize(unsigned int targetCount, bool hasDrawPoints, unsigned int drawPointCount) {
+	size_t size = HEADER_SIZE + targetCount*TARGET_SIZE;
+	if (hasDrawPoints) size += 1 + drawPointCount*POINT_SIZE;
+	return size;
+}
+
+size_t encode(const Packet& packet, uint8_t* buf, size_t bufSize) {
+	if (packet.targetCount > MAX_TARGETS || packet.drawPointCount > MAX_DRAW_POINTS) return 0;
+	size_t size = packetSize(packet.targetCount, packet.hasDrawPoints, packet.drawPointCount);
+	if (size > bufSize) return 0;
+
+	uint8_t* p = buf;
+	put16(p, MAGIC);
+	put8(p, VERSION);
+	put8(p, (packet.hasDrawPoints ? FLAG_DRAW_POINTS : 0) | (packet.drawOnly ? FLAG_DRAW_ONLY : 0));
+	put32(p, packet.sequence);
+	put64(p, packet.captureTimeUs);
+	put32(p, packet.latencyUs);
+	put8(p, packet.targetCount);
+	put8(p, 0); put8(p, 0); put8(p, 0);
+	for (unsigned int i = 0; i < packet.targetCount; ++i) {
+		const Target& target = packet.targets[i];
+		putFloat(p, target.distance);
+		putFloat(p, target.tapeAngle);
+		putFloat(p, target.robotAngle);
+		putFloat(p, target.confidence);
+	}
+	if (packet.hasDrawPoints) {
+		put8(p, packet.drawPointCount);
+		for (unsigned int i = 0; i < packet.drawPointCount; ++i) {
+			putFloat(p, packet.drawPoints[i].x);
+			putFloat(p, packet.drawPoints[i].y);
+		}
+	}
+	return p - buf;
+}
+
+bool decode(const uint8_t* buf, size_t size, Packet& packet) {
+	if (size < HEADER_SIZE) return false;
+	const uint8_t* p = buf;
+	if (get16(p) != MAGIC || get8(p) != VERSION) return false;
+	uint8_t flags = get8(p);
+	packet.sequence = get32(p);
+	packet.captureTimeUs = get64(p);
+	packet.latencyUs = get32(p);
+	packet.targetCount = get8(p);
+	p += 3;
+	packet.hasDrawPoints = flags & FLAG_DRAW_POINTS;
+	packet.drawOnly = flags & FLAG_DRAW_ONLY;
+	if (packet.targetCount > MAX_TARGETS || size < packetSize(packet.targetCount, packet.hasDrawPoints, 0)) return false;
+
+	for (unsigned int i = 0; i < packet.targetCount; ++i) {
+		Target& target = packet.targets[i];
+		target.distance = getFloat(p);
+		target.tapeAngle = getFloat(p);
+		target.robotAngle = getFloat(p);
+		target.confidence = getFloat(p);
+	}
+	packet.drawPointCount = 0;
+	if (packet.hasDrawPoints) {
+		packet.drawPointCount = get8(p);
+		if (packet.drawPointCount > MAX_DRAW_POINTS || size < packetSize(packet.targetCount, true, packet.drawPointCount)) return false;
+		for (unsigned int i = 0; i < packet.drawPointCount; ++i) {
+			packet.drawPoints[i].x = getFloat(p);
+			packet.drawPoints[i].y = getFloat(p);
+		}
+	}
+	return true;
+}
+
+int formatText(const Packet& packet, char* buf, size_t bufSize) {
+	Target target = {};
+	if (packet.targetCount > 0) target = packet.targets[0];
+	return snprintf(buf, bufSize, "# distance=%f tapeAngle=%f robotAngle=%f\n@%u\n",
+		target.distance, target.tapeAngle, target.robotAngle, packet.latencyUs / 1000);
+}
+
+}
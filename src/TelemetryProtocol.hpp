@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/* Binary vision telemetry, sent to the RIO over UDP (port 5808) by DataComm, and decoded by naudpl.
+** Doesn't depend on opencv, so that tools can use it without it.
+**
+** Every field is big-endian (network order, which is also what Java's ByteBuffer reads by default). Floats are IEEE 754.
+** Header, HEADER_SIZE bytes:
+**	uint16 magic (MAGIC)
+**	uint8  version (VERSION)
+**	uint8  flags (FLAG_DRAW_POINTS, FLAG_DRAW_ONLY)
+**	uint32 sequence number, one more than the last packet's
+**	uint64 capture time, in microseconds of the pi's steady clock
+**	uint32 processing latency, in microseconds from capture to send
+**	uint8  target count
+**	uint8  reserved[3]
+** Then each target, TARGET_SIZE bytes: float distance, tapeAngle, robotAngle, confidence (0 to 1)
+** Then, if FLAG_DRAW_POINTS is set: uint8 point count, then each point as float x, y (in pixels)
+** A packet with FLAG_DRAW_ONLY only carries draw points for the overlay. Its target count is 0 whether or not a target is in view,
+**  so it's no reason to stop aiming.
+*/
+namespace telemetry {
+	constexpr uint16_t MAGIC = 0x5708;
+	// Bumped whenever the layout changes. The decoder refuses other versions instead of misreading them.
+	constexpr uint8_t VERSION = 1;
+	constexpr uint8_t FLAG_DRAW_POINTS = 1, FLAG_DRAW_ONLY = 2;
+
+	constexpr unsigned int MAX_TARGETS = 8, MAX_DRAW_POINTS = 16;
+	constexpr size_t HEADER_SIZE = 24, TARGET_SIZE = 16, POINT_SIZE = 8;
+	constexpr size_t MAX_PACKET_SIZE = HEADER_SIZE + MAX_TARGETS*TARGET_SIZE + 1 + MAX_DRAW_POINTS*POINT_SIZE;
+
+	struct Target {
+		float distance, tapeAngle, robotAngle;
+		float confidence;
+	};
+	struct Point {
+		float x, y;
+	};
+	// Fixed size, so it can live on the stack
+	struct Packet {
+		uint32_t sequence = 0;
+		uint64_t captureTimeUs = 0;
+		uint32_t latencyUs = 0;
+		unsigned int targetCount = 0;
+		Target targets[MAX_TARGETS];
+		bool hasDrawPoints = false;
+		bool drawOnly = false;
+		unsigned int drawPointCount = 0;
+		Point drawPoints[MAX_DRAW_POINTS];
+	};
+
+	// Writes the packet to buf, returning its size, or 0 if it doesn't fit (or has too many targets or points).
+	size_t encode(const Packet& packet, uint8_t* buf, size_t bufSize);
+	// Reads a packet. Returns false if it isn't a telemetry packet, is a different version, or is truncated.
+	bool decode(const uint8_t* buf, size_t size, Packet& packet);
+
+	/* The old text format, for robot code that hasn't moved to the binary one:
+	** # distance=<> tapeAngle=<> robotAngle=<>
+	** @<latency in ms>
+	** It only has room for the first target. Returns the length, like snprintf.
+	*/
+	int formatText(const Packet& packet, char* buf, size_t bufSize);
+}
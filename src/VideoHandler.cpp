@@ -6,7 +6,17 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <limits.h>
+#include <linux/usbdevice_fs.h>
+#include <fstream>
 #include <thread> // I hate everything.
+#include <cmath>
+#include <algorithm>
+
+#include "CaptureLoop.hpp"
 
 /*
 Magic and jankyness lies here. This class communicates to the cameras and to gStreamer with the Video4Linux API.
@@ -18,18 +28,25 @@ Magic and jankyness lies here. This class communicates to the cameras and to gSt
 */
 
 
-VideoReader::VideoReader(int width, int height, const char* file) : width(width),height(height),deviceFile(std::string(file)){
+VideoReader::VideoReader(int width, int height, const char* file, unsigned int bufferCount, bool newestOnly)
+: width(width),height(height),deviceFile(std::string(file)),bufferCount(std::max(bufferCount, 2u)),newestOnly(newestOnly){
 }
 
 bool VideoReader::tryOpenReader(bool isClosed) {
 	// http://jwhsmith.net/2014/12/capturing-a-webcam-stream-using-v4l2/
 	// https://jayrambhia.com/blog/capture-v4l2
 
+	// EBUSY doesn't come with an event to wait for, so back off quickly instead
+	std::chrono::milliseconds busyDelay(10);
+	auto waitWhileBusy = [&busyDelay]() {
+		std::this_thread::sleep_for(busyDelay);
+		busyDelay = std::min(busyDelay * 2, std::chrono::milliseconds(1000));
+	};
 	if (isClosed) {
-		while ((camfd = open(deviceFile.c_str(), O_RDWR|O_CLOEXEC)) < 0) {
+		while ((camfd = open(deviceFile.c_str(), O_RDWR|O_CLOEXEC|(nonBlocking ? O_NONBLOCK : 0))) < 0) {
 			perror("open");
-			if (errno == EBUSY) {
-				sleep(1);
+			if (errno == EBUSY && !stopping) {
+				waitWhileBusy();
 			}
 			else return false;
 		}
@@ -55,8 +72,8 @@ bool VideoReader::tryOpenReader(bool isClosed) {
 
 	while (ioctl(camfd, VIDIOC_S_FMT, &format) < 0){
 		perror((deviceFile + " VIDIOC_S_FMT").c_str());
-		if (errno == EBUSY) {
-			sleep(1);
+		if (errno == EBUSY && !stopping) {
+			waitWhileBusy();
 			continue;
 		}
 		else {
@@ -64,28 +81,12 @@ bool VideoReader::tryOpenReader(bool isClosed) {
 		}
 	}
 
-	// set framerate
-	struct v4l2_streamparm streamparm;
-	memset(&streamparm, 0, sizeof(streamparm));
-	streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (ioctl(camfd, VIDIOC_G_PARM, &streamparm) != 0){
-		perror("Setting framerate: VIDIOC_G_PARM");
-	}
-	else {
-		streamparm.parm.capture.capturemode |= V4L2_CAP_TIMEPERFRAME;
-		streamparm.parm.capture.timeperframe.numerator = 1;
-		streamparm.parm.capture.timeperframe.denominator = 1000;
-		if(ioctl(camfd, VIDIOC_S_PARM, &streamparm) !=0) {
-			perror("Setting framerate: VIDIOC_S_PARM");
-		}
-		else std::cout << "Frame time for " << deviceFile << " is: " << streamparm.parm.capture.timeperframe.numerator 
-		<< "/" << streamparm.parm.capture.timeperframe.denominator << std::endl;
-	}
+	setFrameInterval();
 
 	// request memory buffers from the kernel
 	bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	bufrequest.memory = V4L2_MEMORY_MMAP;
-	bufrequest.count = 4;
+	bufrequest.count = bufferCount;
 
 	if(ioctl(camfd, VIDIOC_REQBUFS, &bufrequest) < 0){
 		perror("VIDIOC_REQBUFS");
@@ -122,7 +123,7 @@ bool VideoReader::tryOpenReader(bool isClosed) {
 	}
 	
 	int type = bufferinfo.type;
-	if(ioctl(camfd, VIDIOC_STREAMON, &type) < 0){
+	if(streamIoctl(VIDIOC_STREAMON, &type) < 0){
 		perror("VIDIOC_STREAMON");
 		return false;
 	}
@@ -133,24 +134,173 @@ bool VideoReader::tryOpenReader(bool isClosed) {
 		bufferinfo.memory = V4L2_MEMORY_MMAP;
 		bufferinfo.index = i;
 
-		if(ioctl(camfd, VIDIOC_QBUF, &bufferinfo) < 0){
+		if(streamIoctl(VIDIOC_QBUF, &bufferinfo) < 0){
 			std::cerr << "Queueing buffer " << i << ": ";
 			perror("VIDIOC_QBUF");
 		}
 	}
 	return true;
 }
+void VideoReader::setFrameInterval() {
+	struct v4l2_streamparm streamparm;
+	memset(&streamparm, 0, sizeof(streamparm));
+	streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (ioctl(camfd, VIDIOC_G_PARM, &streamparm) != 0){
+		perror("Setting framerate: VIDIOC_G_PARM");
+	}
+	else {
+		streamparm.parm.capture.capturemode |= V4L2_CAP_TIMEPERFRAME;
+		// The driver picks the closest interval it supports, so asking for 1/1000 gets the fastest.
+		streamparm.parm.capture.timeperframe.numerator = 1000;
+		streamparm.parm.capture.timeperframe.denominator = (requestedFps > 0) ? round(requestedFps * 1000) : 1000000;
+		if(ioctl(camfd, VIDIOC_S_PARM, &streamparm) !=0) {
+			perror("Setting framerate: VIDIOC_S_PARM");
+		}
+		else std::cout << "Frame time for " << deviceFile << " is: " << streamparm.parm.capture.timeperframe.numerator 
+		<< "/" << streamparm.parm.capture.timeperframe.denominator << std::endl;
+	}
+}
 void VideoReader::openReader(bool isClosed) {
+	std::chrono::milliseconds retryDelay(50);
 	while (!tryOpenReader(isClosed)) {
-		std::cerr << "Failed to open " << deviceFile << "! Retrying in 3 seconds..." << std::endl;
+		if (stopping) return;
+		std::cerr << "Failed to open " << deviceFile << "! Retrying in " << retryDelay.count() << " ms, or when it's plugged back in..." << std::endl;
 		closeReader();
-		sleep(3);
+		isClosed = true; // So the retry opens it again
+		waitForDevice(retryDelay);
+		retryDelay = std::min(retryDelay * 2, std::chrono::milliseconds(3000));
+	}
+}
+bool VideoReader::tryReopen(std::chrono::milliseconds wait) {
+	if (tryOpenReader(true)) return true;
+	closeReader();
+	waitForDevice(wait);
+	if (tryOpenReader(true)) return true;
+	closeReader();
+	return false;
+}
+
+void VideoReader::waitForDevice(std::chrono::milliseconds timeout) {
+	size_t slash = deviceFile.find_last_of('/');
+	std::string directory = deviceFile.substr(0, slash), name = deviceFile.substr(slash + 1);
+	int watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watchFd < 0 || inotify_add_watch(watchFd, directory.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+		perror("Waiting for camera: inotify");
+		if (watchFd >= 0) close(watchFd);
+		std::this_thread::sleep_for(timeout);
+		return;
+	}
+	bool existed = access(deviceFile.c_str(), F_OK) == 0;
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (!stopping) {
+		// It might have been created before the watch was added
+		if (!existed && access(deviceFile.c_str(), F_OK) == 0) break;
+		long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (remaining <= 0) break;
+		struct pollfd pollFd = { watchFd, POLLIN, 0 };
+		// Wake up now and then to check stopping
+		if (poll(&pollFd, 1, std::min(remaining, 250L)) <= 0) continue;
+
+		alignas(struct inotify_event) char buffer[4096];
+		bool changed = false;
+		ssize_t length = read(watchFd, buffer, sizeof(buffer));
+		for (char* p = buffer; length > 0 && p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+			struct inotify_event* event = (struct inotify_event*) p;
+			if (event->len > 0 && name == event->name) changed = true;
+		}
+		if (changed) break;
+	}
+	close(watchFd);
+}
+
+bool VideoReader::requeueBuffers() {
+	for (unsigned int i = 0; i < bufrequest.count; ++i) {
+		struct v4l2_buffer buffer;
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		if (ioctl(camfd, VIDIOC_QUERYBUF, &buffer) < 0) {
+			perror("Requeueing: VIDIOC_QUERYBUF");
+			return false;
+		}
+		if (buffer.flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE)) continue;
+		if (streamIoctl(VIDIOC_QBUF, &buffer) < 0) {
+			perror("Requeueing: VIDIOC_QBUF");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool VideoReader::restartStreaming() {
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	// Takes every buffer back from the driver, but leaves them allocated and mapped
+	if (ioctl(camfd, VIDIOC_STREAMOFF, &type) < 0) {
+		perror("Restarting: VIDIOC_STREAMOFF");
+		return false;
+	}
+	setFrameInterval();
+	for (unsigned int i = 0; i < bufrequest.count; ++i) {
+		struct v4l2_buffer buffer;
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		if (streamIoctl(VIDIOC_QBUF, &buffer) < 0) {
+			perror("Restarting: VIDIOC_QBUF");
+			return false;
+		}
+	}
+	if (streamIoctl(VIDIOC_STREAMON, &type) < 0) {
+		perror("Restarting: VIDIOC_STREAMON");
+		return false;
+	}
+	return true;
+}
+
+bool VideoReader::resetUsbDevice() {
+	// deviceFile is usually a /dev/v4l/by-id link, and sysfs only knows the videoN name
+	char devicePath[PATH_MAX];
+	if (realpath(deviceFile.c_str(), devicePath) == nullptr) {
+		perror(deviceFile.c_str());
+		return false;
+	}
+	std::string name = devicePath;
+	name = name.substr(name.find_last_of('/') + 1);
+	// The video device's parent is its USB interface, and the interface's parent is the USB device
+	char interfacePath[PATH_MAX];
+	if (realpath(("/sys/class/video4linux/" + name + "/device").c_str(), interfacePath) == nullptr) {
+		perror(("Finding " + name + "'s USB device").c_str());
+		return false;
+	}
+	std::string usbDevice = interfacePath;
+	usbDevice = usbDevice.substr(0, usbDevice.find_last_of('/'));
+	unsigned int bus = 0, device = 0;
+	std::ifstream(usbDevice + "/busnum") >> bus;
+	std::ifstream(usbDevice + "/devnum") >> device;
+	if (bus == 0 || device == 0) {
+		std::cerr << deviceFile << " isn't a USB camera" << std::endl;
+		return false;
+	}
+	char usbPath[64];
+	snprintf(usbPath, sizeof(usbPath), "/dev/bus/usb/%03u/%03u", bus, device);
+	int usbFd = open(usbPath, O_WRONLY | O_CLOEXEC);
+	if (usbFd < 0) {
+		perror(usbPath);
+		return false;
 	}
+	bool success = ioctl(usbFd, USBDEVFS_RESET, 0) == 0;
+	if (!success) perror("USBDEVFS_RESET");
+	close(usbFd);
+	return success;
 }
 
 void VideoReader::closeReader() {
+	if (camfd < 0) return; // Already closed
 	stopStreaming();
 	if (close(camfd) < 0) perror("close"); //Close the camera fd.
+	camfd = -1;
 }
 void VideoReader::stopStreaming() {
 	int type = bufferinfo.type;
@@ -189,10 +339,28 @@ bool VideoReader::grabFrame() {
 	bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	bufferinfo.memory = V4L2_MEMORY_MMAP;
 	// The buffer's waiting in the outgoing queue.
-	int ret = ioctl(camfd, VIDIOC_DQBUF, &bufferinfo);
+	int ret = streamIoctl(VIDIOC_DQBUF, &bufferinfo);
 	if(ret < 0) {
-		perror("VIDIOC_DQBUF");
-		 return false;
+		// Callers check errno, to tell no frame yet (EAGAIN, if non-blocking) from a broken camera
+		int error = errno;
+		if (error != EAGAIN) perror("VIDIOC_DQBUF");
+		errno = error;
+		return false;
+	}
+
+	if (newestOnly) {
+		// Anything else that's ready is newer, so the one we have goes straight back to the driver
+		struct pollfd ready = { camfd, POLLIN, 0 };
+		while (poll(&ready, 1, 0) > 0 && (ready.revents & POLLIN)) {
+			struct v4l2_buffer newer;
+			memset(&newer, 0, sizeof(newer));
+			newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			newer.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(camfd, VIDIOC_DQBUF, &newer) < 0) break;
+			if (ioctl(camfd, VIDIOC_QBUF, &bufferinfo) < 0) perror("Skipping frame: VIDIOC_QBUF");
+			bufferinfo = newer;
+			++skippedFrames;
+		}
 	}
 
 	currentBuffer = buffers[bufferinfo.index];
@@ -200,7 +368,7 @@ bool VideoReader::grabFrame() {
 	assert((signed) bufferinfo.length == width*height*2);
 
 	// put the old buffer back into the queue
-	if(hasFirstFrame && ioctl(camfd, VIDIOC_QBUF, &bufferinfo) < 0){
+	if(hasFirstFrame && streamIoctl(VIDIOC_QBUF, &bufferinfo) < 0){
 		perror("VIDIOC_QBUF");
 		return false;
 	}
@@ -208,6 +376,14 @@ bool VideoReader::grabFrame() {
 	hasFirstFrame = true;
 	return true;
 }
+int VideoReader::streamIoctl(unsigned long request, void* arg) {
+	if (faultStages > 0) {
+		errno = EIO;
+		return -1;
+	}
+	return ioctl(camfd, request, arg);
+}
+
 /* Get and cache the list of acceptable resolution pair values for the used format. */
 void VideoReader::queryResolutions(){
 	if(hasResolutions) return;
@@ -254,7 +430,7 @@ void VideoReader::reset(bool hard){
 	//hard = true;
 	if (hard) {
 		closeReader();
-		sleep(4); //Can this be lowered? I've changed it from 4 to 2, here's hoping it doesn't make anything explode...
+		// If it isn't ready to be opened again straight away, this waits for it
 		openReader(true);
 	}
 	else {
@@ -296,37 +472,279 @@ void VideoReader::setExposureVals(bool isAuto, int exposure) {
 
 
 bool ThreadedVideoReader::grabFrame() {
-	resetLock.lock(); resetLock.unlock(); // If resetting, wait until done
+	bool hadFirstFrame = hasFirstFrame;
 	bool goodGrab = VideoReader::grabFrame();
 	if (goodGrab) { // We've successfully grabbed a frame. Record frame time and reset the timeout.
 		auto now = timeout_clock.now();
 
+		// The first frame after opening doesn't count, since the camera was still starting up
+		if (hadFirstFrame) {
+			double interval = std::chrono::duration<double>(now - last_update).count();
+			meanFrameInterval = (meanFrameInterval == 0) ? interval : 0.75*meanFrameInterval + 0.25*interval;
+		}
 		++frameTimeIdx;
 		if (frameTimeIdx >= frameTimeCount) frameTimeIdx = 0;
 		frameTimes[frameTimeIdx] = now;
 		last_update = now; 
+
+		std::lock_guard<std::mutex> lock(frameCountLock);
+		++framesGrabbed;
+		frameArrived.notify_all();
 	}
 	return goodGrab;
 }
-ThreadedVideoReader::ThreadedVideoReader(int width, int height, const char* file, std::function<void(void)> newFrameCallback, bool flipped)
-: VideoReader(width, height, file) {
+ThreadedVideoReader::ThreadedVideoReader(int width, int height, const char* file, std::function<void(void)> newFrameCallback, CaptureLoop& captureLoop, bool flipped,
+	unsigned int bufferCount, bool newestOnly, double fps)
+: VideoReader(width, height, file, bufferCount, newestOnly), captureLoop(captureLoop) {
 	flipImage = flipped;
+	requestedFps = fps;
+	nonBlocking = true;
 	
 	this->newFrameCallback=newFrameCallback;
 	timeout_clock=std::chrono::steady_clock();
 	last_update = timeout_clock.now();
 
-	mainLoopThread = std::thread([this]() {
-		openReader();	
-		resetTimeoutThread = std::thread(&ThreadedVideoReader::resetterMonitor,this); //Start monitoring thread.
+	deadlineFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (deadlineFd < 0) perror("timerfd_create");
+	// Opening can take a while (and retries forever if the camera's missing), so it's done like a reset
+	requestRecovery(Recovery::Open);
+}
+ThreadedVideoReader::~ThreadedVideoReader() {
+	std::thread recovering;
+	{
+		std::lock_guard<std::mutex> lock(recoveryLock);
+		stopping = true;
+		recovering = std::move(recoveryThread);
+	}
+	{
+		std::lock_guard<std::mutex> lock(frameCountLock);
+		frameArrived.notify_all();
+	}
+	// openReader() and the recovery stages give up once stopping is set
+	if (recovering.joinable()) recovering.join();
+	captureLoop.unwatch(this, true);
+	if (deadlineFd >= 0) close(deadlineFd);
+}
+
+void ThreadedVideoReader::onReadable() {
+	// If it's being reset, the loop is told about it again when that's done
+	if (!resetLock.try_lock()) return;
+	bool goodGrab = grabFrame();
+	int error = errno;
+	resetLock.unlock();
+	if (goodGrab) {
+		armDeadline();
+		if (!stopping) newFrameCallback();
+	}
+	else if (error != EAGAIN && error != EINTR) {
+		// Unplugged, or the driver's having a bad day. Stop listening until it's reset, or it'll keep waking the loop.
+		captureLoop.unwatch(this, false);
+		requestRecovery(Recovery::Stall);
+	}
+}
+
+void ThreadedVideoReader::onDeadline() {
+	uint64_t expirations;
+	read(deadlineFd, &expirations, sizeof(expirations));
+	double waited = std::chrono::duration<double>(timeout_clock.now() - last_update).count();
+	std::cerr << "Camera " << deviceFile << " not responding for " << waited * 1000 << " ms. Recovering..." << std::endl;
+	requestRecovery(Recovery::Stall);
+}
+
+void ThreadedVideoReader::armDeadline() {
+	double timeout = std::chrono::duration<double>(ioctl_timeout).count();
+	if (hasFirstFrame && meanFrameInterval > 0) {
+		// A camera that was asked to slow down is allowed to
+		double expectedInterval = std::max(meanFrameInterval, (requestedFps > 0) ? 1 / requestedFps : 0.0);
+		timeout = std::min(timeout, std::max(minStallTimeout, stallFrames * expectedInterval));
+	}
+	struct itimerspec deadline = {};
+	deadline.it_value.tv_sec = (time_t) timeout;
+	deadline.it_value.tv_nsec = (long) ((timeout - deadline.it_value.tv_sec) * 1e9);
+	if (timerfd_settime(deadlineFd, 0, &deadline, nullptr) < 0) perror("timerfd_settime");
+}
+
+void ThreadedVideoReader::requestRecovery(Recovery recovery) {
+	std::lock_guard<std::mutex> lock(recoveryLock);
+	if (stopping) return;
+	// The ladder is already running, and the deadline going off again (or a read failing) while it's between stages doesn't mean anything new
+	if (recovery == Recovery::Stall && currentRecovery == Recovery::Stall) return;
+	// Recoveries wait for opening to finish, and one asked for while another is running is done after it
+	if (recovery > pendingRecovery) pendingRecovery = recovery;
+	if (recovering) return;
+	if (recoveryThread.joinable()) recoveryThread.join(); // It finished already
+	recovering = true;
+	recoveryThread = std::thread(&ThreadedVideoReader::recover, this);
+}
 
-		while (true) {
-			if (grabFrame()) {
-				resetLock.lock(); resetLock.unlock(); // If resetting, wait until done
-				this->newFrameCallback();
+void ThreadedVideoReader::recover() {
+	while (true) {
+		Recovery recovery;
+		{
+			std::lock_guard<std::mutex> lock(recoveryLock);
+			recovery = pendingRecovery;
+			pendingRecovery = Recovery::None;
+			if (recovery == Recovery::None && modePending) recovery = Recovery::Reconfigure;
+			currentRecovery = recovery;
+			if (recovery == Recovery::None || stopping) {
+				recovering = false;
+				return;
+			}
+		}
+		if (recovery == Recovery::Open) {
+			resetLock.lock();
+			openReader();
+			last_update = timeout_clock.now();
+			if (!stopping) {
+				armDeadline();
+				captureLoop.watch(this);
+			}
+			resetLock.unlock();
+		}
+		else if (recovery == Recovery::Restart) {
+			resetLock.lock();
+			captureLoop.unwatch(this, false);
+			bool restarted = restartStreaming();
+			if (restarted) {
+				last_update = timeout_clock.now();
+				meanFrameInterval = 0;
+				if (!stopping) {
+					armDeadline();
+					captureLoop.watch(this);
+				}
 			}
+			resetLock.unlock();
+			if (!restarted) reset();
 		}
-	});
+		else if (recovery == Recovery::Reconfigure) reconfigure();
+		else recoverFromStall();
+	}
+}
+
+void ThreadedVideoReader::requestMode(unsigned int width, unsigned int height, double fps) {
+	{
+		std::lock_guard<std::mutex> lock(recoveryLock);
+		modePending = true;
+		pendingWidth = width; pendingHeight = height; pendingFps = fps;
+	}
+	requestRecovery(Recovery::Reconfigure);
+}
+
+void ThreadedVideoReader::reconfigure() {
+	unsigned int newWidth, newHeight;
+	double newFps;
+	{
+		std::lock_guard<std::mutex> lock(recoveryLock);
+		if (!modePending) return;
+		modePending = false;
+		newWidth = pendingWidth; newHeight = pendingHeight; newFps = pendingFps;
+	}
+	std::cout << "Switching " << deviceFile << " to " << newWidth << "x" << newHeight << " at " << ((newFps > 0) ? std::to_string(newFps) : "maximum") << " fps" << std::endl;
+	auto start = timeout_clock.now();
+	resetLock.lock();
+	// Wait for the capture loop to finish with the current frame, since its buffer is about to be unmapped and getMat() is about to change size
+	captureLoop.unwatch(this, true);
+	width = newWidth; height = newHeight;
+	requestedFps = newFps;
+	// Stops streaming and sets the new format on the same fd, which is much quicker than reopening
+	VideoReader::reset(false);
+	last_update = timeout_clock.now();
+	meanFrameInterval = 0;
+	if (!stopping) {
+		armDeadline();
+		captureLoop.watch(this);
+	}
+	resetLock.unlock();
+	std::cout << "Switched " << deviceFile << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(last_update - start).count() << " ms" << std::endl;
+}
+
+void ThreadedVideoReader::recoverFromStall() {
+	auto stallStart = last_update;
+	for (int stage = 0; stage < RecoveryStats::STAGES && !stopping; ++stage) {
+		uint64_t before;
+		{
+			std::lock_guard<std::mutex> lock(frameCountLock);
+			before = framesGrabbed;
+		}
+		if (faultStages > 0) --faultStages;
+		if (!runRecoveryStage(stage)) continue;
+		if (!waitForFrame(before, std::chrono::milliseconds(RecoveryStats::STAGE_TIMEOUT_MS[stage]))) continue;
+
+		// The frame that ended it was recorded in last_update
+		int ttr = std::chrono::duration_cast<std::chrono::milliseconds>(last_update - stallStart).count();
+		std::cout << "Camera " << deviceFile << " recovered by " << RecoveryStats::STAGE_NAMES[stage] << " after " << ttr << " ms" << std::endl;
+		std::lock_guard<std::mutex> lock(recoveryLock);
+		++recoveryStats.recovered[stage];
+		int bucket = 0;
+		while (bucket < RecoveryStats::BUCKETS - 1 && ttr >= RecoveryStats::BUCKET_LIMITS_MS[bucket]) ++bucket;
+		++recoveryStats.timeToRecovery[bucket];
+		return;
+	}
+	if (stopping) return;
+	{
+		std::lock_guard<std::mutex> lock(recoveryLock);
+		++recoveryStats.failed;
+	}
+	// Nothing worked, so keep trying to open it until it comes back
+	std::cerr << "Camera " << deviceFile << " didn't recover. Waiting for it..." << std::endl;
+	reset(true);
+}
+
+bool ThreadedVideoReader::runRecoveryStage(int stage) {
+	std::lock_guard<std::mutex> lock(resetLock);
+	// Each stage stops or replaces the fd, so the loop stops listening until it's working again.
+	// Reopening unmaps the buffers, so it waits for the capture loop to finish with the current frame, like reconfigure() does.
+	captureLoop.unwatch(this, true);
+	bool success = false;
+	switch (stage) {
+		case 0: success = requeueBuffers(); break;
+		case 1: success = restartStreaming(); break;
+		case 2:
+			closeReader();
+			success = tryReopen(std::chrono::milliseconds(1000));
+			break;
+		case 3:
+			closeReader();
+			// The device disappears and comes back, often with a new devnum
+			if (resetUsbDevice()) waitForDevice(std::chrono::milliseconds(5000));
+			success = tryReopen(std::chrono::milliseconds(2000));
+			break;
+	}
+	if (success) {
+		meanFrameInterval = 0;
+		if (!stopping) captureLoop.watch(this);
+	}
+	return success;
+}
+
+bool ThreadedVideoReader::waitForFrame(uint64_t before, std::chrono::milliseconds timeout) {
+	std::unique_lock<std::mutex> lock(frameCountLock);
+	frameArrived.wait_for(lock, timeout, [&]{ return framesGrabbed > before || stopping; });
+	return framesGrabbed > before;
+}
+
+RecoveryStats ThreadedVideoReader::getRecoveryStats() {
+	std::lock_guard<std::mutex> lock(recoveryLock);
+	return recoveryStats;
+}
+
+unsigned int RecoveryStats::total() const {
+	unsigned int sum = failed;
+	for (int i = 0; i < STAGES; ++i) sum += recovered[i];
+	return sum;
+}
+
+std::string RecoveryStats::format() const {
+	std::string result = "recovered";
+	for (int i = 0; i < STAGES; ++i) result += std::string(" ") + STAGE_NAMES[i] + "=" + std::to_string(recovered[i]);
+	result += " failed=" + std::to_string(failed) + " ttr";
+	for (int i = 0; i < BUCKETS; ++i) {
+		if (i > 0) result += " ";
+		if (i < BUCKETS - 1) result += "<" + std::to_string(BUCKET_LIMITS_MS[i]);
+		else result += ">=" + std::to_string(BUCKET_LIMITS_MS[BUCKETS - 2]);
+		result += "ms=" + std::to_string(timeToRecovery[i]);
+	}
+	return result;
 }
 
 double ThreadedVideoReader::getMeanFrameInterval() {
@@ -342,26 +760,36 @@ double ThreadedVideoReader::getMeanFrameInterval() {
 	return 1.0/count;
 }
 
-void ThreadedVideoReader::resetterMonitor(){ // Seperate thread that resets the camera buffers if it hangs.
-	while (true) {
-		if((timeout_clock.now()-last_update) > ioctl_timeout){
-			if (hasFirstFrame){
-				std::cerr << "Camera " << deviceFile << " not responding. Resetting..." << std::endl;
-				reset();
-			} 
-			else { // last reset didn't work
-				std::cerr << "Camera " << deviceFile << " still not responding. Hard resetting..." << std::endl;
-				reset(true);
-			}
-		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Because I'm a janky spinlock
+double ThreadedVideoReader::getFrameIntervalJitter() {
+	auto now = timeout_clock.now();
+	double sum = 0, sumSquares = 0;
+	int count = 0;
+	int i = frameTimeIdx;
+	for (int n = 0; n < frameTimeCount - 1; ++n) {
+		int previous = (i == 0) ? frameTimeCount - 1 : i - 1;
+		if (now - frameTimes[previous] >= std::chrono::milliseconds(1000)) break;
+		double interval = std::chrono::duration<double>(frameTimes[i] - frameTimes[previous]).count();
+		sum += interval; sumSquares += interval*interval;
+		++count;
+		i = previous;
 	}
+	if (count < 2) return 0;
+	double mean = sum / count;
+	return sqrt(std::max(0.0, sumSquares / count - mean*mean));
 }
+
 void ThreadedVideoReader::reset(bool hard){
 	std::cout << "Camera " << deviceFile << " resetting..." << std::endl;
 	resetLock.lock();
+	// Its fd is about to stop streaming, or be closed, and its buffers unmapped, so wait for the capture loop to finish with the current frame
+	captureLoop.unwatch(this, true);
 	VideoReader::reset(hard);
 	last_update = timeout_clock.now();
+	meanFrameInterval = 0;
+	if (!stopping) {
+		armDeadline();
+		captureLoop.watch(this);
+	}
 	resetLock.unlock();
 	std::cout << "Camera " << deviceFile << " reset." << std::endl;
 
@@ -369,6 +797,14 @@ void ThreadedVideoReader::reset(bool hard){
 const std::chrono::steady_clock::time_point ThreadedVideoReader::getLastUpdate(){
 	return last_update;
 }
+void ThreadedVideoReader::setFrameRate(double fps) {
+	if (fps == requestedFps) return;
+	requestedFps = fps;
+	std::cout << "Changing framerate of " << deviceFile << " to " << ((fps > 0) ? std::to_string(fps) : "maximum") << std::endl;
+	// uvcvideo refuses VIDIOC_S_PARM while streaming, so restart streaming (without closing the device) to apply it.
+	// This is called from frame callbacks, so it mustn't hold up the capture loop.
+	requestRecovery(Recovery::Restart);
+}
 /* int ThreadedVideoReader::setResolution(int width, int height)
 ** This function attempts to set the resolution of the camera stream to the given values, 
 **  resetting the feed in the process.
@@ -394,8 +830,9 @@ int ThreadedVideoReader::setResolution(unsigned int width,unsigned int height){
 
 
 // https://gist.github.com/thearchitect/96ab846a2dae98329d1617e538fbca3c
-void VideoWriter::openWriter(int width, int height, const char* file) {		
-	v4l2lo = open(file, O_WRONLY|O_CLOEXEC);
+void VideoWriter::openWriter(int width, int height, const char* file, bool useStreaming) {		
+	// mmap() needs read access, even if we're only writing
+	v4l2lo = open(file, (useStreaming ? O_RDWR : O_WRONLY)|O_CLOEXEC);
 	if(v4l2lo < 0) {
 		std::cout << "Error opening v4l2l device: " << strerror(errno);
 		exit(-2);
@@ -416,16 +853,141 @@ void VideoWriter::openWriter(int width, int height, const char* file) {
 	if( t < 0 ) {
 		exit(t);
 	}
+	this->width = width; this->height = height;
+
+	streaming = useStreaming && setupStreaming();
+	if (useStreaming && !streaming) std::cerr << "Streaming output unavailable, falling back to write()" << std::endl;
+}
+bool VideoWriter::setupStreaming() {
+	struct v4l2_requestbuffers bufrequest;
+	memset(&bufrequest, 0, sizeof(bufrequest));
+	bufrequest.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	bufrequest.memory = V4L2_MEMORY_MMAP;
+	bufrequest.count = 4;
+
+	if (ioctl(v4l2lo, VIDIOC_REQBUFS, &bufrequest) < 0) {
+		perror("Output VIDIOC_REQBUFS");
+		return false;
+	}
+	// We need at least one buffer to draw in while another is being read
+	if (bufrequest.count < 2) {
+		std::cerr << "Only got " << bufrequest.count << " output buffers" << std::endl;
+		closeStreaming();
+		return false;
+	}
+
+	buffers.assign(bufrequest.count, MAP_FAILED);
+	for (unsigned int i = 0; i < bufrequest.count; ++i) {
+		struct v4l2_buffer bufferinfo;
+		memset(&bufferinfo, 0, sizeof(bufferinfo));
+		bufferinfo.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		bufferinfo.memory = V4L2_MEMORY_MMAP;
+		bufferinfo.index = i;
+
+		if (ioctl(v4l2lo, VIDIOC_QUERYBUF, &bufferinfo) < 0) {
+			perror("Output VIDIOC_QUERYBUF");
+			closeStreaming();
+			return false;
+		}
+		if (bufferinfo.length < vidsendsiz) {
+			std::cerr << "Output buffer is too small: " << bufferinfo.length << " < " << vidsendsiz << std::endl;
+			closeStreaming();
+			return false;
+		}
+		bufferLength = bufferinfo.length;
+		buffers[i] = mmap(NULL, bufferinfo.length, PROT_READ | PROT_WRITE, MAP_SHARED, v4l2lo, bufferinfo.m.offset);
+		if (buffers[i] == MAP_FAILED) {
+			perror("Output mmap");
+			closeStreaming();
+			return false;
+		}
+	}
+	currentBuffer = 0;
+	nextUnqueued = 1;
+	streamOn = false;
+	std::cout << "Streaming output with " << buffers.size() << " mmap'd buffers" << std::endl;
+	return true;
+}
+void VideoWriter::closeStreaming() {
+	if (streamOn) {
+		int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		if (ioctl(v4l2lo, VIDIOC_STREAMOFF, &type) < 0) perror("Output VIDIOC_STREAMOFF");
+		streamOn = false;
+	}
+	for (void* buffer : buffers) {
+		if (buffer != MAP_FAILED) munmap(buffer, bufferLength);
+	}
+	buffers.clear();
+	
+	struct v4l2_requestbuffers bufrequest;
+	memset(&bufrequest, 0, sizeof(bufrequest));
+	bufrequest.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	bufrequest.memory = V4L2_MEMORY_MMAP;
+	bufrequest.count = 0;
+	if (ioctl(v4l2lo, VIDIOC_REQBUFS, &bufrequest) < 0) perror("Deallocating output buffers: VIDIOC_REQBUFS");
+	currentBuffer = -1;
 }
 void VideoWriter::closeWriter(){
 	std::cout << "Closing VideoWriter: " << v4l2lo << std::endl;
+	if (streaming) closeStreaming();
+	streaming = false;
 	close(v4l2lo);
 }
 
+cv::Mat VideoWriter::getBuffer() {
+	assert(streaming && currentBuffer >= 0);
+	return cv::Mat(height, width, CV_8UC2, buffers[currentBuffer]);
+}
+void VideoWriter::fillBuffers(cv::Mat& frame) {
+	assert(streaming && frame.total() * frame.elemSize() == vidsendsiz && frame.isContinuous());
+	for (void* buffer : buffers) memcpy(buffer, frame.data, vidsendsiz);
+}
+
+void VideoWriter::queueBuffer() {
+	assert(streaming && currentBuffer >= 0);
+
+	struct v4l2_buffer bufferinfo;
+	memset(&bufferinfo, 0, sizeof(bufferinfo));
+	bufferinfo.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	bufferinfo.memory = V4L2_MEMORY_MMAP;
+	bufferinfo.index = currentBuffer;
+	bufferinfo.bytesused = vidsendsiz;
+	bufferinfo.field = V4L2_FIELD_NONE;
+	if (ioctl(v4l2lo, VIDIOC_QBUF, &bufferinfo) < 0) {
+		// We still own the buffer, so the next frame will just be drawn over it.
+		perror("Output VIDIOC_QBUF");
+		return;
+	}
+	if (!streamOn) {
+		int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		if (ioctl(v4l2lo, VIDIOC_STREAMON, &type) < 0) perror("Output VIDIOC_STREAMON");
+		else streamOn = true;
+	}
+
+	if (nextUnqueued < buffers.size()) {
+		currentBuffer = nextUnqueued++;
+		return;
+	}
+	memset(&bufferinfo, 0, sizeof(bufferinfo));
+	bufferinfo.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	bufferinfo.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(v4l2lo, VIDIOC_DQBUF, &bufferinfo) < 0) {
+		// Draw over the buffer we just queued. It may tear, but it's better than not sending anything.
+		perror("Output VIDIOC_DQBUF");
+		return;
+	}
+	currentBuffer = bufferinfo.index;
+}
+
 void VideoWriter::writeFrame(cv::Mat& frame) {
 	assert(frame.total() * frame.elemSize() == vidsendsiz);
 	
-	if (write(v4l2lo, frame.data, vidsendsiz) == -1) {
+	if (streaming) {
+		cv::Mat buffer = getBuffer();
+		frame.copyTo(buffer);
+		queueBuffer();
+	}
+	else if (write(v4l2lo, frame.data, vidsendsiz) == -1) {
 		perror("writing frame");
 	}
 }
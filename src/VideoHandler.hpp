@@ -4,6 +4,10 @@
 #include <chrono>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <string>
 
 #include <opencv2/core.hpp>
 #include <linux/videodev2.h>
@@ -29,7 +33,7 @@ struct resolution {
 class VideoReader {
 
 private: //These are internal and should not be mucked about with.
-	int camfd;
+	int camfd = -1;
 	void* currentBuffer;
 	std::vector<void*> buffers;
 	struct v4l2_buffer bufferinfo; 
@@ -42,17 +46,40 @@ protected: //Should not be directly called. (ThreadedVideoReader uses these)
 	bool tryOpenReader(bool isClosed);
 	void stopStreaming();
 	void closeReader();
+	void setFrameInterval(); // Asks the camera for requestedFps. It can't be streaming.
+	// Recovery stages, for when the camera stops sending frames. Each returns false if it couldn't be done.
+	bool requeueBuffers(); // Gives back any buffers the driver lost track of
+	bool restartStreaming(); // Stops and starts streaming, keeping the buffers mapped. Also applies requestedFps.
+	bool tryReopen(std::chrono::milliseconds wait); // Opens it, giving it up to wait to be ready. It must be closed.
+	bool resetUsbDevice(); // Resets the camera's USB device, as if it was unplugged and plugged back in. It should be closed first.
+	// Waits until deviceFile is created or changed (if it already exists), timeout passes, or stopping is set.
+	void waitForDevice(std::chrono::milliseconds timeout);
 	int width, height; // size of the video
 	void queryResolutions(); //Find (and cache in VideoReader::resolutions!) what resolutions our v4l2 device supports.
 	bool hasResolutions=false; //Kind of jank, but the above function should only get called once. (This is protected, not private in case we want to undo this restriction for some reason)
 	std::vector<resolution> resolutions; //We only save discrete resolutions right now.
 	bool grabFrame(); // Grab the next frame from the camera.
 	const std::string deviceFile; //Name of camera
+	double requestedFps = 0; // Framerate asked of the camera when it's opened. 0 means as fast as possible.
+	std::atomic<bool> stopping{false}; // Set when the camera is going away, so openReader() stops retrying
+	bool nonBlocking = false; // If true, the device is opened with O_NONBLOCK, and grabFrame() fails with EAGAIN when there's no frame yet
+	/* How many buffers the driver fills. More survive a slow consumer without the camera dropping frames, but each one queued up
+	**  is a frame of latency in FIFO mode. The driver may give us more than this.
+	*/
+	const unsigned int bufferCount;
+	// If true, grabFrame() takes every frame that's ready and keeps only the newest, rather than the oldest. See getSkippedFrames().
+	const bool newestOnly;
+	std::atomic<uint64_t> skippedFrames{0};
+	int getFd() { return camfd; }
+	// For fault injection: while it's above 0, the streaming ioctls (QBUF, DQBUF and STREAMON) fail with EIO, like a camera that's gone bad
+	std::atomic<int> faultStages{0};
+	// ioctl() on the camera, for the ones faultStages can break
+	int streamIoctl(unsigned long request, void* arg);
 
 public:
 	bool flipImage = false;
 	virtual void reset(bool hard = false); //Actually resets the camera. (Should this be public? This should probably not be called willy-nilly, but it's useful.)
-	VideoReader(int width, int height, const char* file);
+	VideoReader(int width, int height, const char* file, unsigned int bufferCount = 4, bool newestOnly = false);
 	virtual ~VideoReader();
 	cv::Mat getMat(); // Get the most-recently-grabbed frame in an opencv Mat. The data is not copied.
 	int getWidth();
@@ -62,12 +89,39 @@ public:
 	*/
 	void setExposure(int value) { setExposureVals(false, value); }
 	void setAutoExposure() { setExposureVals(true, 50); } // Turns on auto-exposure.
+	// In newestOnly mode, how many frames have been passed over because a newer one was already waiting
+	uint64_t getSkippedFrames() { return skippedFrames; }
+	bool isNewestOnly() { return newestOnly; }
 	class NotInitializedException : public std::exception {};
 };
 
+class CaptureLoop;
+
+// How ThreadedVideoReader's stalls have been recovered from. Each stage is only tried if the ones before it didn't work.
+struct RecoveryStats {
+	static constexpr int STAGES = 4;
+	static constexpr const char* STAGE_NAMES[STAGES] = { "requeue", "restart", "reopen", "usbReset" };
+	// How long each stage waits for a frame before the next is tried. Cameras take a while to start sending after STREAMON, and longer after opening.
+	static constexpr int STAGE_TIMEOUT_MS[STAGES] = { 200, 1000, 2000, 3000 };
+	unsigned int recovered[STAGES] = {};
+	unsigned int failed = 0; // Every stage was tried and it still didn't send a frame
+	// Time from the last frame before a stall to the first one after, bucketed by these upper limits, with a last bucket for everything longer
+	static constexpr int BUCKETS = 7;
+	static constexpr int BUCKET_LIMITS_MS[BUCKETS - 1] = { 100, 250, 500, 1000, 2500, 5000 };
+	unsigned int timeToRecovery[BUCKETS] = {};
+
+	unsigned int total() const;
+	// e.g. "recovered requeue=2 restart=1 reopen=0 usbReset=0 failed=0 ttr<100ms=0 <250ms=2 <500ms=0 <1000ms=1 <2500ms=0 <5000ms=0 >=5000ms=0"
+	std::string format() const;
+};
+
 /* class ThreadedVideoReader: public VideoReader
 ** ThreadedVideoReader extends VideoReader via a callback-based thread safe approach.
-** It also runs a monitor that automatically resets the camera if it exceeds the new frame timeout.
+** Its frames are waited for by a CaptureLoop, which is shared with the other cameras, and the callback is run on the loop's thread.
+** If the camera misses about two frames (or doesn't send its first one within ioctl_timeout), it's recovered in stages, cheapest first:
+**  requeueing lost buffers, restarting streaming, reopening it, then resetting its USB device. Each stage gets a little while
+**  to produce a frame before the next is tried, and waits on device events rather than sleeping, so a glitch costs a fraction of a second.
+** Opening and recovering happen on a thread of the camera's own, which only exists while it's doing that.
 */
 class ThreadedVideoReader : public VideoReader {
 
@@ -78,32 +132,113 @@ std::chrono::steady_clock timeout_clock;
 static constexpr int frameTimeCount = 100;
 std::chrono::steady_clock::time_point frameTimes[frameTimeCount]; // Ring buffer with last frameTimeCount frame times
 int frameTimeIdx = 0;
-void resetterMonitor(); //Monitors to see if camera should be reset, calls reset() if it should be so. (Started automatically within constructor)
+// How long the camera has to send its first frame after opening or resetting
 static constexpr std::chrono::steady_clock::duration ioctl_timeout = std::chrono::milliseconds(5000);
+// Once it's running, how many frame intervals it can go without a frame, and the least time that can be (for jitter at high framerates)
+static constexpr double stallFrames = 3, minStallTimeout = 0.1;
+// Average frame interval in seconds, for the stall deadline. 0 until two frames have been grabbed since opening or resetting.
+double meanFrameInterval = 0;
 std::mutex resetLock;
-std::thread resetTimeoutThread, mainLoopThread; //Keep ahold of the thread handles
+
+CaptureLoop& captureLoop;
+friend class CaptureLoop;
+int deadlineFd = -1; // timerfd which goes off when the camera is late
+void armDeadline();
+void onReadable(); // Called by captureLoop when there's a frame (or an error)
+void onDeadline(); // Called by captureLoop when the deadline goes off
+
+// Higher ones include the lower ones, so a pending one can be upgraded
+enum class Recovery { None, Restart, Reconfigure, Stall, Open };
+std::mutex recoveryLock;
+Recovery pendingRecovery = Recovery::None, currentRecovery = Recovery::None;
+bool recovering = false;
+std::thread recoveryThread;
+// From requestMode(), waiting to be switched to. A recovery that's more urgent doesn't lose it, since it's done after.
+bool modePending = false;
+unsigned int pendingWidth, pendingHeight;
+double pendingFps;
+// Switches to the pending mode, keeping the camera open. Runs on recoveryThread.
+void reconfigure();
+// Opens, restarts, or recovers the camera on recoveryThread, so the caller (often the capture loop) isn't held up
+void requestRecovery(Recovery recovery);
+void recover();
+// Tries each recovery stage until a frame arrives
+void recoverFromStall();
+bool runRecoveryStage(int stage);
+RecoveryStats recoveryStats; // Guarded by recoveryLock
+
+// Counts frames, so recovery can wait for one
+std::mutex frameCountLock;
+std::condition_variable frameArrived;
+uint64_t framesGrabbed = 0;
+// Returns true if a frame comes after framesGrabbed was before, within timeout
+bool waitForFrame(uint64_t before, std::chrono::milliseconds timeout);
 
 protected:
-bool grabFrame(); //Thread-safe wrapper for VideoReader::grabFrame()
+bool grabFrame(); //Records frame times, for the stall deadline and stats
 
 public:
-	ThreadedVideoReader(int width, int height,const char* file, std::function<void(void)> newFrameCallback, bool flipped = false);
-	virtual ~ThreadedVideoReader() {}; //Does nothing; required to compile?
+	ThreadedVideoReader(int width, int height,const char* file, std::function<void(void)> newFrameCallback, CaptureLoop& captureLoop, bool flipped = false,
+		unsigned int bufferCount = 4, bool newestOnly = false, double fps = 0);
+	// Stops the camera, for when it's been unplugged. Mustn't be called from newFrameCallback, or with anything it needs held.
+	virtual ~ThreadedVideoReader();
 	int setResolution(unsigned int width, unsigned int height);
-	void reset(bool hard = false) override; //Wrapper for VideoReader reset(). (Should this be public? This should probably not be called willy-nilly, but it's useful.)
+	/* Switches resolution and framerate in the background, without closing the camera, and returns straight away.
+	** Frames stop for as long as the camera takes to restart streaming, then come at the new size. The switch waits for newFrameCallback to return,
+	**  so getMat() is safe in it, but anywhere else it can be the new size with the old buffer, or unmapped.
+	** It doesn't check the camera supports the resolution, since it's asked for before the camera's open. The streamer checks against the modes it enumerated.
+	*/
+	void requestMode(unsigned int width, unsigned int height, double fps);
+	// Lowers the camera's framerate (or raises it back with 0, which means as fast as possible). Resets the camera in the background if it can't be changed while streaming.
+	void setFrameRate(double fps);
+	// Waits for newFrameCallback to return, so like the destructor, it mustn't be called from it, or with anything it needs held.
+	void reset(bool hard = false) override; //Wrapper for VideoReader reset(). Waits until it's done. (Should this be public? This should probably not be called willy-nilly, but it's useful.)
 	const std::chrono::steady_clock::time_point getLastUpdate();
 	double getMeanFrameInterval(); // Get a rolling average of the frame interval from the past second, which includes the time since the most recent frame
+	double getFrameIntervalJitter(); // Standard deviation of the intervals between the past second's frames, in seconds
+	RecoveryStats getRecoveryStats();
+	/* Fault injection, for trying out recovery on a real camera: QBUF, DQBUF and STREAMON fail with EIO until stages recovery stages have been started,
+	**  so the next frame goes down the same error path as a real failure, and each stage before the last fails on its own ioctls.
+	** (So 1 is fixed by requeueing, and 4 needs a USB reset.) The camera itself is fine, so it can't show how a real one fails, only how recovery copes.
+	*/
+	void injectFault(unsigned int stages) { faultStages = stages; }
 
 };
 
 
 // Writes video to a v4l2-loopback device
+// Either write()s each frame (which makes the kernel copy it again), or, in streaming mode, hands out mmap'd driver buffers which frames are drawn directly into and then queued.
 class VideoWriter {
 	unsigned int vidsendsiz;
 	int v4l2lo;
+	int width, height;
+
+	// Streaming mode stuff
+	bool streaming = false;
+	bool streamOn = false;
+	std::vector<void*> buffers;
+	unsigned int bufferLength;
+	int currentBuffer = -1; // Index of the buffer we own and is being drawn into
+	unsigned int nextUnqueued = 0; // Buffers are all ours after VIDIOC_REQBUFS, so the first few don't need to be dequeued.
+	bool setupStreaming(); // Requests and maps buffers. Returns false if the driver doesn't support streaming output.
+	void closeStreaming();
 
 public:
-	void openWriter(int width, int height, const char* file);
+	// If useStreaming is true, tries to use mmap'd buffers, falling back to write() if that fails.
+	void openWriter(int width, int height, const char* file, bool useStreaming = false);
 	void closeWriter();
-    void writeFrame(cv::Mat& frame);
+	// Writes a frame. In streaming mode, the frame is copied into the current buffer, which is queued.
+	void writeFrame(cv::Mat& frame);
+	
+	bool isStreaming() { return streaming; }
+	// Streaming mode only. Returns a Mat which points to the driver buffer that the next frame should be drawn into.
+	// It is valid until the next call to queueBuffer().
+	cv::Mat getBuffer();
+	// Streaming mode only. Sends the buffer from getBuffer() and gets a new one.
+	void queueBuffer();
+	// Streaming mode only. Which driver buffer getBuffer() points to, out of getBufferCount(). They're reused in turn.
+	int getBufferIndex() { return currentBuffer; }
+	unsigned int getBufferCount() { return buffers.size(); }
+	// Streaming mode only. Copies frame into every buffer, for things which never change, like the background.
+	void fillBuffers(cv::Mat& frame);
 };
\ No newline at end of file
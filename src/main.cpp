@@ -29,6 +29,7 @@
 
 #include "DataComm.hpp"
 #include "ControlPacketReceiver.hpp"
+#include "FileWatcher.hpp"
 
 #include <dlfcn.h>
 
@@ -39,7 +40,9 @@ using std::cout; using std::cerr; using std::endl; using std::string;
 // when false, drastically slows down vision processing
 volatile bool visionEnabled = false;
 
-VisionTarget lastResults;
+// Written by the vision thread, read by the capture thread for the overlay. Guarded by lastResultsLock.
+VisionResults lastResults;
+std::mutex lastResultsLock;
 //std::vector<cv::Point> lastResults;
 
 std::chrono::steady_clock timing_clock;
@@ -50,6 +53,8 @@ std::mutex waitMutex;
 std::condition_variable condition;
 void visionFrameNotifier(); //Declared later in namespace
 Streamer streamer(visionFrameNotifier);
+string getStats(); //Declared later, next to the vision thread whose stats it reports
+string reloadThresholds(); string reloadCalibration(); string setThresholds(string arguments); string setTarget(string name); void applyPendingParams(); void changeCalibResolution(int width, int height); //Declared later, next to the calibration functions
 
 //Callback function passed into ControlPacketReceiver.
 // recieves enable/disable signals from the RIO to conserve thermal capacity.
@@ -65,7 +70,14 @@ string parseControlMessage(string message) {
 		indexOfDelimiter = message.length() - 1;
 	}
 	std::string command=message.substr(0,indexOfDelimiter);
-		if (command == "reset" || command == "resolution") {
+		if (command == "stats") {
+		// stats:<cameras> is just those cameras, from the streamer. Plain stats is everything.
+		string arguments = (indexOfDelimiter < message.length()) ? message.substr(indexOfDelimiter+1, string::npos) : "";
+		if (!arguments.empty() && arguments[arguments.length()-1] == '\n') arguments = arguments.substr(0, arguments.length()-1);
+		if (!arguments.empty()) return streamer.parseControlMessage(command, arguments);
+		return getStats();
+	}
+	else if (command == "reset" || command == "resolution" || command == "subscribe" || command == "unsubscribe" || command == "fault") {
 			if(indexOfDelimiter >= message.length()){
 			//There just isn't a : in there.
 			return "UNPARSABLE MESSAGE (No colon-seperator)\n";
@@ -77,6 +89,28 @@ string parseControlMessage(string message) {
 		
 		return streamer.parseControlMessage(command, arguments);
 	}
+	else if (command == "streamReport") {
+		if(indexOfDelimiter >= message.length()){
+			return "UNPARSABLE MESSAGE (No colon-seperator)\n";
+		}
+		return streamer.handleReceiverReport(message.substr(indexOfDelimiter+1,string::npos));
+	}
+	else if (command == "usbPlan") return streamer.getUsbPlan();
+	else if (command == "reloadParams") return reloadThresholds() + reloadCalibration();
+	else if (command == "thresholds") {
+		if(indexOfDelimiter >= message.length()){
+			return "UNPARSABLE MESSAGE (No colon-seperator)\n";
+		}
+		return setThresholds(message.substr(indexOfDelimiter+1,string::npos));
+	}
+	else if (command == "target") {
+		if(indexOfDelimiter >= message.length()){
+			return "UNPARSABLE MESSAGE (No colon-seperator)\n";
+		}
+		string name = message.substr(indexOfDelimiter+1,string::npos);
+		if (!name.empty() && name[name.length()-1] == '\n') name = name.substr(0, name.length()-1);
+		return setTarget(name);
+	}
 	else if (command == "visionEnable") visionEnabled = true;
 	else if (command == "visionDisable") visionEnabled = false;
 	else if (command == "lowExposureOn") streamer.setLowExposure(true);
@@ -86,12 +120,25 @@ string parseControlMessage(string message) {
 	return "Success\n";
 }
 
+// For the stats control message: the latency from capture to results of the last LATENCY_SAMPLES frames, and when each was done
+constexpr int LATENCY_SAMPLES = 256;
+struct LatencySample {
+	std::chrono::steady_clock::time_point doneTime;
+	double latencyMs;
+};
+LatencySample latencySamples[LATENCY_SAMPLES];
+int latencySampleCount = 0, nextLatencySample = 0;
+std::mutex latencyLock;
+// Null until the vision thread starts
+DataComm* rioCommForStats = nullptr;
+
 void VisionThread() {
 	errno = 0;
 	nice(5);
 	if (errno != 0) perror("nice");
 
 	DataComm rioComm=DataComm("10.57.8.2", "5808");
+	rioCommForStats = &rioComm;
 
 	auto lastFrameTime = currentFrameTime;
 	while (true) {
@@ -104,67 +151,186 @@ void VisionThread() {
 		
 		// currentFrameTime serves as a unique marker for this frame
 		lastFrameTime = currentFrameTime;
-		lastResults = doVision(streamer.getBGRFrame());
+		applyPendingParams();
+		cv::Mat frame = streamer.getBGRFrame();
+		if (frame.empty()) continue;
+		// The vision camera can switch resolution mid-match (see Streamer's resolution control message)
+		if (frame.cols != calib::current->width || frame.rows != calib::current->height) changeCalibResolution(frame.cols, frame.rows);
+		VisionResults results = doVision(frame);
+		{
+			std::lock_guard<std::mutex> lock(lastResultsLock);
+			lastResults = results;
+		}
 				
-		if (lastResults.calcs.distance != 0) rioComm.sendData(lastResults.calcs, lastFrameTime);		
+		if (results.found()) rioComm.sendResults(results, lastFrameTime);		
+
+		auto doneTime = timing_clock.now();
+		std::lock_guard<std::mutex> lock(latencyLock);
+		latencySamples[nextLatencySample] = { doneTime, std::chrono::duration<double, std::milli>(doneTime - lastFrameTime).count() };
+		nextLatencySample = (nextLatencySample + 1) % LATENCY_SAMPLES;
+		latencySampleCount = std::min(latencySampleCount + 1, LATENCY_SAMPLES);
 	}
 }
 
+// Everything a dashboard would want to poll between matches, in one response. See Streamer::getStats() for the camera and stream lines.
+string getStats() {
+	std::stringstream stats;
+	stats.precision(3);
+
+	// Vision framerate, and latency percentiles
+	std::vector<double> latencies;
+	int framesInLastSecond = 0;
+	{
+		std::lock_guard<std::mutex> lock(latencyLock);
+		auto now = timing_clock.now();
+		for (int i = 0; i < latencySampleCount; ++i) {
+			latencies.push_back(latencySamples[i].latencyMs);
+			if (now - latencySamples[i].doneTime < std::chrono::seconds(1)) ++framesInLastSecond;
+		}
+	}
+	std::sort(latencies.begin(), latencies.end());
+	VisionTimings visionTimings = getVisionTimings();
+	auto percentile = [&latencies](double p) { return latencies.empty() ? 0 : latencies[(size_t) (p * (latencies.size() - 1))]; };
+	stats << "vision " << (visionEnabled ? "enabled" : "disabled") << " fps=" << framesInLastSecond
+	<< " pipeline=" << visionTimings.pipeline << "ms corners=" << visionTimings.corners << "ms pnp=" << visionTimings.pnp << "ms total=" << visionTimings.total << "ms"
+	<< " latency p50=" << percentile(0.5) << "ms p90=" << percentile(0.9) << "ms p99=" << percentile(0.99) << "ms\n";
+
+	if (rioCommForStats != nullptr) {
+		DataComm::Stats telemetry = rioCommForStats->getStats();
+		stats << "telemetry sent=" << telemetry.sent << " coalesced=" << telemetry.coalesced << " dropped=" << telemetry.dropped << "\n";
+	}
+
+	stats << streamer.getStats();
+
+	std::ifstream temperatureFile("/sys/class/thermal/thermal_zone0/temp");
+	int milliCelsius;
+	if (temperatureFile >> milliCelsius) stats << "cpuTemp=" << milliCelsius / 1000.0 << "C\n";
+	return stats.str();
+}
+
+// The vision camera's calibrations, which calib::current is one of. Only the vision thread uses it, once it's started.
+std::shared_ptr<CalibrationStore> calibrationStore = std::make_shared<CalibrationStore>();
+
 void setDefaultCalibParams() {
-	calib::width = 1280; calib::height = 720;
+	Calibration calibration;
+	calibration.width = 1280; calibration.height = 720;
 	
 	// Old cameras' FOV is 69°, new camera is 78°
 	//constexpr double radFOV = (69.0/180.0)*M_PI;
 	constexpr double radFOV = (78.0/180.0)*M_PI;
-	const double pixFocalLength = tan((M_PI_2) - radFOV/2) * sqrt(pow(calib::width, 2) + pow(calib::height, 2))/2; // pixels. Estimated from the camera's FOV spec.
+	const double pixFocalLength = tan((M_PI_2) - radFOV/2) * sqrt(pow(calibration.width, 2) + pow(calibration.height, 2))/2; // pixels. Estimated from the camera's FOV spec.
 
 	static double cameraMatrixVals[] {
-		pixFocalLength, 0, ((double) calib::width)/2,
-		0, pixFocalLength, ((double) calib::height)/2,
+		pixFocalLength, 0, ((double) calibration.width)/2,
+		0, pixFocalLength, ((double) calibration.height)/2,
 		0, 0, 1
 	};
-	calib::cameraMatrix = cv::Mat(3, 3, CV_64F, cameraMatrixVals);
+	calibration.cameraMatrix = cv::Mat(3, 3, CV_64F, cameraMatrixVals);
 	// distCoeffs is empty matrix
+	calibrationStore->setBase(calibration);
 }
 bool readCalibParams(const std::string path) {
-	cv::FileStorage calibFile;
-	calibFile.open(path.c_str(), cv::FileStorage::READ);
-	if (!calibFile.isOpened()) {
-		std::cerr << "Failed to open camera data " << path << endl;
-		return false;
-	}
-	
-	//setDefaultCalibParams();
-	calib::cameraMatrix = calibFile["cameraMatrix"].mat();
-	calib::distCoeffs = calibFile["dist_coeffs"].mat();
-	cv::FileNode calibSize = calibFile["cameraResolution"];
-
-	calib::width = calibSize[0];
-	calib::height = calibSize[1];
-	
-	assert(calib::cameraMatrix.type() == CV_64F);
-	
-	// correcting for opencv bug?
-	//calib::cameraMatrix.at<double>(0,0) *= 2;
-	//calib::cameraMatrix.at<double>(1,1) *= 2;
-	
+	auto store = std::make_shared<CalibrationStore>();
+	if (!store->load(path, streamer.getVisionCameraSizes())) return false;
+	calibrationStore = store;
 	cout << "Loaded camera data: " << path << endl;
 	return true;
 }
 // change camera calibration to match resolution of incoming image
 void changeCalibResolution(int width, int height) {
-	assert(calib::cameraMatrix.type() == CV_64F);
-	if (fabs(calib::width / (double) calib::height - width / (double) height) > 0.03) {
-		cerr << "wrong aspect ratio recieved from camera! Vision will be borked!" << endl;
-	}
-	calib::cameraMatrix.at<double>(0, 0) *= (width / (double) calib::width);
-	calib::cameraMatrix.at<double>(0, 2) *= (width / (double) calib::width);
-	calib::cameraMatrix.at<double>(1, 1) *= (height / (double) calib::height);
-	calib::cameraMatrix.at<double>(1, 2) *= (height / (double) calib::height);
-
-	calib::width = width; calib::height = height;
+	calib::current = calibrationStore->get(width, height);
 	
-	cout << "Vision camera matrix set to: \n" << calib::cameraMatrix << endl;
+	cout << "Vision camera matrix set to: \n" << calib::current->cameraMatrix << endl;
+}
+
+/* Hot reloading: thresholds and calibration can be changed without restarting, by editing their files or with control messages.
+** New values wait in these until the vision thread picks them up between frames, so a frame never sees half of an update,
+**  and loading and parsing the files never holds up vision.
+*/
+std::shared_ptr<grip::HslThresholds> pendingThresholds;
+std::shared_ptr<CalibrationStore> pendingCalibration;
+std::shared_ptr<TargetModelId> pendingTarget;
+// Thresholds file, e.g.
+// %YAML:1.0
+// hue: [ 0, 180 ]
+// saturation: [ 0, 255 ]
+// luminance: [ 200, 255 ]
+const std::string thresholdsPath = "/home/pi/calib-data/thresholds.yml";
+// Set once the vision camera is known
+std::string calibrationPath;
+
+// Called by the vision thread between frames
+void applyPendingParams() {
+	auto thresholds = std::atomic_exchange(&pendingThresholds, std::shared_ptr<grip::HslThresholds>());
+	if (thresholds) visionThresholds = *thresholds;
+	auto target = std::atomic_exchange(&pendingTarget, std::shared_ptr<TargetModelId>());
+	if (target) visionTarget = *target;
+	auto calibration = std::atomic_exchange(&pendingCalibration, std::shared_ptr<CalibrationStore>());
+	if (calibration) {
+		calibrationStore = calibration;
+		if (calib::current) calib::current = calibrationStore->get(calib::current->width, calib::current->height);
+	}
+}
+bool loadThresholds(const std::string path, grip::HslThresholds& thresholds) {
+	cv::FileStorage file;
+	if (!file.open(path.c_str(), cv::FileStorage::READ)) return false;
+	// Anything missing keeps its default
+	auto readRange = [&file](const char* name, double range[2]) {
+		cv::FileNode node = file[name];
+		if (node.size() == 2) { range[0] = node[0]; range[1] = node[1]; }
+	};
+	readRange("hue", thresholds.hue);
+	readRange("saturation", thresholds.saturation);
+	readRange("luminance", thresholds.luminance);
+	return true;
+}
+std::string formatThresholds(const grip::HslThresholds& thresholds) {
+	std::stringstream formatted;
+	formatted << "hue " << thresholds.hue[0] << "-" << thresholds.hue[1]
+	<< " saturation " << thresholds.saturation[0] << "-" << thresholds.saturation[1]
+	<< " luminance " << thresholds.luminance[0] << "-" << thresholds.luminance[1];
+	return formatted.str();
+}
+/* The file watcher's thread and the reloadParams command can both reload at once. Holding this while loading and storing means they
+**  don't write the same calibration cache file together, and whichever reads a file last is the one that's applied.
+*/
+std::mutex reloadLock;
+// Reloads the thresholds file. Returns a status message.
+std::string reloadThresholds() {
+	std::lock_guard<std::mutex> lock(reloadLock);
+	auto thresholds = std::make_shared<grip::HslThresholds>();
+	if (!loadThresholds(thresholdsPath, *thresholds)) return "Failed to open " + thresholdsPath + "\n";
+	std::atomic_store(&pendingThresholds, thresholds);
+	return "Thresholds: " + formatThresholds(*thresholds) + "\n";
+}
+// Reloads the vision camera's calibration file. Returns a status message.
+std::string reloadCalibration() {
+	std::lock_guard<std::mutex> lock(reloadLock);
+	// Built here, so the vision thread only has to swap it in
+	auto calibration = std::make_shared<CalibrationStore>();
+	if (calibrationPath.empty() || !calibration->load(calibrationPath, streamer.getVisionCameraSizes())) return "Failed to load " + calibrationPath + "\n";
+	int width = streamer.getVisionCameraWidth(), height = streamer.getVisionCameraHeight();
+	std::stringstream status;
+	status << "Calibration for " << width << "x" << height << ": " << calibration->get(width, height)->cameraMatrix.reshape(1, 1) << "\n";
+	std::atomic_store(&pendingCalibration, calibration);
+	return status.str();
+}
+// thresholds:<hue min> <hue max> <saturation min> <saturation max> <luminance min> <luminance max>
+// Not saved to the thresholds file, so they're lost on restart.
+std::string setThresholds(std::string arguments) {
+	auto thresholds = std::make_shared<grip::HslThresholds>();
+	std::stringstream toParse(arguments);
+	toParse >> thresholds->hue[0] >> thresholds->hue[1] >> thresholds->saturation[0] >> thresholds->saturation[1] >> thresholds->luminance[0] >> thresholds->luminance[1];
+	if (toParse.fail()) return "UNPARSABLE THRESHOLDS (Need 6 numbers)\n";
+	std::atomic_store(&pendingThresholds, thresholds);
+	return "Thresholds: " + formatThresholds(*thresholds) + "\n";
+}
+// target:<name>, picks the target model vision looks for (see TargetModels.hpp). Like thresholds, it's lost on restart.
+std::string setTarget(std::string name) {
+	auto target = std::make_shared<TargetModelId>();
+	if (!parseTargetModel(name, *target)) return "UNKNOWN TARGET " + name + "\n";
+	std::atomic_store(&pendingTarget, target);
+	return std::string("Target: ") + targetModelName(*target) + "\n";
 }
 
 // Test the vision system, feeding it a static image.
@@ -190,7 +356,13 @@ bool fileIsImage(char* file) {
 	return extension == "PNG" || extension == "JPG" || extension == "JPEG";
 }
 void drawTargets(cv::Mat drawOn) {
-	drawVisionPoints(lastResults.drawPoints, drawOn);
+	// Copied under the lock, so drawing (outside it) never holds up the vision thread, and never mixes two frames' results
+	VisionResults results;
+	{
+		std::lock_guard<std::mutex> lock(lastResultsLock);
+		results = lastResults;
+	}
+	for (unsigned int i = 0; i < results.count; ++i) drawVisionPoints(results.targets[i].drawPoints, drawOn);
     /*	
 	// draw thing to see if camera is updating
 	static std::chrono::steady_clock::time_point beginTime = timing_clock.now();
@@ -314,11 +486,22 @@ int main(int argc, char** argv) {
 	});
 	
 	// will fail if the file doesn't exist, and use the default params instead
-	readCalibParams("/home/pi/calib-data/" + streamer.visionCameraName + ".xml");
+	calibrationPath = "/home/pi/calib-data/" + streamer.visionCameraName + ".xml";
+	readCalibParams(calibrationPath);
 	// Scale the calibration parameters to match the current resolution
 	changeCalibResolution(streamer.getVisionCameraWidth(), streamer.getVisionCameraHeight());
+	if (loadThresholds(thresholdsPath, visionThresholds)) cout << "Loaded thresholds: " << formatThresholds(visionThresholds) << endl;
+
+	// Pick up edited thresholds and calibration without a restart
+	FileWatcher paramWatcher([](const std::string& path) {
+		std::string status = (path == thresholdsPath) ? reloadThresholds() : reloadCalibration();
+		cout << path << " changed. " << status;
+	});
+	paramWatcher.watch(thresholdsPath);
+	paramWatcher.watch(calibrationPath);
 
-	ControlPacketReceiver receiver=ControlPacketReceiver(&parseControlMessage,5805);
+	// Resetting a camera takes a while, so that doesn't hold up the RIO's commands. (Resolution changes happen in the background.)
+	ControlPacketReceiver receiver=ControlPacketReceiver(&parseControlMessage,5805,{"reset"});
     VisionThread();
 	return 0;
 }
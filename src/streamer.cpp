@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <chrono>
 #include <thread>
+#include <algorithm>
 
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -25,11 +26,12 @@ using std::cout; using std::cerr; using std::endl; using std::string; using std:
 
 
 // These are the model numbers of our cameras
-// They are matched with device names from sysfs
+// They are matched with device names from /dev/v4l/by-id
 // Since cameraDevs[0] is always the vision camera, our camera that's most likely to be used for vision comes first
 vector<string> cameraNames = {
 	"C920_99EDB55F", "C615_603161B0", "C525_5FC6DE20", "C615_F961A370"
 };
+// Whether each of cameraNames is mounted upside down
 vector<bool> flipCameras = {
 	true, false, false, true
 };
@@ -43,20 +45,47 @@ void Streamer::start() {
 	setupCameras();
 	calculateOutputSize();
 	setupFramebuffer();
-	videoWriter.openWriter(outputWidth, outputHeight, loopbackDev.c_str());
+	openWriter();
 	initialized = true;	
+	if (outputFps > 0) {
+		pacer = std::make_unique<FramePacer>(frameLock, 
+			std::bind(&Streamer::emitFrame, this, std::placeholders::_1),
+			std::bind(&Streamer::checkFramebufferReadiness, this),
+			std::bind(&Streamer::anyNewFrames, this));
+		pacer->start(outputFps, lateTileWait);
+	}
+	if (snapshotPort != 0) {
+		// Leave room for cameras that are plugged in later
+		snapshotServer = std::make_unique<SnapshotServer>((hotplug ? MAX_CAMERAS : cameraDevs.size()) + 1);
+		snapshotServer->quality = snapshotQuality;
+		snapshotServer->maxFps = snapshotMaxFps;
+		if (!snapshotServer->start(snapshotPort)) snapshotServer.reset();
+	}
 	// Start the thread that listens for the signal from the driver station
 	std::thread(&Streamer::dsListener, this).detach();
+	if (hotplug) {
+		cameraHotplug = std::make_unique<CameraHotplug>(cameraDiscovery, cameraNames,
+			std::bind(&Streamer::camerasChanged, this, std::placeholders::_1));
+	}
 }
 
 // --------------- Camera stuff -------------------
 
 cv::Mat Streamer::getBGRFrame() {
 	cv::Mat frame;
-	cvtColor(visionCamera->getMat(), frame, cv::COLOR_YUV2BGR_YUYV);
+	std::lock_guard<std::mutex> lock(visionFrameLock);
+	if (!visionFrame.empty()) cvtColor(visionFrame, frame, cv::COLOR_YUV2BGR_YUYV);
 	return frame;
 }
 
+void Streamer::offerVisionFrame(const cv::Mat& frame) {
+	{
+		std::lock_guard<std::mutex> lock(visionFrameLock);
+		frame.copyTo(visionFrame);
+	}
+	visionFrameNotifier(); //New vision frame
+}
+
 void Streamer::setLowExposure(bool value) {
 	if (value != lowExposure) {
 		lowExposure = value;
@@ -68,10 +97,19 @@ void Streamer::setLowExposure(bool value) {
 	}
 }
 
+// The biggest each camera can be, for a given number of cameras. Camera 0 is the vision camera.
+static vector<cv::Size2i> planCameraSizes(unsigned int count) {
+	if (count == 1) return vector<cv::Size2i>(count, {800, 448});
+	if (count == 2) return vector<cv::Size2i>(count, {640, 360});
+	vector<cv::Size2i> sizes(count, {432, 240});
+	sizes[0] = {640, 360};
+	return sizes;
+}
+
 void Streamer::setupCameras(){
 	if(initialized) return;
 
-	vector<string> loopbackDevList = getLoopbackDevices();
+	vector<string> loopbackDevList = cameraDiscovery.findLoopbackDevices();
 	if (loopbackDevList.empty()) {
 		std::cerr << "v4l2loopback device not found" << std::endl;
 		exit(1);
@@ -81,77 +119,255 @@ void Streamer::setupCameras(){
 		std::cout << "video loopback device: " << loopbackDev << std::endl;
 	}
 
-
-	for (auto& i : cameraNames) {
-		vector<string> namedCameras = getVideoDevicesWithString(i);
-		cameraDevs.insert(cameraDevs.end(), namedCameras.begin(), namedCameras.end());
-		if (visionCameraName.empty() && namedCameras.size() > 0) visionCameraName = i;
-	}
+	vector<CameraDiscovery::Camera> cameras = cameraDiscovery.findCameras(cameraNames);
 	
-	std::cout << "Cameras detected: " << cameraDevs.size() << std::endl;
+	std::cout << "Cameras detected: " << cameras.size() << std::endl;
 		
-	if (cameraDevs.size() == 0) {
+	if (cameras.size() == 0) {
 		std::cerr << "Camera not found" << std::endl;
 		exit(1);
 	}
+	if (cameras.size() > MAX_CAMERAS) {
+		std::cerr << "Over " << MAX_CAMERAS << " cameras unsupported, ignoring the rest" << std::endl;
+		cameras.resize(MAX_CAMERAS);
+	}
+	visionCameraName = cameras[0].model;
 	
-	std::cout << "main (vision) camera: " << cameraDevs[0] << std::endl;
-	for (unsigned int i = 0; i < cameraDevs.size(); ++i) {
-		std::cout << "Camera " << i << ": " << cameraDevs[i] << std::endl;
+	std::cout << "main (vision) camera: " << cameras[0].device << std::endl;
+	for (unsigned int i = 0; i < cameras.size(); ++i) {
+		std::cout << "Camera " << i << ": " << cameras[i].device << std::endl;
 	}
 
-	std::vector<cv::Size2i> targetDims;
-	
-	if (cameraDevs.size() == 1) {
-		targetDims = std::vector<cv::Size2i>(cameraDevs.size(), {800, 448});
+	vector<string> devices;
+	vector<vector<CameraMode>> modes;
+	for (auto& camera : cameras) {
+		devices.push_back(camera.device);
+		modes.push_back(BandwidthPlanner::enumerateModes(camera.device));
 	}
-	else if (cameraDevs.size() == 2) {
-		targetDims = std::vector<cv::Size2i>(cameraDevs.size(), {640, 360});
+	vector<CameraMode> plan = planCameraModes(usbPlanner, devices, modes, {}, {});
+	for (unsigned int i = 0; i < cameras.size(); ++i) {
+		unsigned int id = nextCameraId++;
+		attachCamera(cameras[i], plan[i], modes[i], openCamera(cameras[i], plan[i], id, i), id);
 	}
-	else {
-		targetDims = std::vector<cv::Size2i>(cameraDevs.size(), {432, 240});
-		targetDims[0] = {640, 360};
+	visionCamera = cameraReaders[0].get();
+}
+
+vector<CameraMode> Streamer::planCameraModes(BandwidthPlanner& planner, const vector<string>& devices, const vector<vector<CameraMode>>& modes,
+	const vector<bool>& keep, const vector<CameraMode>& current) {
+	vector<cv::Size2i> sizes = planCameraSizes(devices.size());
+	vector<BandwidthPlanner::Request> requests;
+	for (unsigned int i = 0; i < devices.size(); ++i) requests.push_back({ devices[i], modes[i], sizes[i], maxCameraFps });
+	for (unsigned int i = 0; i < keep.size(); ++i) {
+		if (!keep[i]) continue;
+		requests[i].modes = { current[i] };
+		requests[i].maxSize = cv::Size2i(current[i].width, current[i].height);
 	}
+	return planner.plan(requests);
+}
 
-	newFrames.resize(cameraDevs.size());
-	cameraFrameCounts.resize(cameraDevs.size());
-	
-	for (unsigned int i = 0; i < cameraDevs.size(); ++i) {
-		cameraReaders.push_back(std::make_unique<ThreadedVideoReader>(
-			targetDims[i].width, targetDims[i].height, cameraDevs[i].c_str(),std::bind(&Streamer::pushFrame,this,i), 
-			flipCameras[i])//Bind callback to relevant id.
-		);
-		if (i == 0) visionCamera = cameraReaders[0].get();
+// The mode a camera's asked for when it's switched to width x height at fps. Only YUYV is captured, since that's what's composited.
+static CameraMode yuyvMode(unsigned int width, unsigned int height, double fps) {
+	return { V4L2_PIX_FMT_YUYV, width, height, fps, BandwidthPlanner::requiredMbps(V4L2_PIX_FMT_YUYV, width, height, fps) };
+}
+
+bool Streamer::supportsSize(unsigned int i, unsigned int width, unsigned int height) {
+	for (auto& mode : supportedModes[i]) {
+		if (mode.pixelFormat == V4L2_PIX_FMT_YUYV && mode.width == width && mode.height == height) return true;
 	}
+	return false;
+}
+
+std::shared_ptr<ThreadedVideoReader> Streamer::openCamera(const CameraDiscovery::Camera& camera, const CameraMode& mode, unsigned int id, unsigned int position) {
+	auto model = std::find(cameraNames.begin(), cameraNames.end(), camera.model);
+	bool known = model != cameraNames.end();
+	bool flipped = known && flipCameras[model - cameraNames.begin()];
+	/* The vision camera is aimed with, so a fresh frame matters more than seeing every one, and it only delivers the newest that's ready.
+	** The others are just watched, so they keep every frame. It's whichever camera is first, whatever model, and it never moves, even when unplugged.
+	*/
+	bool vision = position == 0;
+	unsigned int bufferCount = vision ? 3 : 4;
+	return std::make_shared<ThreadedVideoReader>(
+		mode.width, mode.height, camera.device.c_str(), std::bind(&Streamer::pushFrame, this, id), captureLoop, flipped, bufferCount, vision, mode.fps);
+}
+
+void Streamer::attachCamera(const CameraDiscovery::Camera& camera, const CameraMode& mode, const vector<CameraMode>& modes,
+	std::shared_ptr<ThreadedVideoReader> reader, unsigned int id) {
+	cameraDevs.push_back(camera.device);
+	cameraModels.push_back(camera.model);
+	supportedModes.push_back(modes);
+	requestedModes.push_back(yuyvMode(mode.width, mode.height, mode.fps));
+	modePicked.push_back(false);
+	cameraIds.push_back(id);
+	newFrames.push_back(false);
+	cameraFrameCounts.push_back(0);
+	subscribed.push_back(true);
+	changeDetectors.emplace_back();
+	cameraDownrated.push_back(false);
+	tileStatic.push_back(false);
+	cameraReaders.push_back(reader);
 }
 
+std::shared_ptr<ThreadedVideoReader> Streamer::detachCamera(unsigned int i) {
+	std::shared_ptr<ThreadedVideoReader> camera = cameraReaders[i];
+	cameraDevs.erase(cameraDevs.begin() + i);
+	cameraModels.erase(cameraModels.begin() + i);
+	supportedModes.erase(supportedModes.begin() + i);
+	requestedModes.erase(requestedModes.begin() + i);
+	modePicked.erase(modePicked.begin() + i);
+	cameraIds.erase(cameraIds.begin() + i);
+	newFrames.erase(newFrames.begin() + i);
+	cameraFrameCounts.erase(cameraFrameCounts.begin() + i);
+	subscribed.erase(subscribed.begin() + i);
+	changeDetectors.erase(changeDetectors.begin() + i);
+	cameraDownrated.erase(cameraDownrated.begin() + i);
+	tileStatic.erase(tileStatic.begin() + i);
+	cameraReaders.erase(cameraReaders.begin() + i);
+	if (i < cameraStreams.size()) cameraStreams.erase(cameraStreams.begin() + i);
+	return camera;
+}
+
+void Streamer::camerasChanged(const vector<CameraDiscovery::Camera>& found) {
+	/* Listing a new camera's modes and opening it are slow, and the capture loop would be waiting for frameLock in every camera's pushFrame(),
+	**  so they're done on a copy first, and frameLock is only held to swap the cameras in and out.
+	** Only this thread plugs or unplugs cameras, so the copy stays right. (Their modes can change, which is why the vision camera's is copied.)
+	*/
+	frameLock.lock();
+	vector<string> devices = cameraDevs;
+	vector<vector<CameraMode>> modes = supportedModes;
+	vector<CameraMode> current = requestedModes;
+	vector<bool> keep = modePicked;
+	BandwidthPlanner planner = usbPlanner;
+	frameLock.unlock();
+	// Vision's calibration is scaled for its resolution, so it keeps what it has, and the others fit around it
+	keep[0] = true;
+
+	// The vision camera stays, even when it's unplugged
+	vector<unsigned int> unplugged;
+	for (int i = devices.size() - 1; i >= 1; --i) {
+		bool present = false;
+		for (auto& camera : found) present |= camera.device == devices[i];
+		if (present) continue;
+		cout << "Camera " << i << " (" << devices[i] << ") unplugged" << endl;
+		unplugged.push_back(i);
+	}
+	for (unsigned int i : unplugged) {
+		devices.erase(devices.begin() + i);
+		modes.erase(modes.begin() + i);
+		current.erase(current.begin() + i);
+		keep.erase(keep.begin() + i);
+	}
+	unsigned int firstAdded = devices.size();
+	vector<CameraDiscovery::Camera> added;
+	for (auto& camera : found) {
+		if (std::find(devices.begin(), devices.end(), camera.device) != devices.end()) continue;
+		if (devices.size() >= MAX_CAMERAS) {
+			cerr << "Over " << MAX_CAMERAS << " cameras unsupported, ignoring " << camera.device << endl;
+			continue;
+		}
+		cout << "Camera " << devices.size() << " (" << camera.device << ") plugged in" << endl;
+		added.push_back(camera);
+		devices.push_back(camera.device);
+		modes.push_back(BandwidthPlanner::enumerateModes(camera.device));
+	}
+	if (unplugged.empty() && added.empty()) return;
+
+	vector<CameraMode> plan = planCameraModes(planner, devices, modes, keep, current);
+	vector<std::shared_ptr<ThreadedVideoReader>> opened;
+	vector<unsigned int> openedIds;
+	for (unsigned int i = 0; i < added.size(); ++i) {
+		openedIds.push_back(nextCameraId++);
+		opened.push_back(openCamera(added[i], plan[firstAdded + i], openedIds.back(), firstAdded + i));
+	}
+
+	vector<std::shared_ptr<ThreadedVideoReader>> detached;
+	// Resetting a camera to change its framerate takes a while, so it's done after unlocking. -1 means no change.
+	vector<double> changeFrameRate(firstAdded, -1);
+	vector<ThreadedVideoReader*> cameras;
+	frameLock.lock();
+	for (unsigned int i : unplugged) detached.push_back(detachCamera(i));
+	usbPlanner = planner;
+	for (unsigned int i = 1; i < firstAdded; ++i) {
+		// Picked with the resolution control message (maybe while this was planning), so it's left alone
+		if (modePicked[i]) continue;
+		CameraMode& requested = requestedModes[i];
+		if (plan[i].width == requested.width && plan[i].height == requested.height) {
+			// A downrated camera goes back to its new plan when it's no longer static
+			if (plan[i].fps != requested.fps && !cameraDownrated[i]) changeFrameRate[i] = plan[i].fps;
+		}
+		// It fell back to its tile's size, since its modes couldn't be enumerated
+		else if (!supportsSize(i, plan[i].width, plan[i].height)) {
+			cerr << "Camera " << i << " can't switch to its planned " << plan[i].width << "x" << plan[i].height << endl;
+			continue;
+		}
+		// Switched in the background, like the resolution control message does, so it keeps streaming until then
+		else cameraReaders[i]->requestMode(plan[i].width, plan[i].height, cameraDownrated[i] ? staticCameraFps : plan[i].fps);
+		requested = yuyvMode(plan[i].width, plan[i].height, plan[i].fps);
+	}
+	for (unsigned int i = 0; i < added.size(); ++i) attachCamera(added[i], plan[firstAdded + i], modes[firstAdded + i], opened[i], openedIds[i]);
+	// Safe to use after unlocking, since only this thread detaches them
+	for (unsigned int i = 0; i < firstAdded; ++i) cameras.push_back(cameraReaders[i].get());
+	frameLock.unlock();
+	// Now that the capture loop can finish their pushFrame()
+	detached.clear();
+
+	for (unsigned int i = 1; i < firstAdded; ++i) if (changeFrameRate[i] >= 0) cameras[i]->setFrameRate(changeFrameRate[i]);
+	relayout();
+}
 void Streamer::calculateOutputSize(){
 	switch (cameraDevs.size()) {
 	case 1:
-		uncorrectedWidth = cameraReaders[0]->getWidth(); uncorrectedHeight = cameraReaders[0]->getHeight();
+		uncorrectedWidth = requestedModes[0].width; uncorrectedHeight = requestedModes[0].height;
 		break;
 	case 2:
-		uncorrectedWidth = cameraReaders[0]->getWidth() + cameraReaders[1]->getWidth();
-		uncorrectedHeight = std::max(cameraReaders[0]->getHeight(), cameraReaders[1]->getHeight());
+		uncorrectedWidth = requestedModes[0].width + requestedModes[1].width;
+		uncorrectedHeight = std::max(requestedModes[0].height, requestedModes[1].height);
 		break;
 	case 3:
-		uncorrectedWidth = std::max(cameraReaders[0]->getWidth() + cameraReaders[1]->getWidth(), cameraReaders[2]->getWidth());
-		uncorrectedHeight = std::max(cameraReaders[0]->getHeight(), cameraReaders[1]->getHeight()) + cameraReaders[2]->getHeight();
+		uncorrectedWidth = std::max(requestedModes[0].width + requestedModes[1].width, requestedModes[2].width);
+		uncorrectedHeight = std::max(requestedModes[0].height, requestedModes[1].height) + requestedModes[2].height;
 		break;
 	case 4:
-		uncorrectedWidth = std::max(cameraReaders[0]->getWidth() + cameraReaders[1]->getWidth(), cameraReaders[2]->getWidth() + cameraReaders[3]->getWidth());
-		uncorrectedHeight = std::max(cameraReaders[0]->getHeight() + cameraReaders[2]->getHeight(), cameraReaders[1]->getHeight() + cameraReaders[3]->getHeight());
+		uncorrectedWidth = std::max(requestedModes[0].width + requestedModes[1].width, requestedModes[2].width + requestedModes[3].width);
+		uncorrectedHeight = std::max(requestedModes[0].height + requestedModes[2].height, requestedModes[1].height + requestedModes[3].height);
 		break;
 	default:
 		std::cerr << "Over 4 cameras unsupported" << std::endl;
 		exit(1);
 	}
 	
+	// Vision camera goes in the top left, the second camera in the top right, the third in the bottom left, and the fourth in the bottom right.
+	tileRects.resize(cameraDevs.size());
+	for (unsigned int i = 0; i < cameraDevs.size(); ++i) {
+		int width = requestedModes[i].width, height = requestedModes[i].height;
+		tileRects[i] = cv::Rect2i(
+			(i % 2 == 0) ? 0 : uncorrectedWidth - width,
+			(i < 2) ? 0 : uncorrectedHeight - height,
+			width, height);
+	}
+	
 	// The h.264 encoder doesn't like dimensions that aren't multiples of 16, so our output must be sized this way.
 	outputWidth = ceil(uncorrectedWidth/16.0)*16;
 	outputHeight = ceil(uncorrectedHeight/16.0)*16;
 }
 
+// Copies a YUYV frame into out, scaling it (keeping its aspect ratio, with black bars) if it's a different size.
+// This is how a camera that's switched resolution keeps fitting in the layout, and its stream, without restarting anything.
+void fitYUYV(const cv::Mat& in, cv::Mat& out) {
+	if (in.size() == out.size()) {
+		in.copyTo(out);
+		return;
+	}
+	double scale = std::min(out.cols / (double) in.cols, out.rows / (double) in.rows);
+	// Whole pixel pairs only, so every Y0 U Y1 V group stays together
+	int width = std::min(out.cols, (int) round(in.cols * scale / 2) * 2), height = std::min(out.rows, (int) round(in.rows * scale));
+	if (width != out.cols || height != out.rows) out.setTo(cv::Scalar(16, 128));
+	cv::Mat fitted = out(cv::Rect2i(((out.cols - width) / 2) & ~1, (out.rows - height) / 2, width, height));
+	// Treat each pair of pixels as one 4-channel pixel, so luma is only blended with luma, and U with U and V with V
+	cv::Mat inPairs(in.rows, in.cols / 2, CV_8UC4, in.data, in.step);
+	cv::Mat fittedPairs(fitted.rows, fitted.cols / 2, CV_8UC4, fitted.data, fitted.step);
+	cv::resize(inPairs, fittedPairs, fittedPairs.size(), 0, 0, (scale < 1) ? cv::INTER_AREA : cv::INTER_LINEAR);
+}
+
 void colorConvertBGR2YUYV(cv::Mat& in, cv::Mat& out) {
 	// For some reason, opencv can't convert directly to YUYV (aka YUV 4:2:2 or YUY2), so we must convert to YUV (aka YUV 4:4:4) then downsample that.
 	assert(in.type() == CV_8UC3);
@@ -173,11 +389,16 @@ void colorConvertBGR2YUYV(cv::Mat& in, cv::Mat& out) {
 }
 
 void Streamer::setupFramebuffer() {
-	
+	// Let go of the VideoWriter's buffer, if we're pointing into it
+	frameBuffer.release();
+	lastSentBuffer.release();
+	// The tiles are about to be painted over with the background
+	for (auto& detector : changeDetectors) detector.reset();
 	frameBuffer.create(outputHeight, outputWidth, CV_8UC2);
 	frameBuffer.setTo(cv::Scalar{0, 128});
 	
-	cv::Mat source = cv::imread("/home/pi/vision-code/background.jpg");
+	if (backgroundImage.empty()) backgroundImage = cv::imread("/home/pi/vision-code/background.jpg");
+	cv::Mat source = backgroundImage;
 	if (source.cols == 0 || source.rows == 0){
 		std::cerr << "Background image read failed. (Either corrupted or non-existent file)" << std::endl;
 		return;
@@ -235,85 +456,304 @@ bool Streamer::checkFramebufferReadiness(){
 	}
 	return true;
 }
-void Streamer::pushFrame(int i) {
+void Streamer::pushFrame(unsigned int cameraId) {
 	if(!initialized) {
-		std::cerr << "recieved frame from " << i << " but not initialized yet (this theoretically shouldn't happen)" << endl;
+		std::cerr << "recieved frame from " << cameraId << " but not initialized yet (this theoretically shouldn't happen)" << endl;
 		return;
 	}; //We're still setting up.
-	//cout << "Logging: received frame from " << i << endl;
+	//cout << "Logging: received frame from " << cameraId << endl;
 	/* Updates framebuffer section for camera $i
 	** If we are ready to go, write to the videowriter.
 	*/
 	frameLock.lock(); //We don't want this happening concurrently.
+	auto id = std::find(cameraIds.begin(), cameraIds.end(), cameraId);
+	if (id == cameraIds.end()) {
+		// It's being attached or detached
+		frameLock.unlock();
+		return;
+	}
+	int i = id - cameraIds.begin();
+	// Safe to use after unlocking, since detaching waits for the capture loop to be done with it
+	ThreadedVideoReader* camera = cameraReaders[i].get();
 	newFrames[i]=true;
 	++cameraFrameCounts[i];
+	if (i >= (int) tileRects.size()) {
+		// It's just been plugged in, and relayout() hasn't given it a tile yet
+		frameLock.unlock();
+		return;
+	}
+	if (!cameraStreams.empty()) {
+		// Every camera goes straight to its own stream, without waiting on the others
+		try {
+			submitCameraFrame(i);
+		} catch (VideoReader::NotInitializedException& e) {}
+		reportFramerates();
+		++frameCount;
+		frameLock.unlock();
+		return;
+	}
+	// Resetting a camera to change its framerate takes a while, so it's done after unlocking. -1 means no change.
+	double changeFrameRate = -1;
 	try {
-		switch(i){
-			case 0: { //Vision camera
-				
-				cv::Mat visionFrame = frameBuffer.colRange(0, visionCamera->getWidth()).rowRange(0, visionCamera->getHeight());
-				visionCamera->getMat().copyTo(visionFrame);
-
+		cv::Mat tile = frameBuffer(tileRects[i]);
+		cv::Mat frame = camera->getMat();
+		
+		// Static tiles are skipped, and given fewer bits by the in-process encoder
+		bool unchanged = i != 0 && (skipStaticTiles || encodedStream) && !changeDetectors[i].hasChanged(frame);
+		if (encodedStream && i != 0) {
+			bool isStatic = unchanged && changeDetectors[i].getTimeUnchanged() > staticQualityDelay;
+			if (isStatic != tileStatic[i]) {
+				tileStatic[i] = isStatic;
+				updateRegionQuality();
+			}
+		}
+		if (unchanged && skipStaticTiles) {
+			// What's in the framebuffer is close enough. (In streaming mode, emitFrame() carries it over from the last buffer, until every buffer has it.)
+			if (staticCameraFps > 0 && !cameraDownrated[i] && changeDetectors[i].getTimeUnchanged() > staticDownrateDelay) {
+				cameraDownrated[i] = true;
+				changeFrameRate = staticCameraFps;
+			}
+		}
+		else {
+			if (cameraDownrated[i]) {
+				cameraDownrated[i] = false;
+				changeFrameRate = requestedModes[i].fps;
+			}
+			if (i == 0 && annotateFrame != nullptr && frame.size() != tile.size()) {
+				// The overlay is drawn in the camera's coordinates, so it goes on before scaling
+				frame.copyTo(annotatedVisionFrame);
+				annotateFrame(annotatedVisionFrame);
+				fitYUYV(annotatedVisionFrame, tile);
+			}
+			else {
+				fitYUYV(frame, tile);
 				// Draw an overlay on the frame before handing it off to gStreamer
-				if (annotateFrame != nullptr) annotateFrame(visionFrame);
-
-				visionFrameNotifier(); //New vision frame
-				break;
+				if (i == 0 && annotateFrame != nullptr) annotateFrame(tile);
 			}
-			case 1: //Second camera
-				cameraReaders[1]->getMat().copyTo(frameBuffer
-				.colRange(uncorrectedWidth - cameraReaders[1]->getWidth(), uncorrectedWidth)
-				.rowRange(0, cameraReaders[1]->getHeight()));
-				break;
-			case 2: //Third camera
-				cameraReaders[2]->getMat().copyTo(frameBuffer
-				.colRange(0, cameraReaders[2]->getWidth())
-				.rowRange(uncorrectedHeight - cameraReaders[2]->getHeight(), uncorrectedHeight));
-				break;
-			case 3: //Fourth camera (untested)
-				cameraReaders[3]->getMat().copyTo(frameBuffer
-				.colRange(uncorrectedWidth - cameraReaders[3]->getWidth(), uncorrectedWidth)
-				.rowRange(uncorrectedHeight - cameraReaders[3]->getHeight(), uncorrectedHeight));
-				break;
-			default:
-				cerr << "More than four cameras are unsupported at this time." << endl;
-				return;
+			if (i == 0) offerVisionFrame(frame); //Vision camera
+			if (videoWriter.isStreaming()) bufferTileVersion[videoWriter.getBufferIndex()][i] = ++tileVersion[i];
 		}
+		if (snapshotServer) snapshotServer->offerFrame(i + 1, (i == 0) ? tile : frame);
 	} catch (VideoReader::NotInitializedException& e) {
 		frameLock.unlock();
 		return;
 	}
 
-	if(checkFramebufferReadiness()){
-		videoWriter.writeFrame(frameBuffer);
-		
-		auto now = std::chrono::steady_clock().now();
-		auto elapsed = now - lastReport;
-		if (elapsed >= std::chrono::seconds(1)) {
-			cout << "In the past " << std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count()
-			<< " seconds, " << frameCount << " pushed frames: ";
-			for (unsigned int i = 0; i < cameraFrameCounts.size(); ++i) {
-				cout << cameraFrameCounts[i] << " from cam " << i;
-				if (i != cameraFrameCounts.size() - 1) cout << ", ";
-				cameraFrameCounts[i] = 0;
-			}
-			cout << endl;
-			frameCount = 0;
-			lastReport = now;
-		}
-		++frameCount;
+	bool pacing = pacer && pacer->isRunning();
+	// If pacing, the pacer decides when to send the frame
+	if(!pacing && checkFramebufferReadiness()){
+		emitFrame();
+	}
+	frameLock.unlock();
+	if (pacing) pacer->notifyTile();
+	if (changeFrameRate >= 0) camera->setFrameRate(changeFrameRate);
+}
+bool Streamer::anyNewFrames() {
+	for (unsigned int i = 0; i < newFrames.size(); ++i) {
+		if (newFrames[i]) return true;
+	}
+	return false;
+}
+void Streamer::reportFramerates() {
+	auto now = std::chrono::steady_clock().now();
+	auto elapsed = now - lastReport;
+	if (elapsed < std::chrono::seconds(1)) return;
+	
+	cout << "In the past " << std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count()
+	<< " seconds, " << frameCount << " pushed frames: ";
+	for (unsigned int i = 0; i < cameraFrameCounts.size(); ++i) {
+		cout << cameraFrameCounts[i] << " from cam " << i;
+		if (i != cameraFrameCounts.size() - 1) cout << ", ";
+		cameraFrameCounts[i] = 0;
+	}
+	if (pacer && pacer->isRunning()) {
+		FramePacer::Stats stats = pacer->takeStats();
+		cout << "; pacer: " << stats.emitted << " emitted, " << stats.duplicated << " duplicated, " << stats.late << " late";
+		totalPacerDuplicated += stats.duplicated;
+		totalPacerLate += stats.late;
+	}
+	auto printSenderStats = [this](EncodedStream* stream) {
+		RtpSender::Stats stats = stream->takeSenderStats();
+		totalPacketsDropped += stats.dropped;
+		cout << "sent " << stats.packets << " packets (" << stats.bytes * 8 / 1000 << " kbit) in " << stats.sendCalls << " calls, " << stats.dropped << " dropped";
+	};
+	if (encodedStream) {
+		cout << "; ";
+		printSenderStats(encodedStream.get());
+	}
+	for (unsigned int i = 0; i < cameraStreams.size(); ++i) {
+		if (!subscribed[i] || !cameraStreams[i]) continue;
+		cout << "; cam " << i << " ";
+		printSenderStats(cameraStreams[i].get());
+	}
+	cout << endl;
+	frameCount = 0;
+	lastReport = now;
+}
+std::string Streamer::cameraStats(unsigned int i) {
+	std::stringstream stats;
+	stats.precision(3);
+	ThreadedVideoReader* camera = cameraReaders[i].get();
+	stats << "cam" << i << " " << camera->getWidth() << "x" << camera->getHeight()
+	<< " fps=" << 1.0 / camera->getMeanFrameInterval() << " jitter=" << camera->getFrameIntervalJitter() * 1000 << "ms";
+	if (cameraDownrated[i]) stats << " downrated";
+	if (camera->isNewestOnly()) stats << " skipped=" << camera->getSkippedFrames();
+	if (EncodedStream* stream = cameraStream(i)) {
+		stats << " bitrate=" << stream->getConfig().bitrate << " encoderDropped=" << stream->getDroppedFrames();
+		if (!subscribed[i]) stats << " unsubscribed";
+	}
+	else if (!cameraStreams.empty()) stats << " noStream";
+	RecoveryStats recovery = camera->getRecoveryStats();
+	if (recovery.total() > 0) stats << " " << recovery.format();
+	return stats.str();
+}
 
-		for(unsigned int i=0;i<cameraDevs.size();i++){
-			newFrames[i]=false;
+vector<cv::Size2i> Streamer::getVisionCameraSizes() {
+	std::lock_guard<std::mutex> lock(frameLock);
+	vector<cv::Size2i> sizes;
+	if (cameraReaders.empty()) return sizes;
+	sizes.push_back(cv::Size2i(visionCamera->getWidth(), visionCamera->getHeight()));
+	for (auto& mode : supportedModes[0]) {
+		cv::Size2i size(mode.width, mode.height);
+		if (mode.pixelFormat == V4L2_PIX_FMT_YUYV && std::find(sizes.begin(), sizes.end(), size) == sizes.end()) sizes.push_back(size);
+	}
+	return sizes;
+}
+std::string Streamer::getUsbPlan() {
+	std::lock_guard<std::mutex> lock(frameLock);
+	return usbPlanner.getReport();
+}
+std::string Streamer::getStats() {
+	std::lock_guard<std::mutex> lock(frameLock);
+	std::stringstream stats;
+	for (unsigned int i = 0; i < cameraReaders.size(); ++i) stats << cameraStats(i) << "\n";
+
+	stats << "stream ";
+	if (encodedStream) {
+		stats << "encoder=" << encodedStream->getEncoderName() << " " << encodedStream->getConfig().width << "x" << encodedStream->getConfig().height
+		<< " bitrate=" << encodedStream->getConfig().bitrate << " encoderDropped=" << encodedStream->getDroppedFrames();
+	}
+	else if (!cameraStreams.empty()) {
+		// Any camera's stream will do, since they're all created from the same backends
+		EncodedStream* stream = nullptr;
+		for (unsigned int i = 0; i < cameraStreams.size() && !stream; ++i) stream = cameraStreams[i].get();
+		stats << "encoder=" << (stream ? stream->getEncoderName() : "none") << " perCamera bitrate=" << appliedBitrate;
+	}
+	else if (gstreamer_pid != 0) stats << "gstreamer pid=" << gstreamer_pid;
+	else stats << "idle";
+	stats << " packetsDropped=" << totalPacketsDropped;
+	if (pacer && pacer->isRunning()) stats << " pacerLate=" << totalPacerLate << " pacerDuplicated=" << totalPacerDuplicated;
+	stats << "\n";
+	return stats.str();
+}
+
+void Streamer::emitFrame(bool duplicate) {
+	if (videoWriter.isStreaming()) {
+		// This driver buffer last held a frame from a few frames ago, so bring the tiles it's behind on up to date.
+		std::vector<unsigned int>& held = bufferTileVersion[videoWriter.getBufferIndex()];
+		for (unsigned int i = 0; i < tileRects.size(); ++i) {
+			if (held[i] == tileVersion[i]) continue;
+			if (!lastSentBuffer.empty()) lastSentBuffer(tileRects[i]).copyTo(frameBuffer(tileRects[i]));
+			held[i] = tileVersion[i];
 		}
 	}
-	frameLock.unlock();
+	if (encodedStream) encodedStream->submitFrame(frameBuffer);
+	if (snapshotServer) snapshotServer->offerFrame(0, frameBuffer);
+
+	if (videoWriter.isStreaming()) {
+		lastSentBuffer = frameBuffer;
+		videoWriter.queueBuffer();
+		frameBuffer = videoWriter.getBuffer();
+	}
+	// Nothing reads from the loopback device when we're encoding in-process, so don't pay for the copy.
+	else if (!encodedStream) videoWriter.writeFrame(frameBuffer);
+	
+	reportFramerates();
+	++frameCount;
+
+	for(unsigned int i=0;i<cameraDevs.size();i++){
+		newFrames[i]=false;
+	}
 }
 
+void Streamer::openWriter() {
+	videoWriter.openWriter(outputWidth, outputHeight, loopbackDev.c_str(), useStreamingOutput);
+	if (videoWriter.isStreaming()) {
+		// The background never changes, so it only needs to be put in each buffer once.
+		videoWriter.fillBuffers(frameBuffer);
+		frameBuffer = videoWriter.getBuffer();
+		lastSentBuffer.release();
+		resetTileVersions();
+		for (auto& detector : changeDetectors) detector.reset();
+	}
+}
+void Streamer::resetTileVersions() {
+	tileVersion.assign(tileRects.size(), 0);
+	bufferTileVersion.assign(videoWriter.getBufferCount(), tileVersion);
+}
 void Streamer::restartWriter(){
+	// frameBuffer must not point into the buffers that are about to be unmapped
+	if (videoWriter.isStreaming()) frameBuffer = frameBuffer.clone();
+	lastSentBuffer.release();
 	videoWriter.closeWriter();
 	std::cout << "Closed Writer. Reopening..." << std::endl;
-	videoWriter.openWriter(outputWidth, outputHeight, loopbackDev.c_str());
+	openWriter();
+}
+void Streamer::relayout(){
+	std::lock_guard<std::mutex> launching(launchLock);
+	handlingLaunchRequest=true;
+	bool relaunchingGstreamer = gstreamer_pid != 0;
+	if (relaunchingGstreamer) {
+		std::cout << "Killing previous gstreamer instance..." << std::endl;
+		killGstreamerInstance();
+	}
+	frameLock.lock();
+	std::cout << "Calculating modified output width..." << std::endl;
+	calculateOutputSize();
+	std::cout << "Setting up framebuffer..." << std::endl;
+	setupFramebuffer();
+	std::cout << "Restarting Video Writer..." << std::endl;
+	restartWriter(); //Work Please
+	// Taken out to be rebuilt for the new layout without frameLock
+	std::unique_ptr<EncodedStream> encoder = std::move(encodedStream);
+	vector<std::unique_ptr<EncodedStream>> streams = std::move(cameraStreams);
+	cameraStreams.clear();
+	bool relaunchingEncoder = encoder != nullptr;
+	bool relaunchingCameraStreams = !streams.empty();
+	EncoderConfig encoderConfig = outputStreamConfig();
+	vector<EncoderConfig> streamConfigs;
+	if (relaunchingCameraStreams) for (unsigned int i = 0; i < cameraReaders.size(); ++i) streamConfigs.push_back(cameraStreamConfig(i));
+	int width = outputWidth, height = outputHeight;
+	frameLock.unlock();
+
+	if (relaunchingEncoder && !fitsConfig(encoder, encoderConfig) && !createStream(encoder, encoderConfig)) {
+		std::cerr << "Failed to restart in-process encoder" << std::endl;
+	}
+	// Cameras that were plugged in need a stream, and the others only need a new one if they've changed resolution
+	streams.resize(streamConfigs.size());
+	for (unsigned int i = 0; i < streams.size(); ++i) {
+		// The others keep streaming without it, and launchCameraStreams() tries it again
+		if (!fitsConfig(streams[i], streamConfigs[i]) && !createStream(streams[i], streamConfigs[i])) std::cerr << "Failed to restart camera " << i << "'s stream" << std::endl;
+	}
+
+	frameLock.lock();
+	// They're the right size now, so this only points them at the driver station again
+	if (encoder) {
+		encodedStream = std::move(encoder);
+		if (!launchEncodedStream()) std::cerr << "Failed to restart in-process encoder" << std::endl;
+	}
+	if (!streams.empty()) {
+		cameraStreams = std::move(streams);
+		if (!launchCameraStreams()) std::cerr << "Failed to restart the camera streams" << std::endl;
+	}
+	// The tiles may have moved even if the encoder was kept, since it's only recreated when the output size changes
+	updateRegionQuality();
+	frameLock.unlock();
+	if (relaunchingGstreamer) {
+		std::cout << "Restarting new gstreamer stream..." << std::endl;
+		launchGStreamer(width, height, strAddr.c_str(), bitrate, "5809", loopbackDev);
+	}		
+	handlingLaunchRequest=false;
 }
 
 // ---------------- GStreamer stuff -----------------------
@@ -354,6 +794,144 @@ void Streamer::launchGStreamer(int width, int height, const char* recieveAddress
 
 }
 
+bool Streamer::fitsConfig(const std::unique_ptr<EncodedStream>& stream, const EncoderConfig& config) {
+	return stream && stream->getConfig().width == config.width && stream->getConfig().height == config.height;
+}
+
+bool Streamer::createStream(std::unique_ptr<EncodedStream>& stream, const EncoderConfig& config) {
+	stream.reset(); // Only one encoder at a time; the hardware might not support more.
+	stream = EncodedStream::create(encoderBackends, config);
+	if (!stream) return false;
+	stream->setPacing(streamPacing);
+	return true;
+}
+
+EncoderConfig Streamer::outputStreamConfig() {
+	EncoderConfig config;
+	config.width = outputWidth; config.height = outputHeight;
+	config.fps = (outputFps > 0) ? outputFps : 30;
+	config.bitrate = bitrate;
+	return config;
+}
+
+EncoderConfig Streamer::cameraStreamConfig(unsigned int i) {
+	EncoderConfig config;
+	config.width = requestedModes[i].width; config.height = requestedModes[i].height;
+	// Cameras slow themselves down for exposure, so use whatever they're running at now
+	int cameraFps = (int) round(1.0 / cameraReaders[i]->getMeanFrameInterval());
+	config.fps = (cameraFps >= 5) ? cameraFps : 30;
+	config.bitrate = bitrate / cameraReaders.size();
+	return config;
+}
+
+bool Streamer::launchEncodedStream() {
+	cameraStreams.clear();
+	EncoderConfig config = outputStreamConfig();
+	if (!fitsConfig(encodedStream, config)) {
+		if (!createStream(encodedStream, config)) {
+			std::cerr << "No in-process encoder available" << std::endl;
+			return false;
+		}
+		if (!updateRegionQuality()) std::cout << encodedStream->getEncoderName() << " encoder doesn't support per-region quality" << std::endl;
+	}
+	else encodedStream->setBitrate(bitrate);
+	appliedBitrate = bitrate;
+
+	rateController.reset(bitrate);
+	if (!encodedStream->setDestination(strAddr, "5809")) {
+		encodedStream.reset();
+		return false;
+	}
+	// The receiver just (re)started, so it needs SPS/PPS and a keyframe to start decoding
+	encodedStream->requestKeyframe();
+	return true;
+}
+
+bool Streamer::launchCameraStreams() {
+	encodedStream.reset();
+	cameraStreams.resize(cameraReaders.size());
+	bool anyStreams = false;
+	for (unsigned int i = 0; i < cameraReaders.size(); ++i) {
+		EncoderConfig config = cameraStreamConfig(i);
+		// A camera that can't have a stream is left without one, and the others stream anyway
+		if (!fitsConfig(cameraStreams[i], config) && !createStream(cameraStreams[i], config)) {
+			std::cerr << "No in-process encoder available for camera " << i << std::endl;
+			continue;
+		}
+		// Cameras move down when one before them is unplugged
+		cameraStreams[i]->setSsrc(CAMERA_SSRC_BASE + i);
+		if (!cameraStreams[i]->setDestination(strAddr, "5809")) {
+			cameraStreams[i].reset();
+			continue;
+		}
+		cameraStreams[i]->requestKeyframe();
+		anyStreams = true;
+	}
+	if (!anyStreams) {
+		cameraStreams.clear();
+		return false;
+	}
+	rateController.reset(bitrate);
+	applyBitrate(bitrate);
+	return true;
+}
+
+EncodedStream* Streamer::cameraStream(unsigned int i) {
+	// A camera that's just been plugged in has no stream until relayout() makes one
+	return (i < cameraStreams.size()) ? cameraStreams[i].get() : nullptr;
+}
+
+void Streamer::submitCameraFrame(int i) {
+	cv::Mat frame = cameraReaders[i]->getMat();
+	if (i == 0) { //Vision camera
+		offerVisionFrame(frame);
+		if (annotateFrame != nullptr) {
+			frame.copyTo(annotatedVisionFrame);
+			annotateFrame(annotatedVisionFrame);
+			frame = annotatedVisionFrame;
+		}
+	}
+	EncodedStream* stream = cameraStream(i);
+	if (subscribed[i] && stream) {
+		const EncoderConfig& config = stream->getConfig();
+		if (frame.cols != config.width || frame.rows != config.height) {
+			// It's switched resolution, and the stream keeps the one it started with
+			scaledCameraFrame.create(config.height, config.width, CV_8UC2);
+			fitYUYV(frame, scaledCameraFrame);
+			stream->submitFrame(scaledCameraFrame);
+		}
+		else stream->submitFrame(frame);
+	}
+	if (snapshotServer) snapshotServer->offerFrame(i + 1, frame);
+}
+
+void Streamer::applyBitrate(int bitrate) {
+	appliedBitrate = bitrate;
+	if (encodedStream) {
+		encodedStream->setBitrate(bitrate);
+		return;
+	}
+	unsigned int otherCameras = 0;
+	for (unsigned int i = 1; i < cameraStreams.size(); ++i) if (subscribed[i] && cameraStreams[i]) ++otherCameras;
+	// If the vision camera is the only one (or isn't subscribed), it doesn't need to share.
+	double visionShare = (otherCameras == 0) ? 1 : ((subscribed[0] && cameraStreams[0]) ? visionBitrateShare : 0);
+	for (unsigned int i = 0; i < cameraStreams.size(); ++i) {
+		if (!subscribed[i] || !cameraStreams[i]) continue;
+		double share = (i == 0) ? visionShare : (1 - visionShare) / otherCameras;
+		cameraStreams[i]->setBitrate(std::max(1, (int) (bitrate * share)));
+	}
+}
+
+bool Streamer::updateRegionQuality() {
+	if (!encodedStream) return false;
+	std::vector<RegionQuality> regions;
+	for (unsigned int i = 0; i < tileRects.size(); ++i) {
+		float qpOffset = (i == 0) ? visionTileQpOffset : (i < tileStatic.size() && tileStatic[i]) ? staticTileQpOffset : secondaryTileQpOffset;
+		regions.push_back({ tileRects[i], qpOffset });
+	}
+	return encodedStream->setRegionQuality(regions, backgroundQpOffset);
+}
+
 void Streamer::dsListener() {
 	//Threaded listener
 	servFd = socket(AF_INET6, SOCK_STREAM, 0);
@@ -395,6 +973,7 @@ void Streamer::dsListener() {
 
 		// At this point, a connection has been recieved from the driver station.
 		// gStreamer will now be set up to stream to the driver station.
+		launchLock.lock();
 		handlingLaunchRequest = true;
 		killGstreamerInstance();
  
@@ -418,12 +997,21 @@ void Streamer::dsListener() {
 		sleep(1);
 
 		char strAddr[INET6_ADDRSTRLEN];
-		this->strAddr=strAddr;
 		getnameinfo((struct sockaddr *) &clientAddr, sizeof(clientAddr), strAddr,sizeof(strAddr),
 		0,0,NI_NUMERICHOST);
+		this->strAddr=strAddr;
 
-		launchGStreamer(outputWidth, outputHeight, strAddr, bitrate, "5809", loopbackDev);
+		// The composite isn't used in PerCamera mode. (The pacer must be stopped without frameLock held, since it takes frameLock.)
+		bool perCamera = outputMode == OutputMode::PerCamera;
+		if (perCamera && pacer) pacer->stop();
+		frameLock.lock();
+		perCamera = perCamera && launchCameraStreams();
+		bool encodingInProcess = perCamera || launchEncodedStream();
+		frameLock.unlock();
+		if (!perCamera && pacer && !pacer->isRunning() && outputFps > 0) pacer->start(outputFps, lateTileWait);
+		if (!encodingInProcess) launchGStreamer(outputWidth, outputHeight, strAddr, bitrate, "5809", loopbackDev);
 		handlingLaunchRequest = false;
+		launchLock.unlock();
 	}
 }
 
@@ -564,49 +1152,90 @@ string Streamer::parseControlMessage(string command, string arguments){
 	return status.str(); //Delightful.
 
 }
+string Streamer::handleReceiverReport(string arguments) {
+	std::stringstream toParse(arguments);
+	double lossPercent, jitterMs;
+	toParse >> lossPercent >> jitterMs;
+	if (toParse.fail() || lossPercent < 0 || jitterMs < 0) return "UNPARSABLE MESSAGE (Expected <loss percent> <jitter ms>)\n";
+
+	std::lock_guard<std::mutex> lock(frameLock);
+	if (!encodedStream && cameraStreams.empty()) return "-1:Not encoding in-process\n";
+
+	int oldBitrate = appliedBitrate;
+	int newBitrate = rateController.onReport(lossPercent / 100, jitterMs);
+	// Small changes aren't worth reconfiguring the encoder for
+	if (abs(newBitrate - oldBitrate) > oldBitrate / 32) {
+		cout << "Receiver reports " << lossPercent << "% loss, " << jitterMs << " ms jitter. Bitrate " << oldBitrate << " -> " << newBitrate << endl;
+		applyBitrate(newBitrate);
+	}
+	return "Bitrate " + std::to_string(appliedBitrate) + "\n";
+}
+
 string Streamer::controlMessage(unsigned int cam_no, string command, string parameters){
 	
 	std::stringstream status=std::stringstream("");
-	ThreadedVideoReader* camera = cameraReaders.at(cam_no).get();
+	std::shared_ptr<ThreadedVideoReader> camera;
+	{
+		std::lock_guard<std::mutex> lock(frameLock);
+		// It might have been unplugged since parseControlMessage() checked
+		if (cam_no >= cameraReaders.size()) return "-1:INVALID CAMERA NO";
+		camera = cameraReaders[cam_no];
+	}
 
 	//Resolution command
 	if(command=="resolution"){
-		frameLock.lock(); //Spooky bad times here.
-
 		std::stringstream toParse=std::stringstream(parameters);
 		unsigned int width,height;
 		toParse >> width;
 		toParse >> height;
 		if(toParse.fail()){
-			frameLock.unlock(); //Goddarn me.
 			return "-1:INVALID RESOLUTION (Not unsigned int)";
 		}
-		int retval = camera->setResolution(width,height);
-		status << retval << ":" << ((retval==0) ? "SUCCESS" : "FAILURE");
-		if(retval==0){
-			handlingLaunchRequest=true;
-			bool relaunchingGstreamer = gstreamer_pid != 0;
-			if (relaunchingGstreamer) {
-				std::cout << "Killing previous gstreamer instance..." << std::endl;
-				killGstreamerInstance();
+		std::lock_guard<std::mutex> lock(frameLock);
+		if (cam_no >= cameraReaders.size() || cameraReaders[cam_no] != camera) return "-1:INVALID CAMERA NO";
+		// The framerate is optional, and stays what it was asked for last if it's left out
+		double fps;
+		if (!(toParse >> fps)) fps = requestedModes[cam_no].fps;
+		// The camera switches in the background, and its frames are scaled into its tile (and stream), so the layout and encoder carry on as they are
+		if (!supportsSize(cam_no, width, height)) return "1:FAILURE (Unsupported resolution)";
+		camera->requestMode(width, height, fps);
+		requestedModes[cam_no] = yuyvMode(width, height, fps);
+		// Re-planning after a camera's plugged in or unplugged keeps it
+		modePicked[cam_no] = true;
+		status << "0:SUCCESS";
+		double mbps = 0;
+		for (auto& mode : requestedModes) mbps += std::max(0.0, mode.mbps);
+		if (mbps > usbPlanner.budgetMbps) status << " (Over the USB budget: " << mbps << " of " << usbPlanner.budgetMbps << " Mbps)";
+	}else if(command == "subscribe" || command == "unsubscribe"){
+		std::lock_guard<std::mutex> lock(frameLock);
+		bool subscribing = command == "subscribe";
+		if (subscribed[cam_no] != subscribing) {
+			subscribed[cam_no] = subscribing;
+			if (!cameraStreams.empty()) {
+				// The driver station's decoder needs a keyframe to start with
+				if (subscribing && cameraStream(cam_no)) cameraStream(cam_no)->requestKeyframe();
+				applyBitrate(appliedBitrate);
 			}
-			std::cout << "Calculating modified output width..." << std::endl;
-			calculateOutputSize();
-			std::cout << "Setting up framebuffer..." << std::endl;
-			setupFramebuffer();
-			std::cout << "Restarting Video Writer..." << std::endl;
-			restartWriter(); //Work Please
-			if (relaunchingGstreamer) {
-				std::cout << "Restarting new gstreamer stream..." << std::endl;
-				launchGStreamer(outputWidth, outputHeight, strAddr.c_str(), bitrate, "5809", loopbackDev);
-			}		
-			handlingLaunchRequest=false;
 		}
-		frameLock.unlock();
+		if (cameraStreams.empty()) return "0:SUBSCRIPTION SAVED (Not streaming each camera seperately right now)";
+		return subscribing ? "0:SUBSCRIBED" : "0:UNSUBSCRIBED";
+	}else if(command == "stats"){
+		std::lock_guard<std::mutex> lock(frameLock);
+		return "0:" + cameraStats(cam_no);
 	}else if(command == "reset"){
 		std::cout << "Attempting to reset " << cam_no << "(COMMAND given)" << std::endl;
 		camera->reset(true);
 		return "0:RESET";
+	}else if(command == "fault"){
+		// Makes the camera's streaming ioctls fail, to see how recovery copes. The stats command shows which stage fixed it.
+		unsigned int stages = 1;
+		if (!parameters.empty()) {
+			std::stringstream toParse=std::stringstream(parameters);
+			toParse >> stages;
+			if (toParse.fail() || stages > RecoveryStats::STAGES) return "-1:INVALID STAGE COUNT (0 to " + std::to_string(RecoveryStats::STAGES) + ")";
+		}
+		camera->injectFault(stages);
+		return "0:FAILING FOR " + std::to_string(stages) + " STAGES";
 	}
 	else{
 		status << "-1:Unrecognized command \"" << command << "\"\n";
@@ -639,40 +1268,6 @@ pid_t runCommandAsync(const std::string& cmd) {
 	else return pid;
 }
 
-// The next three functions are for getting video devices based on various parameters.
-vector<string> getOutputsFromCommand(const char * cmd) {
-
-	FILE* cmdStream = popen(cmd, "r");
-
-	vector<string> names;
-	char output[1035];
-	
-	while (fgets(output, sizeof(output), cmdStream) != NULL) {
-		// videoX
-		if (strlen(output) >= 6) {
-			names.push_back(output);
-			// remove newlines
-			names.back().erase(std::remove(names.back().begin(), names.back().end(), '\n'), names.back().end());
-		}
-	}
-	pclose(cmdStream);
-	return names;
-}
-// Finds a video device whose name contains cmp
-vector<string> getVideoDevicesWithString(string cmp) {
-
-	return getOutputsFromCommand(("for I in /dev/v4l/by-id/*; do if basename $I | grep -Fq '" 
-	+ cmp + "' && basename $I | grep -Fq index0; then realpath $I; fi; done").c_str());
-}
-vector<string> getLoopbackDevices() {
-	vector<string> devnames = getOutputsFromCommand("for I in /sys/class/video4linux/*; do if grep -q Dummy $I/name; then basename $I; fi; done");
-	
-	for (auto i = devnames.begin(); i < devnames.end(); ++i) {
-		*i = "/dev/" + *i;
-	}
-	return devnames;
-}
-
 // Forwards everything in fromFd to toFd, with prefix before every line
 void interceptFile(int fromFd, int toFd, string prefix) {
 	std::thread([=]() {
@@ -9,6 +9,14 @@
 
 #include "DataComm.hpp"
 #include "VideoHandler.hpp"
+#include "CaptureLoop.hpp"
+#include "FramePacer.hpp"
+#include "EncodedStream.hpp"
+#include "RateController.hpp"
+#include "ChangeDetector.hpp"
+#include "SnapshotServer.hpp"
+#include "CameraDiscovery.hpp"
+#include "BandwidthPlanner.hpp"
 #include <string>
 
 // Broadly split into two parts: managing the different cameras, and managing the gStreamer instance.
@@ -23,7 +31,8 @@ public:
 	
 	// Camera stuff:
 public:
-	// Gets a video frame which is converted to the blue-green-red format usually used by opencv
+	// Gets a video frame which is converted to the blue-green-red format usually used by opencv. Empty before the vision camera's first frame.
+	// It's a copy pushFrame() made, since the camera's own buffer can be unmapped or change size while it's switching or recovering.
 	cv::Mat getBGRFrame();
 
 	// visionFrameNotifier is called every new frame from the vision camera.
@@ -36,41 +45,169 @@ public:
 	std::string visionCameraName;
 	int getVisionCameraWidth() { return visionCamera->getWidth(); }
 	int getVisionCameraHeight() { return visionCamera->getHeight(); }
+	// Every size the vision camera could be switched to, for building its calibrations ahead of time. Empty before start().
+	std::vector<cv::Size2i> getVisionCameraSizes();
 	
 	bool lowExposure = false;
 	void setLowExposure(bool value);
+
+	// Where start() looks for cameras and the v4l2loopback device
+	CameraDiscovery cameraDiscovery;
+	static constexpr unsigned int MAX_CAMERAS = 4;
+	// Picks each camera's resolution and framerate (up to its tile in the layout, and maxCameraFps) to fit usbPlanner.budgetMbps.
+	// The cameras are planned again whenever one is plugged in or unplugged.
+	BandwidthPlanner usbPlanner;
+	double maxCameraFps = 30;
+	// If true, cameras plugged in after start() are attached, unplugged ones are detached, and the layout is re-planned for the new count.
+	// The vision camera is never detached (its reader keeps trying to reopen it), and keeps its resolution, since vision's calibration is scaled for it.
+	bool hotplug = true;
+
+	// The framebuffer is sent to the VideoWriter at this fixed rate, using the newest tile from each camera.
+	// If 0, it is sent whenever checkFramebufferReadiness() says so instead, which jitters with the cameras' phase.
+	double outputFps = 30;
+	// How long after a pacer tick to wait for a late tile from a synchronization camera before sending the frame anyway.
+	std::chrono::milliseconds lateTileWait = std::chrono::milliseconds(10);
+	// If true, the cameras are composited directly into mmap'd v4l2loopback buffers instead of being write()n, saving a copy of every frame.
+	bool useStreamingOutput = true;
+	// Encoder backends to try, in order, for encoding and sending the stream in-process. "omx" is for a hardware encoder to register itself as.
+	// If none of them are available, gst-launch is used instead.
+	std::vector<std::string> encoderBackends = { "omx", "x264" };
+	// Frames bigger than a burst of packets are spread over this fraction of the frame interval, so keyframes don't overflow the radio's queue. 0 sends every frame at once.
+	double streamPacing = 0.5;
+	// Quantizer offsets for the in-process encoder. Negative is more bits, and every 6 doubles or halves them.
+	// The vision camera's tile is what the driver aims with, so it gets the most.
+	float visionTileQpOffset = -3, secondaryTileQpOffset = 2, backgroundQpOffset = 6;
+	// A secondary tile that's been static (see ChangeDetector) for staticQualityDelay gets this instead, until it changes again.
+	float staticTileQpOffset = 10;
+	std::chrono::milliseconds staticQualityDelay = std::chrono::milliseconds(1000);
+	
+	/* Composite tiles every camera into one framebuffer, which is encoded as one stream.
+	** PerCamera gives every camera its own encoder and RTP stream at its own resolution and framerate, so a slow camera doesn't hold back the others.
+	** The streams all go to port 5809, and are told apart by SSRC (CAMERA_SSRC_BASE + camera number). The driver station needs a branch per SSRC
+	**  to show more than one of them: start_streaming.sh builds those when CAMERAS is set.
+	** The driver station picks which ones it wants with the subscribe and unsubscribe control messages, which start_streaming.sh sends for CAMERAS.
+	** PerCamera needs an in-process encoder; without one, Composite is used.
+	*/
+	enum class OutputMode { Composite, PerCamera };
+	OutputMode outputMode = OutputMode::Composite;
+	static constexpr uint32_t CAMERA_SSRC_BASE = 0x57080000;
+	// In PerCamera mode, the vision camera's share of the bitrate. The rest is split evenly between the other subscribed cameras.
+	double visionBitrateShare = 0.5;
+
+	// HTTP port for JPEG snapshots and MJPEG of the composite and each camera (see SnapshotServer). 0 turns it off.
+	short snapshotPort = 5800;
+	int snapshotQuality = 70;
+	double snapshotMaxFps = 10;
+
+	// If true, a secondary camera's tile isn't recopied when its view hasn't changed
+	bool skipStaticTiles = true;
+	// If nonzero, a secondary camera that's been static for staticDownrateDelay has its framerate lowered to this, saving USB bandwidth.
+	double staticCameraFps = 0;
+	std::chrono::seconds staticDownrateDelay = std::chrono::seconds(3);
 	
 private:
 	// All the camera streams go into this buffer, then it's pushed to the VideoWriter
+	// If the VideoWriter is streaming, this points into its current driver buffer.
 	cv::Mat frameBuffer;
+	// Where each camera goes in the framebuffer. Calculated by calculateOutputSize()
+	std::vector<cv::Rect2i> tileRects;
+	// Streaming mode only. Each tile's content counts up every time it's drawn, and each driver buffer remembers which count of every tile it holds.
+	// Tiles a buffer is behind on are copied from the buffer that was sent last before it's sent, so a static tile stops costing copies
+	//  once every buffer has caught up with it.
+	std::vector<unsigned int> tileVersion;
+	std::vector<std::vector<unsigned int>> bufferTileVersion;
+	cv::Mat lastSentBuffer;
+	// Every buffer holds the same thing, e.g. after fillBuffers()
+	void resetTileVersions();
 	
 	void setupCameras(); // Initializes the VideoReaders. (Only called once)
-	void calculateOutputSize(); //Calculates and updates values of uncorrectedWidth, uncorrectedHeight
+	// Opens a camera, with its frames going to pushFrame() as id. They're ignored until it's attached with that id, so this doesn't need frameLock.
+	// position is where it'll be attached, which decides its buffering (0 is the vision camera).
+	std::shared_ptr<ThreadedVideoReader> openCamera(const CameraDiscovery::Camera& camera, const CameraMode& mode, unsigned int id, unsigned int position);
+	// Adds an opened camera and its place in every per-camera vector. frameLock must be held, once initialized.
+	void attachCamera(const CameraDiscovery::Camera& camera, const CameraMode& mode, const std::vector<CameraMode>& modes,
+		std::shared_ptr<ThreadedVideoReader> reader, unsigned int id);
+	// Plans a mode for each of devices (the vision camera first) with planner, given what each supports. Cameras with keep set are given current's mode instead,
+	//  and the rest are fitted around them. keep and current can be shorter than devices, for cameras being plugged in.
+	// Only reads its arguments, so it doesn't need frameLock if planner is a copy.
+	std::vector<CameraMode> planCameraModes(BandwidthPlanner& planner, const std::vector<std::string>& devices,
+		const std::vector<std::vector<CameraMode>>& modes, const std::vector<bool>& keep, const std::vector<CameraMode>& current);
+	// Removes camera i from every per-camera vector. frameLock must be held.
+	// Returns its VideoReader, which must be destroyed after unlocking, since the capture loop might be waiting for frameLock in its pushFrame().
+	std::shared_ptr<ThreadedVideoReader> detachCamera(unsigned int i);
+	// Called by cameraHotplug with the cameras that are plugged in now
+	void camerasChanged(const std::vector<CameraDiscovery::Camera>& found);
+	// Null unless hotplug is set
+	std::unique_ptr<CameraHotplug> cameraHotplug;
+	void calculateOutputSize(); //Calculates and updates values of uncorrectedWidth, uncorrectedHeight and tileRects
 	// Sizes the framebuffer and sets the background.
 	void setupFramebuffer();
+	// background.jpg, read the first time it's needed, so relayout() doesn't read the disk with frameLock held
+	cv::Mat backgroundImage;
 
 	// outputWidth/Height are the size of the framebuffer which is outputted to VideoWriter. uncorrectedWidth/Height is what outputWidth/Height *would* be if the H.264 encoder on the raspberry pi was less buggy.
 	int uncorrectedWidth, uncorrectedHeight, outputWidth, outputHeight;
 	// False until setupCameras() is called
 	bool initialized=false;
 	
-	// Camera device file paths (e.g. /dev/video1)
+	// Camera device file paths (e.g. /dev/video1), and which of cameraNames each is
 	std::vector<std::string> cameraDevs;
+	std::vector<std::string> cameraModels;
 	std::string loopbackDev;
+	// What each camera supports, from BandwidthPlanner::enumerateModes()
+	std::vector<std::vector<CameraMode>> supportedModes;
+	// Whether camera i enumerated a YUYV mode of that size. frameLock must be held.
+	bool supportsSize(unsigned int i, unsigned int width, unsigned int height);
+	// The mode each camera was last asked for, by planning or the resolution control message. A camera switches in the background,
+	//  so it's what the layout is made for, even before the camera's caught up. Its fps is what a downrated camera goes back to (0 is as fast as possible).
+	std::vector<CameraMode> requestedModes;
+	// Whether the resolution control message picked the camera's mode, in which case planning keeps it, like the vision camera's
+	std::vector<bool> modePicked;
 	
-	std::vector<std::unique_ptr<ThreadedVideoReader>> cameraReaders;
+	// Waits for every camera's frames. (Declared before cameraReaders, since they use it until they're destroyed.)
+	CaptureLoop captureLoop;
+	// Shared so a control message can keep using a camera that's unplugged while it runs
+	std::vector<std::shared_ptr<ThreadedVideoReader>> cameraReaders;
+	// Cameras move down when one before them is unplugged, so their callbacks find them by id rather than position
+	std::vector<unsigned int> cameraIds;
+	unsigned int nextCameraId = 0;
 	// Always cameraReaders[0]
 	ThreadedVideoReader* visionCamera;
+	// The vision camera's latest frame, for getBGRFrame()
+	cv::Mat visionFrame;
+	std::mutex visionFrameLock;
+	// Copies the vision camera's frame into visionFrame and tells the vision thread. Only safe from pushFrame(), on the capture loop,
+	//  which the camera waits for before it unmaps its buffers.
+	void offerVisionFrame(const cv::Mat& frame);
 	
 	
 	VideoWriter videoWriter;
-	void pushFrame(int i);
+	void pushFrame(unsigned int cameraId);
 	// Checks if we are read to write the framebuffer. It first creates a list of "synchronization cameras", which are running at the highest framerate of all the cameras (cameras sometimes reduce their framerate in order to increase exposure times) and are not "dead". A camera is considered "dead" if it's running significantly below 15 fps or a frame has not been recieved since 1.5*<average frame interval> ago. If a frame has been recieved from all of them, return true.
 	bool checkFramebufferReadiness(); 
 	// required in order to read from the public flags of ThreadedVideoReader
 	std::mutex frameLock; 
+	// Prints the framerates and stream stats, once a second.
+	void reportFramerates();
+	// Totals of what reportFramerates() has printed, for getStats()
+	unsigned long totalPacerLate = 0, totalPacerDuplicated = 0, totalPacketsDropped = 0;
+	// One line of getStats(), for one camera. frameLock must be held.
+	std::string cameraStats(unsigned int i);
 	// Indicates whether a frame has been recieved from each camera since the last frame was outputted to the VideoWriter.
 	std::vector<bool> newFrames;
+	bool anyNewFrames();
+	// One for each camera (the vision camera's is unused)
+	std::vector<ChangeDetector> changeDetectors;
+	// Whether each camera's framerate has been lowered because it's static
+	std::vector<bool> cameraDownrated;
+	// Whether each camera's tile has staticTileQpOffset, with the in-process encoder
+	std::vector<bool> tileStatic;
+	// Writes the framebuffer to the VideoWriter and prints framerates once a second. frameLock must be held.
+	void emitFrame(bool duplicate = false);
+	// Sends frames at outputFps if it's nonzero. (Otherwise it's never started.)
+	std::unique_ptr<FramePacer> pacer;
+	// Null if snapshotPort is 0
+	std::unique_ptr<SnapshotServer> snapshotServer;
 
 	// Time since framerate was printed to the console
 	std::chrono::steady_clock::time_point lastReport = std::chrono::steady_clock().now();
@@ -79,8 +216,16 @@ private:
 	// Counts the number of frames pushed to the VideoWriter since the last time framerate was printed
 	std::vector<int> cameraFrameCounts;
 	
+	// Opens VideoWriter, and if it's streaming, points frameBuffer at it
+	void openWriter();
 	// Restarts VideoWriter, maybe with a different resolution.
 	void restartWriter();
+	/* Recalculates the layout and restarts everything that depends on it, after a camera changes resolution or is plugged in or unplugged.
+	** Must be called without frameLock. It only takes it to swap in the new layout and VideoWriter, and then the rebuilt encoders,
+	**  since stopping gStreamer and building encoders are slow, and every camera's pushFrame() would wait on them.
+	** In between, frames only go to the VideoWriter.
+	*/
+	void relayout();
 	
 	
 //------------------------------------------------------------------------------------------
@@ -93,12 +238,52 @@ private:
 	std::string gstreamer_command; //Do we actually need/want this to be saved?
 	
 	volatile bool handlingLaunchRequest = false;
+	// Held by dsListener() and relayout() while they (re)launch the streams, so they don't build encoders at the same time. Taken before frameLock.
+	std::mutex launchLock;
 	// The thread that listens for the signal from the driver station
 	void dsListener();
 	// File descriptor used by dsListener
 	int servFd, clientFd;
 	
 	void launchGStreamer(int width, int height, const char* recieveAddress, int bitrate, std::string port, std::string file);
+
+	// In-process replacement for gStreamer. Frames go straight from emitFrame() to the encoder, and it's only ever null if no encoder backend works.
+	std::unique_ptr<EncodedStream> encodedStream;
+	// Whether stream was made for config's size. Encoders can't change size, so otherwise it has to be created again.
+	static bool fitsConfig(const std::unique_ptr<EncodedStream>& stream, const EncoderConfig& config);
+	// Replaces stream with a new encoder for config. Returns false if no encoder is available.
+	// Doesn't need frameLock, as long as stream isn't one the capture loop can reach.
+	bool createStream(std::unique_ptr<EncodedStream>& stream, const EncoderConfig& config);
+	// What encodedStream should be for the current layout, and what camera i's stream should be. frameLock must be held.
+	EncoderConfig outputStreamConfig();
+	EncoderConfig cameraStreamConfig(unsigned int i);
+	// (Re)creates encodedStream if the output size changed, and points it at strAddr with the current bitrate. frameLock must be held.
+	// Returns false if no encoder is available, in which case gStreamer should be launched instead.
+	bool launchEncodedStream();
+	// One stream per camera in PerCamera mode, otherwise empty. A camera whose stream couldn't be created has nullptr, and
+	//  one that's just been plugged in may be past the end until relayout() runs, so look them up with cameraStream().
+	std::vector<std::unique_ptr<EncodedStream>> cameraStreams;
+	// Camera i's stream, or nullptr if it hasn't got one. frameLock must be held.
+	EncodedStream* cameraStream(unsigned int i);
+	// Whether the driver station wants each camera's stream. All are subscribed to by default.
+	std::vector<bool> subscribed;
+	// The vision camera's frame with the overlay drawn on it. (The overlay can't be drawn on the camera's buffer, since vision is reading it)
+	cv::Mat annotatedVisionFrame;
+	// A camera's frame, scaled to its stream's size after it's switched resolution
+	cv::Mat scaledCameraFrame;
+	// Creates cameraStreams (or recreates the ones whose camera changed resolution). frameLock must be held.
+	// Returns false if no camera could have a stream.
+	bool launchCameraStreams();
+	// Sends a camera's frame to its stream, in PerCamera mode. frameLock must be held.
+	void submitCameraFrame(int i);
+	// Sets the in-process encoder's bitrate, or splits it between the camera streams. frameLock must be held.
+	void applyBitrate(int bitrate);
+	int appliedBitrate = 0;
+
+	// Gives encodedStream the quality for each tile in tileRects. Returns false if its encoder doesn't support it.
+	bool updateRegionQuality();
+	// Adapts encodedStream's bitrate to the receiver's reports, capped at the bitrate from the driver station.
+	RateController rateController;
 	void killGstreamerInstance();// Kill the previous instance of gsteamer, that we may start anew.
 
 	// Stuff for persisting the gstreamer instance if the program crashes.
@@ -123,9 +308,26 @@ public:
 	**  UNPARSABLE MESSAGE
 	** RETNO is 0 upon success, something else upon failure (detrmined by videoHandler functions). The STATUS MESSAGE *SHOULD* return more information.
 	
-	Available control messages are: reset, resolution <width> <height>
+	Available control messages are: reset, resolution <width> <height> [fps], subscribe, unsubscribe, stats,
+	**  fault [stages] (makes the camera's QBUF, DQBUF and STREAMON fail with EIO until that many recovery stages have been tried; 1 by default)
 	*/
 	std::string parseControlMessage(std::string command, std::string arguments); 
+	
+	/* Receiver report, sent periodically by the driver station (or rtpstat) over the control channel:
+	** streamReport:<percent of packets lost> <interarrival jitter in ms>
+	** Adjusts the in-process encoder's bitrate on the fly. Returns "Bitrate <new bitrate>".
+	*/
+	std::string handleReceiverReport(std::string arguments);
+
+	/* A line for each camera (resolution, fps, frame interval jitter, and its stream if streaming per camera),
+	** then one for the stream (encoder or gStreamer state, and frames and packets dropped since startup), e.g.:
+	** cam0 1280x720 fps=30 jitter=1.2ms skipped=12 (skipped only for cameras which only take the newest frame)
+	** A camera that has stalled also has its RecoveryStats::format(), i.e. which recovery stage fixed it how often, and how long it took.
+	** stream encoder=x264 1280x720 bitrate=1000000 encoderDropped=3 packetsDropped=0 pacerLate=12 pacerDuplicated=40
+	*/
+	std::string getStats();
+	// usbPlanner's report on the current cameras
+	std::string getUsbPlan();
 private:
 	std::string controlMessage(unsigned int camera, std::string command, std::string parameters);
 };
@@ -137,5 +339,3 @@ pid_t runCommandAsync(const std::string& cmd);
 void interceptStdio(int toFd, std::string prefix);
 void interceptFile(int fromFd, int toFd, std::string prefix);
 
-std::vector<std::string> getVideoDevicesWithString(std::string cmp);
-std::vector<std::string> getLoopbackDevices();
@@ -0,0 +1,391 @@
+/* Recovery ladder test
+** Runs a ThreadedVideoReader against a fake camera, and breaks the camera in ways that only one stage of the ladder fixes,
+**  to check that every stage before it is tried, that each waits its STAGE_TIMEOUT_MS for a frame, and that RecoveryStats counts it.
+** Then it does the same through injectFault(), the fault control message's path.
+**
+** The fake camera is a set of replacements for open(), close(), ioctl(), mmap(), munmap() and realpath(), which only act on its device file
+**  (and the USB device sysfs says it's on), and pass everything else through to libc. They work because VideoHandler.o is linked into
+**  this executable, whose definitions win over libc's. Its frames come every 10 ms, through an eventfd, so CaptureLoop can epoll it like a camera.
+**
+** "make test" in src builds and runs it. No camera is needed. Exits with 1 if anything failed.
+*/
+
+#include "../VideoHandler.hpp"
+#include "../CaptureLoop.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include <cstring>
+#include <cstdarg>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <linux/usbdevice_fs.h>
+
+using std::chrono::milliseconds;
+using Clock = std::chrono::steady_clock;
+
+// ---------------- Fake camera -----------------------
+
+// How the test breaks the camera. Each one is fixed by one stage of the ladder, in order.
+enum class Fault { None, LostBuffers, StuckUntilRestart, StuckUntilReopen, StuckUntilUsbReset };
+// What the ladder did to the camera, to tell when each stage started
+enum class Event { Requeue, StreamOff, Close, UsbReset };
+
+struct FakeCamera {
+	std::mutex lock;
+	std::string devicePath, usbInterfacePath;
+	int fd = -1; // An eventfd, which is readable while there are frames to dequeue
+	int usbFd = -1;
+	unsigned int width = 0, height = 0;
+	bool streaming = false;
+	enum class BufferState { Dequeued, Queued, Done };
+	std::vector<std::vector<uint8_t>> buffers;
+	std::vector<BufferState> states;
+	std::deque<unsigned int> queued, done;
+	Fault fault = Fault::None;
+	std::vector<std::pair<Event, Clock::time_point>> events;
+	std::atomic<bool> stopping{false};
+	std::thread frameThread, replugThread;
+
+	// Every 10 ms, the oldest queued buffer is filled, unless it's stuck
+	void sendFrames() {
+		while (!stopping) {
+			std::this_thread::sleep_for(milliseconds(10));
+			std::lock_guard<std::mutex> guard(lock);
+			bool stuck = fault != Fault::None && fault != Fault::LostBuffers;
+			if (fd < 0 || !streaming || stuck || queued.empty()) continue;
+			unsigned int index = queued.front();
+			queued.pop_front();
+			states[index] = BufferState::Done;
+			done.push_back(index);
+			uint64_t one = 1;
+			if (write(fd, &one, sizeof(one)) < 0) perror("Fake camera: write");
+		}
+	}
+	// Takes back every frame that's waiting. lock must be held.
+	void drain() {
+		uint64_t count;
+		while (fd >= 0 && read(fd, &count, sizeof(count)) > 0);
+		for (unsigned int index : done) {
+			states[index] = BufferState::Queued;
+			queued.push_back(index);
+		}
+		done.clear();
+	}
+	void record(Event event) {
+		// requeueBuffers() asks about every buffer, and only the first counts
+		if (!events.empty() && events.back().first == event) return;
+		events.push_back({ event, Clock::now() });
+	}
+	void breakCamera(Fault newFault) {
+		std::lock_guard<std::mutex> guard(lock);
+		fault = newFault;
+		events.clear();
+		drain();
+		if (fault == Fault::LostBuffers) {
+			// The driver forgets about them, so only giving them back brings frames back
+			for (auto& state : states) state = BufferState::Dequeued;
+			queued.clear();
+		}
+	}
+	int ioctl(unsigned long request, void* arg);
+};
+static FakeCamera camera;
+
+template<typename F> static F real(const char* name) { return (F) dlsym(RTLD_NEXT, name); }
+
+int FakeCamera::ioctl(unsigned long request, void* arg) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto fail = [](int error) { errno = error; return -1; };
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		auto cap = (v4l2_capability*) arg;
+		memset(cap, 0, sizeof(*cap));
+		cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMESIZES: return fail(EINVAL);
+	case VIDIOC_S_FMT: {
+		auto format = (v4l2_format*) arg;
+		width = format->fmt.pix.width; height = format->fmt.pix.height;
+		format->fmt.pix.sizeimage = width * height * 2;
+		return 0;
+	}
+	case VIDIOC_G_PARM: case VIDIOC_S_PARM: case VIDIOC_S_EXT_CTRLS: return 0;
+	case VIDIOC_REQBUFS: {
+		auto request = (v4l2_requestbuffers*) arg;
+		buffers.assign(request->count, std::vector<uint8_t>(width * height * 2));
+		states.assign(request->count, BufferState::Dequeued);
+		queued.clear(); done.clear();
+		return 0;
+	}
+	case VIDIOC_QUERYBUF: {
+		auto buffer = (v4l2_buffer*) arg;
+		if (buffer->index >= buffers.size()) return fail(EINVAL);
+		if (streaming) record(Event::Requeue);
+		buffer->length = buffers[buffer->index].size();
+		buffer->m.offset = buffer->index * buffer->length;
+		buffer->flags = (states[buffer->index] == BufferState::Queued) ? V4L2_BUF_FLAG_QUEUED : (states[buffer->index] == BufferState::Done) ? V4L2_BUF_FLAG_DONE : 0;
+		return 0;
+	}
+	case VIDIOC_QBUF: {
+		auto buffer = (v4l2_buffer*) arg;
+		if (buffer->index >= buffers.size() || states[buffer->index] != BufferState::Dequeued) return fail(EINVAL);
+		states[buffer->index] = BufferState::Queued;
+		queued.push_back(buffer->index);
+		return 0;
+	}
+	case VIDIOC_DQBUF: {
+		auto buffer = (v4l2_buffer*) arg;
+		if (done.empty()) return fail(EAGAIN);
+		uint64_t count;
+		if (read(fd, &count, sizeof(count)) < 0) perror("Fake camera: read");
+		buffer->index = done.front();
+		done.pop_front();
+		states[buffer->index] = BufferState::Dequeued;
+		buffer->length = buffer->bytesused = buffers[buffer->index].size();
+		return 0;
+	}
+	case VIDIOC_STREAMON:
+		streaming = true;
+		return 0;
+	case VIDIOC_STREAMOFF:
+		drain();
+		streaming = false;
+		for (auto& state : states) state = BufferState::Dequeued;
+		queued.clear();
+		record(Event::StreamOff);
+		if (fault == Fault::StuckUntilRestart) fault = Fault::None;
+		return 0;
+	default: return fail(ENOTTY);
+	}
+}
+
+extern "C" int open(const char* path, int flags, ...) {
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	static auto realOpen = real<int (*)(const char*, int, ...)>("open");
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		if (path == camera.devicePath) {
+			if (camera.fd >= 0) {
+				errno = EBUSY;
+				return -1;
+			}
+			camera.fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+			return camera.fd;
+		}
+		if (strcmp(path, "/dev/bus/usb/001/002") == 0) return camera.usbFd = realOpen("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	return realOpen(path, flags, mode);
+}
+// With _FORTIFY_SOURCE, open() with flags that aren't constant comes here
+extern "C" int __open_2(const char* path, int flags) { return open(path, flags); }
+
+extern "C" int close(int fd) {
+	static auto realClose = real<int (*)(int)>("close");
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		if (fd >= 0 && fd == camera.fd) {
+			camera.fd = -1;
+			camera.streaming = false;
+			camera.record(Event::Close);
+			if (camera.fault == Fault::StuckUntilReopen) camera.fault = Fault::None;
+		}
+		if (fd >= 0 && fd == camera.usbFd) camera.usbFd = -1;
+	}
+	return realClose(fd);
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...) noexcept {
+	va_list args;
+	va_start(args, request);
+	void* arg = va_arg(args, void*);
+	va_end(args);
+	static auto realIoctl = real<int (*)(int, unsigned long, ...)>("ioctl");
+	bool fake;
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		if (fd >= 0 && fd == camera.usbFd && request == USBDEVFS_RESET) {
+			camera.record(Event::UsbReset);
+			if (camera.fault == Fault::StuckUntilUsbReset) camera.fault = Fault::None;
+			// The device node comes back a little later, like a real one re-enumerating
+			if (camera.replugThread.joinable()) camera.replugThread.detach();
+			camera.replugThread = std::thread([]() {
+				std::this_thread::sleep_for(milliseconds(100));
+				utimensat(AT_FDCWD, camera.devicePath.c_str(), nullptr, 0);
+			});
+			return 0;
+		}
+		fake = fd >= 0 && fd == camera.fd;
+	}
+	if (fake) return camera.ioctl(request, arg);
+	return realIoctl(fd, request, arg);
+}
+
+extern "C" void* mmap(void* address, size_t length, int protection, int flags, int fd, off_t offset) noexcept {
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		if (fd >= 0 && fd == camera.fd) {
+			size_t index = offset / length;
+			if (index >= camera.buffers.size()) {
+				errno = EINVAL;
+				return MAP_FAILED;
+			}
+			return camera.buffers[index].data();
+		}
+	}
+	static auto realMmap = real<void* (*)(void*, size_t, int, int, int, off_t)>("mmap");
+	return realMmap(address, length, protection, flags, fd, offset);
+}
+
+extern "C" int munmap(void* address, size_t length) noexcept {
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		for (auto& buffer : camera.buffers) if (buffer.data() == address) return 0;
+	}
+	static auto realMunmap = real<int (*)(void*, size_t)>("munmap");
+	return realMunmap(address, length);
+}
+
+// resetUsbDevice() finds the camera's USB device through sysfs, which is pointed at a fake one with busnum and devnum files
+extern "C" char* realpath(const char* path, char* resolved) noexcept {
+	if (resolved && path == "/sys/class/video4linux/" + camera.devicePath.substr(camera.devicePath.find_last_of('/') + 1) + "/device") {
+		strcpy(resolved, camera.usbInterfacePath.c_str());
+		return resolved;
+	}
+	static auto realRealpath = real<char* (*)(const char*, char*)>("realpath");
+	return realRealpath(path, resolved);
+}
+extern "C" char* __realpath_chk(const char* path, char* resolved, size_t) noexcept { return realpath(path, resolved); }
+
+// ---------------- Test -----------------------
+
+static int failures = 0;
+
+static void check(bool passed, const std::string& what) {
+	std::cout << (passed ? "ok: " : "FAILED: ") << what << std::endl;
+	if (!passed) ++failures;
+}
+
+template<typename F> static bool waitFor(F condition, milliseconds timeout) {
+	auto deadline = Clock::now() + timeout;
+	while (!condition()) {
+		if (Clock::now() > deadline) return false;
+		std::this_thread::sleep_for(milliseconds(5));
+	}
+	return true;
+}
+
+static long millisecondsBetween(Clock::time_point from, Clock::time_point to) {
+	return std::chrono::duration_cast<milliseconds>(to - from).count();
+}
+
+/* Checks that every stage up to lastStage started, in order, and that each before it waited its timeout for a frame first.
+** Stages start with: requeueing (asking the driver about a buffer while streaming), STREAMOFF, closing, and the USB reset.
+*/
+static void checkStages(int lastStage, Clock::time_point broken) {
+	static constexpr Event STARTS[RecoveryStats::STAGES] = { Event::Requeue, Event::StreamOff, Event::Close, Event::UsbReset };
+	std::vector<Clock::time_point> starts;
+	{
+		std::lock_guard<std::mutex> guard(camera.lock);
+		unsigned int next = 0;
+		for (int stage = 0; stage <= lastStage; ++stage) {
+			while (next < camera.events.size() && camera.events[next].first != STARTS[stage]) ++next;
+			if (next == camera.events.size()) break;
+			starts.push_back(camera.events[next].second);
+		}
+	}
+	check((int) starts.size() == lastStage + 1, "every stage up to " + std::string(RecoveryStats::STAGE_NAMES[lastStage]) + " ran, in order");
+	if (starts.empty()) return;
+	// The deadline is 3 frame intervals, but no less than 100 ms
+	long detected = millisecondsBetween(broken, starts[0]);
+	check(detected >= 80 && detected < 400, "the stall was noticed in " + std::to_string(detected) + " ms");
+	for (unsigned int stage = 0; stage + 1 < starts.size(); ++stage) {
+		long waited = millisecondsBetween(starts[stage], starts[stage + 1]), timeout = RecoveryStats::STAGE_TIMEOUT_MS[stage];
+		check(waited >= timeout - 10 && waited < timeout + 300,
+			std::string(RecoveryStats::STAGE_NAMES[stage]) + " waited " + std::to_string(waited) + " ms of its " + std::to_string(timeout) + " ms");
+	}
+}
+
+int main() {
+	char directory[] = "/tmp/recoverytest.XXXXXX";
+	if (mkdtemp(directory) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string root = directory;
+	camera.devicePath = root + "/video0";
+	std::ofstream(camera.devicePath).close();
+	// sysfs's layout: the video device's parent is its USB interface, whose parent is the USB device
+	mkdir((root + "/usb").c_str(), 0700);
+	mkdir((root + "/usb/1-1").c_str(), 0700);
+	mkdir((root + "/usb/1-1/1-1:1.0").c_str(), 0700);
+	camera.usbInterfacePath = root + "/usb/1-1/1-1:1.0";
+	std::ofstream(root + "/usb/1-1/busnum") << 1;
+	std::ofstream(root + "/usb/1-1/devnum") << 2;
+	camera.frameThread = std::thread(&FakeCamera::sendFrames, &camera);
+
+	CaptureLoop captureLoop;
+	std::atomic<int> frames{0};
+	{
+		ThreadedVideoReader reader(64, 48, camera.devicePath.c_str(), [&frames]() { ++frames; }, captureLoop);
+		check(waitFor([&]() { return frames > 20; }, milliseconds(3000)), "frames come from the fake camera");
+
+		const Fault faults[RecoveryStats::STAGES] = { Fault::LostBuffers, Fault::StuckUntilRestart, Fault::StuckUntilReopen, Fault::StuckUntilUsbReset };
+		for (int stage = 0; stage < RecoveryStats::STAGES; ++stage) {
+			std::string name = RecoveryStats::STAGE_NAMES[stage];
+			auto broken = Clock::now();
+			camera.breakCamera(faults[stage]);
+			bool recovered = waitFor([&]() { return reader.getRecoveryStats().recovered[stage] == 1; }, milliseconds(10000));
+			check(recovered, name + " recovered it");
+			if (!recovered) continue;
+			checkStages(stage, broken);
+			int before = frames;
+			check(waitFor([&]() { return frames > before + 10; }, milliseconds(1000)), "frames came again after " + name);
+		}
+		RecoveryStats stats = reader.getRecoveryStats();
+		std::cout << stats.format() << std::endl;
+		bool oncePerStage = true;
+		for (int stage = 0; stage < RecoveryStats::STAGES; ++stage) oncePerStage &= stats.recovered[stage] == 1;
+		check(oncePerStage && stats.failed == 0, "RecoveryStats counted each stage once, and no failures");
+		unsigned int timed = 0;
+		for (int bucket = 0; bucket < RecoveryStats::BUCKETS; ++bucket) timed += stats.timeToRecovery[bucket];
+		check(timed == 4, "every recovery's time was recorded");
+		// usbReset only ran after the other three had waited 3.2 s between them
+		check(stats.timeToRecovery[RecoveryStats::BUCKETS - 1] + stats.timeToRecovery[RecoveryStats::BUCKETS - 2] == 1, "usbReset's recovery took over 2.5 s");
+
+		// The fault control message: DQBUF fails, and so does everything requeueing tries, so restart fixes it
+		{
+			std::lock_guard<std::mutex> guard(camera.lock);
+			camera.events.clear();
+		}
+		reader.injectFault(2);
+		check(waitFor([&]() { return reader.getRecoveryStats().recovered[1] == 2; }, milliseconds(3000)), "an injected fault of 2 stages was recovered by restart");
+		stats = reader.getRecoveryStats();
+		check(stats.recovered[0] == 1 && stats.recovered[2] == 1 && stats.recovered[3] == 1 && stats.failed == 0, "and no other stage was counted");
+		int before = frames;
+		check(waitFor([&]() { return frames > before + 10; }, milliseconds(1000)), "frames came again after the injected fault");
+	}
+
+	camera.stopping = true;
+	camera.frameThread.join();
+	if (camera.replugThread.joinable()) camera.replugThread.join();
+	for (auto file : { "/usb/1-1/busnum", "/usb/1-1/devnum", "/video0" }) unlink((root + file).c_str());
+	for (auto subdirectory : { "/usb/1-1/1-1:1.0", "/usb/1-1", "/usb", "" }) rmdir((root + subdirectory).c_str());
+
+	std::cout << (failures ? std::to_string(failures) + " checks failed" : "All checks passed") << std::endl;
+	return failures ? 1 : 0;
+}
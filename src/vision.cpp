@@ -4,9 +4,11 @@
 #include <iostream>
 #include <chrono>
 #include <memory>
+#include <mutex>
 #include <cmath>
 
 #include "GripHexFinder.hpp"
+#include "QuadPose.hpp"
 
 #define PI 3.14159265
 
@@ -15,10 +17,14 @@ using std::cout; using std::endl;
 
 bool isImageTesting = false;
 bool verboseMode = false;
+// Written by the vision thread and read by the stats control message, so both go through visionTimingsLock
+static VisionTimings visionTimings;
+static std::mutex visionTimingsLock;
+grip::HslThresholds visionThresholds;
+TargetModelId visionTarget = TargetModelId::PowerPort;
 
 namespace calib {
-	cv::Mat cameraMatrix, distCoeffs;
-	int width, height;
+	std::shared_ptr<const ResolutionCalibration> current;
 }
 
 
@@ -26,16 +32,8 @@ bool isNanOrInf(double in) {
 	return isnan(in) || isinf(in);
 }
 
-// All the constants
+// All the constants. The targets' are in TargetModels.hpp.
 
-constexpr double inchTapesHeightAboveGround = 6*12 + 9 + 1/4;
-constexpr double inchTapesWidthTop = 3*12 + 3 + 1/4;
-constexpr double inchSideTapesLength = 1*12 + 7 + 5/8;
-constexpr double inchTapesHeight = 1*12 + 5;
-
-const double inchTapesWidthBottom = inchTapesWidthTop
- - 2*sqrt(pow(inchSideTapesLength, 2) - pow(inchTapesHeight, 2));
- 
 // Offsets of the camera from the center of the robot. 
 // TODO: Set me to my actual value!
 constexpr double inchCameraHeightAboveGround = 24; 
@@ -58,7 +56,7 @@ void printContourCorners(ContourCorners corners) {
 }
 
 bool contourCornersVerbose = false;
-ContourCorners getContourCorners(std::vector<cv::Point>& contour) {
+ContourCorners getContourCorners(const cv::Mat& contour) {
 	//std::chrono::steady_clock clock;
 	//auto startTime = clock.now();
 
@@ -173,16 +171,17 @@ bool matContainsNan(cv::Mat& in) {
 	return false;
 }
 
-grip::GripHexFinder oldFinder;
+// Kept between frames, so its buffers are too. Only the vision thread uses it.
+grip::GripHexFinder finder;
 void drawVisionPoints(VisionDrawPoints& toDraw, cv::Mat& image) {
 	// Draw the threshold instead
-	if (false && !oldFinder.GetHslThresholdOutput()->empty()) {
-		oldFinder.GetHslThresholdOutput();
-		assert(oldFinder.GetHslThresholdOutput()->type() == CV_8U);
-		cv::Mat arr[] = { *oldFinder.GetHslThresholdOutput(), *oldFinder.GetHslThresholdOutput() };
+	if (false && !finder.GetHslThresholdOutput()->empty()) {
+		finder.GetHslThresholdOutput();
+		assert(finder.GetHslThresholdOutput()->type() == CV_8U);
+		cv::Mat arr[] = { *finder.GetHslThresholdOutput(), *finder.GetHslThresholdOutput() };
 		cv::merge(arr, 2, image);
 		//cv::Mat bgr;
-		//cv::cvtColor(*oldFinder.GetHslThresholdOutput(), bgr, cv::COLOR_GRAY2BGR);
+		//cv::cvtColor(*finder.GetHslThresholdOutput(), bgr, cv::COLOR_GRAY2BGR);
 		//colorConvertBGR2YUYV(bgr, image);
 	}
 	
@@ -262,19 +261,12 @@ void DrawPoints(std::vector<cv::Point>& toDraw, cv::Mat& drawOn){
     */
 }
 
-void invertPose(cv::Mat& rotation_vector, cv::Mat& translation_vector, cv::Mat& cameraRotationVector, cv::Mat& cameraTranslationVector) {
-	cv::Mat R;
-	cv::Rodrigues(rotation_vector, R);
-	cv::Rodrigues(R.t(),cameraRotationVector);
-	cameraTranslationVector = -R.t()*translation_vector;
-}
-
-// Gets useful values from the output of solvePnP. 
+// Gets useful values from a pose from solveQuadPose(), which is the same as solvePnP's with its rvec turned into a matrix.
 // https://docs.opencv.org/2.4/modules/calib3d/doc/camera_calibration_and_3d_reconstruction.html (old documentation) and https://docs.opencv.org/4.2.0/d9/d0c/group__calib3d.html#ga549c2075fac14829ff4a58bc931c033d (newer, but slightly worse documentation) go into some (insufficent) detail about solvePnP. 
 struct SolvePnpResult {
-	// rvec and tvec are returned from solvePnP. (Go read the above documents and stare at the diagram if you haven't already.) They represent a transform between two coordinate spaces; camera space, and world space. Camera space's origin is at the camera, its x-axis is left, its y-axis is down, and z-axis is outwards. World space is whatever we define it to be in the worldPoints parameter passed to solvePnP.
-	// tvec is a vector in camera space that represents the translation from the origin of camera space to the origin of world space. From there, rvec somehow tells us what direction the axes of world coordinate space points.
-	cv::Mat rvec, tvec;
+	// R and t represent a transform between two coordinate spaces; camera space, and world space. (Go read the above documents and stare at the diagram if you haven't already.) Camera space's origin is at the camera, its x-axis is left, its y-axis is down, and z-axis is outwards. World space is whatever we define it to be in the worldPoints passed to solveQuadPose.
+	// t is a vector in camera space that represents the translation from the origin of camera space to the origin of world space. R's columns are the directions the axes of world space point, in camera space.
+	QuadPose pose;
 	
 	double pixError;
 	
@@ -284,38 +276,37 @@ struct SolvePnpResult {
 	VisionData output;
 	bool valid;
 
-	SolvePnpResult(cv::Mat rvec, cv::Mat tvec, double reprojError,
-	std::vector<cv::Point3f> worldPoints, std::vector<cv::Point2f> imagePoints) :
-	rvec(rvec), tvec(tvec), pixError(reprojError) {
-		assert(tvec.type() == CV_64F && rvec.type() == CV_64F);
-
-		if (matContainsNan(rvec) || matContainsNan (tvec) || isnan(reprojError)) {
+	SolvePnpResult(const QuadPose& pose, double inchTargetHeightAboveGround) : pose(pose), pixError(pose.pixError) {
+		const double (&R)[3][3] = pose.R;
+		const double (&t)[3] = pose.t;
+		if (isnan(t[0]) || isnan(t[1]) || isnan(t[2]) || isnan(R[0][0]) || isnan(pixError)) {
 			std::cerr << "solvePnP returned NaN!\n";
 			valid = false;
 			return;
 		} 
 		
-		// Get the translation in the world coordinate space.
-		cv::Mat rotation, translation;
-		invertPose(rvec, tvec, rotation, translation);
+		// Get the translation in the world coordinate space: the camera is at -R^T t.
+		double translation[3];
+		for (int i = 0; i < 3; ++i) translation[i] = -(R[0][i]*t[0] + R[1][i]*t[1] + R[2][i]*t[2]);
 		
-		inchCameraX = translation.at<double>(0);
-		inchCameraY = translation.at<double>(2);
-		inchHeight = -translation.at<double>(1);
+		inchCameraX = translation[0];
+		inchCameraY = translation[2];
+		inchHeight = -translation[1];
 
-		inchTotalDist = sqrt(pow(tvec.at<double>(0), 2) + pow(tvec.at<double>(1), 2) + pow(tvec.at<double>(2), 2));
+		inchTotalDist = sqrt(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]);
 
-		double inchGroundDistanceFromCamera = sqrt(pow(inchTotalDist, 2) - pow(inchTapesHeightAboveGround - inchCameraHeightAboveGround, 2));
+		double inchHeightDifference = inchTargetHeightAboveGround - inchCameraHeightAboveGround;
+		double inchGroundDistanceFromCamera = sqrt(inchTotalDist*inchTotalDist - inchHeightDifference*inchHeightDifference);
 		
 		// The vector from the camera to a point directly below the target, in a plane parallel to the floor.
-		double inchGroundCameraX = tvec.at<double>(0);
-		double inchGroundCameraY = sqrt(pow(inchGroundDistanceFromCamera, 2) - pow(inchGroundCameraX, 2));
+		double inchGroundCameraX = t[0];
+		double inchGroundCameraY = sqrt(inchGroundDistanceFromCamera*inchGroundDistanceFromCamera - inchGroundCameraX*inchGroundCameraX);
 		
 		// The vector from the robot's center to a point directly below the target, in a plane parallel to the floor.
 		double inchRobotCenterX = inchGroundCameraX + camLocalX;
 		double inchRobotCenterY = inchGroundCameraY + camLocalY;
 				
-		output.distance = sqrt(pow(inchRobotCenterX, 2) + pow(inchRobotCenterY, 2));
+		output.distance = sqrt(inchRobotCenterX*inchRobotCenterX + inchRobotCenterY*inchRobotCenterY);
 		output.robotAngle = -atan2(inchRobotCenterX, inchRobotCenterY);
 
 		// TODO: Make this relative to the robot's center instead of the camera
@@ -323,8 +314,8 @@ struct SolvePnpResult {
 		
 		
 		// These are the old calcualtions that do not consider the camera's offset from the robot's center
-		//output.robotAngle = -asin(tvec.at<double>(0) / output.distance);
-		//output.distance = sqrt(pow(inchTotalDist, 2) - pow(inchTapesHeightAboveGround - inchCameraHeightAboveGround, 2));
+		//output.robotAngle = -asin(t[0] / output.distance);
+		//output.distance = sqrt(pow(inchTotalDist, 2) - pow(inchTargetHeightAboveGround - inchCameraHeightAboveGround, 2));
 		
 		valid = true;	
 	}
@@ -334,39 +325,80 @@ struct SolvePnpResult {
 	}
 };
 
+// For image testing: checks solveQuadPose() against solvePnPGeneric's IPPE on the same points, and times them both
+void compareWithSolvePnp(const double worldPoints[4][2], const cv::Point2f undistortedPoints[4], const ResolutionCalibration& calibration, const QuadPose poses[2]) {
+	std::vector<cv::Point3f> worldPoints3d;
+	for (int i = 0; i < 4; ++i) worldPoints3d.push_back(cv::Point3f(worldPoints[i][0], worldPoints[i][1], 0));
+	std::vector<cv::Point2f> imagePoints(undistortedPoints, undistortedPoints + 4);
+
+	std::vector<double> reprojErrors;
+	std::vector<cv::Mat> rvecs, tvecs;
+	auto solvePnp = [&]() {
+		cv::solvePnPGeneric(worldPoints3d, imagePoints, calibration.cameraMatrix, cv::noArray(),
+		 rvecs, tvecs, false, cv::SOLVEPNP_IPPE, cv::noArray(), cv::noArray(), reprojErrors);
+	};
+	solvePnp();
+	for (unsigned int i = 0; i < std::min<size_t>(2, tvecs.size()); ++i) {
+		cv::Mat R;
+		cv::Rodrigues(rvecs[i], R);
+		double rotationDiff = 0, translationDiff = 0;
+		for (int row = 0; row < 3; ++row) {
+			translationDiff = std::max(translationDiff, fabs(tvecs[i].at<double>(row) - poses[i].t[row]));
+			for (int column = 0; column < 3; ++column) rotationDiff = std::max(rotationDiff, fabs(R.at<double>(row, column) - poses[i].R[row][column]));
+		}
+		cout << "solution " << i << " vs solvePnP: translation diff:" << translationDiff << "in rotation diff:" << rotationDiff
+			<< " err:" << poses[i].pixError << " vs " << reprojErrors.at(i) << endl;
+	}
+
+	constexpr int RUNS = 1000;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < RUNS; ++i) solvePnp();
+	auto middle = std::chrono::steady_clock::now();
+	QuadPose timed[2];
+	int found = 0;
+	for (int i = 0; i < RUNS; ++i) found += solveQuadPose(worldPoints, undistortedPoints, calibration.cameraMatrix.ptr<double>(), timed);
+	auto end = std::chrono::steady_clock::now();
+	cout << "solvePnPGeneric:" << std::chrono::duration<double, std::micro>(middle - start).count() / RUNS << "us"
+		<< " solveQuadPose:" << std::chrono::duration<double, std::micro>(end - middle).count() / RUNS << "us (" << found / RUNS << " solutions)" << endl;
+}
+
 struct ProcessPointsResult {
 	bool success;
 	double pixError;
 	VisionTarget t;
+	// pixError as a fraction of the most that's accepted for a target of this size
+	double relativeError;
+	double hullArea;
 };
-ProcessPointsResult processPoints(ContourCorners trapezoid,
+template<typename Model> ProcessPointsResult processPoints(ContourCorners trapezoid,
  int pixImageWidth, int pixImageHeight) {
 
 	// There might be a bug in openCV that would require the focal length to be multiplied by 2.
 	// Test this.
 
-	// world coords: (0, 0, 0) at bottom center of tapes
-	// up and right are positive. y-axis is vertical.
-	std::vector<cv::Point3f> worldPoints = {
-		cv::Point3f(-inchTapesWidthTop/2, inchTapesHeight, 0),
-		cv::Point3f(inchTapesWidthTop/2, inchTapesHeight, 0),
-		cv::Point3f(-inchTapesWidthBottom/2, 0, 0),
-		cv::Point3f(inchTapesWidthBottom/2, 0, 0),
-	};
-	std::vector<cv::Point2f> imagePoints = {
+	cv::Point2f imagePoints[4] = {
 		trapezoid.topleft, trapezoid.topright, trapezoid.bottomleft, trapezoid.bottomright
 	};
 
-	std::vector<double> reprojErrors;
-	std::vector<cv::Mat> rvecs, tvecs;
-	cv::solvePnPGeneric(worldPoints, imagePoints, calib::cameraMatrix, calib::distCoeffs,
-	 rvecs, tvecs, false, cv::SOLVEPNP_IPPE, cv::noArray(), cv::noArray(), reprojErrors);
-	 
-	// SOLVEPNP_IPPE returns up to 2 results.
-	SolvePnpResult result1(rvecs[0], tvecs[0], reprojErrors.at(0), worldPoints, imagePoints);
-	SolvePnpResult result2(rvecs[1], tvecs[1], reprojErrors.at(1), worldPoints, imagePoints);
+	// Undistorting the corners here, from the calibration's table, is much cheaper than letting solvePnP iterate on them
+	const ResolutionCalibration& calibration = *calib::current;
+	cv::Point2f undistortedPoints[4];
+	for (int i = 0; i < 4; ++i) undistortedPoints[i] = calibration.undistort(imagePoints[i]);
+
+	// IPPE, like solvePnPGeneric's SOLVEPNP_IPPE, but without allocating anything
+	QuadPose poses[2];
+	if (solveQuadPose(Model::worldPoints, undistortedPoints, calibration.cameraMatrix.ptr<double>(), poses) < 2) {
+		if (verboseMode) std::cout << "degenerate corners" << std::endl;
+		return { false, {}};
+	}
+	if (isImageTesting) compareWithSolvePnp(Model::worldPoints, undistortedPoints, calibration, poses);
+
+	// It returns 2 results, sorted by reprojection error.
+	SolvePnpResult result1(poses[0], Model::inchHeightAboveGround);
+	SolvePnpResult result2(poses[1], Model::inchHeightAboveGround);
 	
 	SolvePnpResult* resultUsing = nullptr;
+	double pixMaxError = std::max(3.0, (trapezoid.topright.x - trapezoid.topleft.x + trapezoid.bottomright.y - trapezoid.topleft.y) / 2.0 / 12.0);
 	
 	if (!result1.valid) {
 		resultUsing = &result2;
@@ -375,17 +407,8 @@ ProcessPointsResult processPoints(ContourCorners trapezoid,
 		resultUsing = &result1;
 	}
 	else {
-		// solvePnpGeneric sorts results by reprojection error
-		//assert(result1.pixError <= result2.pixError);
-		if (result1.pixError > result2.pixError) {
-			std::cerr << "SolvePNP results BACKWARDS!" << std::endl;
-			std::swap(result1, result2);
-		}
-		
-		double pixMaxError = std::max(3.0, (trapezoid.topright.x - trapezoid.topleft.x + trapezoid.bottomright.y - trapezoid.topleft.y) / 2.0 / 12.0);
-		
-		if (verboseMode) std::cout << "result1: err:" << result1.pixError << " x:" << result1.tvec.at<double>(0) << " y:" << result1.tvec.at<double>(1) << " z:" << result1.tvec.at<double>(2) << "\n"
-			<< "result2: err:" << result1.pixError << " x:" << result2.tvec.at<double>(0) << " y:" << result2.tvec.at<double>(1) << " z:" << result2.tvec.at<double>(2) << "\n"
+		if (verboseMode) std::cout << "result1: err:" << result1.pixError << " x:" << result1.pose.t[0] << " y:" << result1.pose.t[1] << " z:" << result1.pose.t[2] << "\n"
+			<< "result2: err:" << result2.pixError << " x:" << result2.pose.t[0] << " y:" << result2.pose.t[1] << " z:" << result2.pose.t[2] << "\n"
 			<< "maxError:" << pixMaxError << std::endl;
 
 		if (result1.pixError > pixMaxError) return { false, {}};
@@ -401,14 +424,7 @@ ProcessPointsResult processPoints(ContourCorners trapezoid,
 	}
 	
 	if(verboseMode) std::cout << "  Using:" << ((resultUsing == &result1) ? "result1" : "result2") << std::endl;
-
-
-	auto rsize = resultUsing->rvec.size();
-	auto tsize = resultUsing->tvec.size();
-	if (!(rsize == cv::Size(1, 3) || rsize == cv::Size(3, 1)) && (tsize == cv::Size(1, 3) || tsize == cv::Size(3, 1))) {
-		std::cerr << "SolvePnP returned stuff with wrong sizes" << std::endl;
-		return { false, {}};
-	}
+	if (!resultUsing->valid) return { false, {}};
 
 /*
 	VisionData result;
@@ -426,7 +442,7 @@ ProcessPointsResult processPoints(ContourCorners trapezoid,
 	//if (radReferencePitch > M_PI_2) radReferencePitch = M_PI - radReferencePitch;
 	
 	VisionDrawPoints draw;
-	std::copy(imagePoints.begin(), imagePoints.end(), draw.contour);
+	std::copy(imagePoints, imagePoints + 4, draw.contour);
 	/*
 	constexpr float CROSSHAIR_LENGTH = 4,
 	 FLOOROUT_LENGTH = 33,
@@ -450,62 +466,127 @@ ProcessPointsResult processPoints(ContourCorners trapezoid,
 	});
 	
 	cv::Mat projPoints;
-	cv::projectPoints(worldPoints, resultUsing->rvec, resultUsing->tvec, calib::cameraMatrix, calib::distCoeffs, projPoints);
+	cv::projectPoints(worldPoints, resultUsing->rvec, resultUsing->tvec, calibration.cameraMatrix, calibration.distCoeffs, projPoints);
 	assert(projPoints.type() == CV_32FC2);
 	std::copy(projPoints.begin<cv::Point2f>(), projPoints.end<cv::Point2f>(), draw.points + 8);
 	
 	if (isImageTesting) showDebugPoints(draw);*/
 	
-	return { true, resultUsing->pixError, { resultUsing->output, draw }};
+	return { true, resultUsing->pixError, { resultUsing->output, draw }, resultUsing->pixError / pixMaxError };
 }
 
 
 
-VisionTarget doVision(cv::Mat image) {
+// How much each part of a candidate's score counts. They add up to 1.
+constexpr double ERROR_WEIGHT = 0.4, SIZE_WEIGHT = 0.3, CONSISTENCY_WEIGHT = 0.3;
+// A candidate this far from last frame's best target (in radians of robotAngle, or as a fraction of distance) gets about a third of the consistency score.
+constexpr double CONSISTENT_ANGLE = 0.1, CONSISTENT_DISTANCE = 0.2;
+// Last frame's best target is forgotten after this many frames without one
+constexpr int FRAMES_REMEMBERED = 15;
+
+VisionTarget lastBest;
+int framesSinceBest = FRAMES_REMEMBERED;
+
+// Scores every candidate, and returns the best ones, best first.
+VisionResults rankTargets(std::vector<ProcessPointsResult>& candidates) {
+	double largestArea = 0;
+	for (auto& candidate : candidates) largestArea = std::max(largestArea, candidate.hullArea);
+
+	for (auto& candidate : candidates) {
+		double errorScore = 1 - std::min(1.0, candidate.relativeError);
+		// Bigger contours are closer, and have less noise in their corners
+		double sizeScore = (largestArea > 0) ? candidate.hullArea / largestArea : 0;
+		// A target that jumps around between frames is probably something else
+		double consistencyScore = 0.5;
+		if (framesSinceBest < FRAMES_REMEMBERED) {
+			double angleChange = fabs(candidate.t.calcs.robotAngle - lastBest.calcs.robotAngle) / CONSISTENT_ANGLE;
+			double distanceChange = fabs(candidate.t.calcs.distance - lastBest.calcs.distance) / (CONSISTENT_DISTANCE * lastBest.calcs.distance);
+			consistencyScore = exp(-(angleChange + distanceChange));
+		}
+		candidate.t.score = ERROR_WEIGHT*errorScore + SIZE_WEIGHT*sizeScore + CONSISTENCY_WEIGHT*consistencyScore;
+		if (verboseMode) std::cout << "candidate distance: " << candidate.t.calcs.distance << " error: " << errorScore << " size: " << sizeScore << " consistency: " << consistencyScore << " score: " << candidate.t.score << std::endl;
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const ProcessPointsResult& a, const ProcessPointsResult& b) {
+		return a.t.score > b.t.score;
+	});
+
+	VisionResults ranked;
+	ranked.count = std::min<size_t>(candidates.size(), VisionResults::MAX_TARGETS);
+	for (unsigned int i = 0; i < ranked.count; ++i) ranked.targets[i] = candidates[i].t;
+
+	if (ranked.found()) {
+		lastBest = ranked.best();
+		framesSinceBest = 0;
+	}
+	else if (framesSinceBest < FRAMES_REMEMBERED) ++framesSinceBest;
+	return ranked;
+}
+
+// Averages a stage's time into visionTimings
+void addTiming(double& average, std::chrono::steady_clock::duration time) {
+	std::lock_guard<std::mutex> lock(visionTimingsLock);
+	average += (std::chrono::duration<double, std::milli>(time).count() - average) * 0.1;
+}
+
+VisionTimings getVisionTimings() {
+	std::lock_guard<std::mutex> lock(visionTimingsLock);
+	return visionTimings;
+}
+
+// doVision() for one target model. Everything about the model is a constant in here.
+template<typename Model> VisionResults findTargets(cv::Mat image) {
 	if (isImageTesting) debugDrawImage = &image;
+	auto startTime = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration cornersTime(0), pnpTime(0);
 
-    grip::GripHexFinder finder;
+    finder.thresholds = visionThresholds;
     finder.Process(image);
-	oldFinder = finder;
+	addTiming(visionTimings.pipeline, std::chrono::steady_clock::now() - startTime);
 
-    //convert lines to contours
-    std::vector<std::vector<cv::Point>>& hulls=*(finder.GetConvexHullsOutput());
-	assert(hulls.size() == finder.GetFindContoursOutput()->size());
+    //contours, their hulls, and the hulls' areas and bounds
+    ContourStore& contours=*(finder.GetContoursOutput());
     
-    if (verboseMode) cout << "Found " << hulls.size() << " contours" << std::endl; 
+    if (verboseMode) cout << "Found " << contours.size() << " contours" << std::endl; 
 	
-	std::vector<ProcessPointsResult> results;   
-    for(unsigned i = 0; i < hulls.size(); ++i){
+	// Kept between frames, like the contours
+	static std::vector<ProcessPointsResult> results;
+	results.clear();
+    for(unsigned i = 0; i < contours.size(); ++i){
        //filter out contours that don't make sense
 
         //ensure contour area is at least a certain percent of the image
         double imageArea = image.rows*image.cols;
-        double hullArea = cv::contourArea(hulls[i]);
+        double hullArea = contours.hullArea[i];
         double contPerc = hullArea/imageArea;
-		double areaRatio = cv::contourArea((*finder.GetFindContoursOutput())[i])/hullArea;
+		double areaRatio = contours.area[i]/hullArea;
 		if (verboseMode) std::cout << "For contour " << i << " contPerc:" << contPerc << " areaRatio:" << areaRatio << std::endl;
-		// Ideal areaRatio is about 11%
-        if(hulls[i].size() > 4 && contPerc > 0.01 && areaRatio <= 0.3){
+		const cv::Rect& bounds = contours.hullBounds[i];
+		double aspect = bounds.width / (double) std::max(1, bounds.height);
+        if(contours.hullLength[i] >= 4 && contPerc > Model::minImageFraction && areaRatio >= Model::minFillRatio && areaRatio <= Model::maxFillRatio
+         && aspect >= Model::minAspect && aspect <= Model::maxAspect){
 			if (verboseMode) std::cout << "using contour " << i << std::endl;
-            ContourCorners corners = getContourCorners(hulls[i]);
-			if (!corners.valid) break;
-            std::vector<cv::Point2f> cornerPoints;
-            cornerPoints.push_back(corners.topleft); cornerPoints.push_back(corners.topright);
-            cornerPoints.push_back(corners.bottomleft);cornerPoints.push_back(corners.bottomright);
-            sort(cornerPoints.begin(), cornerPoints.end(), 
+            auto cornersStart = std::chrono::steady_clock::now();
+            ContourCorners corners = getContourCorners(contours.hull(i));
+            cornersTime += std::chrono::steady_clock::now() - cornersStart;
+			if (!corners.valid) continue;
+            cv::Point2f cornerPoints[4] = { corners.topleft, corners.topright, corners.bottomleft, corners.bottomright };
+            std::sort(cornerPoints, cornerPoints + 4, 
                 [](const cv::Point& a, const cv::Point& b) -> bool{
                     return a.y > b.y;
                 });
             
             double topAng = abs(atan((cornerPoints[0].y - cornerPoints[1].y)/(cornerPoints[0].x - cornerPoints[1].x))) * 180.0 / PI;
             double botAng = abs(atan((cornerPoints[2].y - cornerPoints[3].y)/(cornerPoints[2].x - cornerPoints[3].x))) * 180.0 / PI;
-            if(topAng < 15.0 && botAng < 15.0){
+            if(topAng < Model::maxEdgeAngle && botAng < Model::maxEdgeAngle){
                 //if(){
                     //the top and bottoms are relatively aligned (within 10 pixels)
                          
                     try { 
-                        auto result = processPoints(corners, image.cols, image.rows);
+                        auto pnpStart = std::chrono::steady_clock::now();
+                        auto result = processPoints<Model>(corners, image.cols, image.rows);
+                        pnpTime += std::chrono::steady_clock::now() - pnpStart;
                         if(result.success){
+                            result.hullArea = hullArea;
                             results.push_back(result);
                         }
                     } catch(const cv::Exception& e){
@@ -520,7 +601,35 @@ VisionTarget doVision(cv::Mat image) {
             }
         }
     }
-	// TODO: In the rare case that there's more than one result, choose which one to return
-    if (results.size() > 0) return results[0].t;
-	else return {};
+	VisionResults ranked = rankTargets(results);
+	addTiming(visionTimings.corners, cornersTime);
+	addTiming(visionTimings.pnp, pnpTime);
+	addTiming(visionTimings.total, std::chrono::steady_clock::now() - startTime);
+	return ranked;
+}
+
+VisionResults doVision(cv::Mat image) {
+	switch (visionTarget) {
+	case TargetModelId::Stronghold: return findTargets<StrongholdTarget>(image);
+	case TargetModelId::CalibrationBoard: return findTargets<CalibrationBoardTarget>(image);
+	case TargetModelId::PowerPort: default: return findTargets<PowerPortTarget>(image);
+	}
+}
+
+const char* targetModelName(TargetModelId model) {
+	switch (model) {
+	case TargetModelId::Stronghold: return StrongholdTarget::name;
+	case TargetModelId::CalibrationBoard: return CalibrationBoardTarget::name;
+	case TargetModelId::PowerPort: default: return PowerPortTarget::name;
+	}
+}
+
+bool parseTargetModel(const std::string& name, TargetModelId& model) {
+	for (TargetModelId id : { TargetModelId::PowerPort, TargetModelId::Stronghold, TargetModelId::CalibrationBoard }) {
+		if (name == targetModelName(id)) {
+			model = id;
+			return true;
+		}
+	}
+	return false;
 }
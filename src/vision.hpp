@@ -3,6 +3,10 @@
 #include <opencv2/core.hpp>
 #include <opencv2/core/mat.hpp>
 
+#include "GripHexFinder.hpp"
+#include "CalibrationStore.hpp"
+#include "TargetModels.hpp"
+
 // Angles are in radians, distances are in inches.
 struct VisionData {
 	// distance along the floor to the a point directly below the targets.
@@ -35,16 +39,45 @@ void DrawPoints(std::vector<cv::Point>& toDraw, cv::Mat& drawOn);
 struct VisionTarget {
 	VisionData calcs;
 	VisionDrawPoints drawPoints;
+	// 0 to 1: how likely this is to be the real target, from its reprojection error, its size, and how close it is to last frame's best target.
+	float score = 0;
+};
+
+// Every target found in a frame, best first, so that the robot can choose when there's more than one.
+struct VisionResults {
+	static constexpr unsigned int MAX_TARGETS = 4;
+	unsigned int count = 0;
+	VisionTarget targets[MAX_TARGETS];
+	bool found() const { return count > 0; }
+	const VisionTarget& best() const { return targets[0]; }
 };
 
 // The main vision processing function, which processes a single frame.
-VisionTarget doVision(cv::Mat image);
+VisionResults doVision(cv::Mat image);
+
+// How long each stage of doVision() takes, in milliseconds, averaged over about the last 10 frames. For the stats control message.
+struct VisionTimings {
+	double pipeline = 0; // The GRIP pipeline: thresholding, finding contours and their hulls
+	double corners = 0; // Fitting quadrilaterals to the contours
+	double pnp = 0; // Solving the pose (solveQuadPose) of each candidate
+	double total = 0;
+};
+// A copy of the latest timings, safe to take from any thread while doVision() is running
+VisionTimings getVisionTimings();
 //std::vector<cv::Point> doVision(cv::Mat image);
 
 extern bool isImageTesting;
 extern bool verboseMode;
 
+// Thresholds for finding the tapes. Only the vision thread may change these (between frames), like calib.
+extern grip::HslThresholds visionThresholds;
+// Which target model doVision() looks for. Only the vision thread may change it (between frames), too.
+extern TargetModelId visionTarget;
+const char* targetModelName(TargetModelId model);
+// From its name, e.g. "powerPort". Returns false if there's no model called that.
+bool parseTargetModel(const std::string& name, TargetModelId& model);
+
 namespace calib {
-	extern cv::Mat cameraMatrix, distCoeffs;
-	extern int width, height;
+	// The vision camera's calibration at the resolution it's running at, from a CalibrationStore
+	extern std::shared_ptr<const ResolutionCalibration> current;
 }
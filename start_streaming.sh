@@ -1,6 +1,8 @@
 #!/bin/sh
 
 if [ -z "$BITRATE" ]; then BITRATE=1000000; fi
+# For the pi's PerCamera output mode: which cameras to show, e.g. CAMERAS="0 1", each in its own window.
+# Unset receives the single composite stream.
 
 # Collect any residual packets in the queue before launching GStreamer
 timeout 1 nc -ul4 5809 &
@@ -19,12 +21,48 @@ fi
 # trap SIGINT so it's sent to both gstreamer and nc
 trap "kill -TERM -$$" SIGINT
 
-echo $BITRATE | nc $PI_ADDR 5807 &
-    $GST_COMMAND udpsrc port=5809 caps="application/x-rtp, payload=96, clock-rate=90000" ! rtpssrcdemux ! application/x-rtp, payload=96, clock-rate=90000, media=video, encoding-name=H264 ! rtpjitterbuffer latency=50 mode=slave ! rtph264depay ! avdec_h264 ! autovideosink sync=false &
+RTP_CAPS="application/x-rtp, payload=96, clock-rate=90000, media=video, encoding-name=H264"
+
+# The pi's adaptive bitrate needs receiver reports, which rtpstat sends (build it with the command at the top of rtpstat.cpp).
+# It needs the stream's port to see the packets, so it passes them on to GStreamer at the next one. Without it, the stream stays at BITRATE.
+if [ -z "$RTPSTAT" ]; then RTPSTAT="$(dirname "$0")/rtpstat"; fi
+RTP_PORT=5809
+if [ -x "$RTPSTAT" ]; then RTP_PORT=5810; fi
+
+if [ -n "$CAMERAS" ]; then
+    # gst-launch only links rtpssrcdemux's first stream unless its pads are named, so each camera gets a branch on the pad for its SSRC
+    # (Streamer::CAMERA_SSRC_BASE + camera number). Unsubscribe from cameras that aren't listed, since their packets have nowhere to go.
+    PIPELINE="udpsrc port=$RTP_PORT caps=\"application/x-rtp, payload=96, clock-rate=90000\" ! rtpssrcdemux name=demux"
+    for CAMERA in $CAMERAS; do
+        PIPELINE="$PIPELINE demux.src_$((0x57080000 + CAMERA)) ! \"$RTP_CAPS\" ! rtpjitterbuffer latency=50 mode=slave ! rtph264depay ! avdec_h264 ! autovideosink sync=false"
+    done
+    eval $GST_COMMAND $PIPELINE &
+    # The pi remembers subscriptions between runs, so the listed cameras are subscribed to again, and the rest (up to Streamer::MAX_CAMERAS) dropped.
+    # Cameras that aren't plugged in just answer INVALID CAMERA NO.
+    SUBSCRIPTIONS=""
+    for CAMERA in 0 1 2 3; do
+        case " $CAMERAS " in
+            *" $CAMERA "*) SUBSCRIPTIONS="${SUBSCRIPTIONS}subscribe:$CAMERA\n" ;;
+            *) SUBSCRIPTIONS="${SUBSCRIPTIONS}unsubscribe:$CAMERA\n" ;;
+        esac
+    done
+    printf "$SUBSCRIPTIONS" | nc $PI_ADDR 5805 > /dev/null &
+else
+    $GST_COMMAND udpsrc port=$RTP_PORT caps="application/x-rtp, payload=96, clock-rate=90000" ! rtpssrcdemux ! application/x-rtp, payload=96, clock-rate=90000, media=video, encoding-name=H264 ! rtpjitterbuffer latency=50 mode=slave ! rtph264depay ! avdec_h264 ! autovideosink sync=false &
+fi
     # Uncomment for tunneled streaming
     # $GST_COMMAND tcpserversrc port=5809 ! gdpdepay ! rtph264depay ! avdec_h264 ! autovideosink sync=false &
 #else
 #    echo "Could not connect to rPi"
 #    exit 1
 #fi
+
+if [ -x "$RTPSTAT" ]; then
+    # It asks the pi to start streaming, like the nc below, once the residual packet collectors have let go of the port
+    sleep 1
+    "$RTPSTAT" -b $BITRATE -f $RTP_PORT $PI_ADDR > /dev/null &
+else
+    echo "rtpstat isn't built, so the bitrate won't adapt to the connection"
+    echo $BITRATE | nc $PI_ADDR 5807 &
+fi
 wait
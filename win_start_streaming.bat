@@ -1,2 +1,3 @@
 cd "%~dp0"
+REM The script runs rtpstat for the adaptive bitrate, if it has been built in WSL (see README.md)
 wsl.exe ./start_streaming.sh
\ No newline at end of file